@@ -0,0 +1,315 @@
+//
+//  benchmark.cpp
+//  libProfiler
+//
+//  Measures the cost of the profiler itself and writes the results as JSON on
+//  stdout, so runs can be compared between releases:
+//  - threads:   ns per PROFILER_START/PROFILER_END pair with 1 to N threads
+//               recording at the same time. Should stay flat as threads are added.
+//  - depth:     ns per pair when pairs are nested that deep
+//  - sites:     ns per pair when a section calls that many distinct sites in turn
+//  - recursion: ns per pair for a function calling itself that deep
+//  - sampled:   ns per call of a PROFILER_START_SAMPLED section, 1 in 16 and adaptive
+//  - report:    ms for LogProfiler on a tree of 10k and 100k contexts
+//  - lock:      ns per uncontended lock/unlock of a std::mutex, plain and in a
+//               ZProfilerMutex
+//
+//  cmake -S . -B build && cmake --build build && ./build/benchmark > bench.json
+//  ./benchmark [-threads N] [-pairs N] [-timeline] [-aggregate] [-perf]
+//
+//  -timeline also records every pair in the timeline ring buffers, -aggregate
+//  queues times to the aggregation thread instead of updating the stats in
+//  PROFILER_END, and -perf reads the perf_event_open counters in every pair.
+//
+
+#include <stdlib.h>
+#include <thread>
+#include <chrono>
+
+void benchPrintf( const char *szText )
+{
+    (void)szText;
+}
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_IMPLEMENTATION
+#define LIB_PROFILER_PRINTF benchPrintf
+#include "libProfiler.h"
+
+
+typedef std::chrono::steady_clock benchClock;
+
+static double nsSince(benchClock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(benchClock::now() - start).count();
+}
+
+// Sites created at run time, for as many distinct sites as needed
+static std::vector<ZProfilerSite*> sites;
+
+static void makeSites(size_t count)
+{
+    while (sites.size() < count)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "BenchSite%u", (unsigned int)sites.size());
+        sites.push_back(new ZProfilerSite(strdup(name), __FILE__, __LINE__));
+    }
+}
+
+static void benchThread(long pairs, double *nsPerPair)
+{
+    benchClock::time_point start = benchClock::now();
+    for (long i = 0; i < pairs; i++)
+    {
+        PROFILER_START(BenchSection);
+        PROFILER_END();
+    }
+    *nsPerPair = nsSince(start) / double(pairs);
+}
+
+static double benchDepth(long pairs, int depth)
+{
+    long loops = pairs / depth;
+    benchClock::time_point start = benchClock::now();
+    for (long i = 0; i < loops; i++)
+    {
+        for (int d = 0; d < depth; d++)
+            Zprofiler_start(sites[d]->id);
+        for (int d = 0; d < depth; d++)
+            Zprofiler_end();
+    }
+    return nsSince(start) / double(loops * depth);
+}
+
+static double benchSites(long pairs, int count)
+{
+    PROFILER_START(BenchSites);
+    benchClock::time_point start = benchClock::now();
+    for (long i = 0; i < pairs; i++)
+    {
+        Zprofiler_start(sites[i % count]->id);
+        Zprofiler_end();
+    }
+    double ns = nsSince(start) / double(pairs);
+    PROFILER_END();
+    return ns;
+}
+
+static void recurse(int depth)
+{
+    PROFILER_START(BenchRecursion);
+    if (depth > 1)
+        recurse(depth - 1);
+    PROFILER_END();
+}
+
+static double benchRecursion(long pairs, int depth)
+{
+    long loops = pairs / depth;
+    benchClock::time_point start = benchClock::now();
+    for (long i = 0; i < loops; i++)
+        recurse(depth);
+    return nsSince(start) / double(loops * depth);
+}
+
+static double benchSampled(long pairs, unsigned int period)
+{
+    static ZProfilerSite site("BenchSampled", __FILE__, __LINE__);
+    site.samplePeriod = period;
+    benchClock::time_point start = benchClock::now();
+    for (long i = 0; i < pairs; i++)
+    {
+        Zprofiler_start_sampled(&site);
+        Zprofiler_end();
+    }
+    return nsSince(start) / double(pairs);
+}
+
+// A tree of outer + outer * inner contexts
+static void buildContexts(int outer, int inner)
+{
+    for (int a = 0; a < outer; a++)
+    {
+        Zprofiler_start(sites[a]->id);
+        for (int b = 0; b < inner; b++)
+        {
+            Zprofiler_start(sites[(a + 1 + b) % sites.size()]->id);
+            Zprofiler_end();
+        }
+        Zprofiler_end();
+    }
+}
+
+static double benchReport(int outer, int inner)
+{
+    PROFILER_DISABLE;
+    PROFILER_ENABLE;
+    std::thread(buildContexts, outer, inner).join();
+
+    benchClock::time_point start = benchClock::now();
+    LogProfiler();
+    return nsSince(start) * 1e-6;
+}
+
+static double benchLock(long pairs, bool profiled)
+{
+    static std::mutex plain;
+    static ZProfilerMutex<std::mutex> lock("BenchLock");
+    PROFILER_START(BenchLock);
+    benchClock::time_point start = benchClock::now();
+    for (long i = 0; i < pairs; i++)
+    {
+        if (profiled)
+        {
+            lock.lock();
+            lock.unlock();
+        }
+        else
+        {
+            plain.lock();
+            plain.unlock();
+        }
+    }
+    double ns = nsSince(start) / double(pairs);
+    PROFILER_END();
+    return ns;
+}
+
+int main(int argc, const char * argv[])
+{
+    int maxThreads = (int)std::thread::hardware_concurrency();
+    long pairs = 1000000;
+    bool timeline = false, aggregate = false, perf = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            maxThreads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-pairs") && i + 1 < argc)
+            pairs = atol(argv[++i]);
+        else if (!strcmp(argv[i], "-timeline"))
+            timeline = true;
+        else if (!strcmp(argv[i], "-aggregate"))
+            aggregate = true;
+        else if (!strcmp(argv[i], "-perf"))
+            perf = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-threads N] [-pairs N] [-timeline] [-aggregate] [-perf]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (maxThreads < 1)
+        maxThreads = 1;
+    if (pairs < 1000)
+        pairs = 1000;
+
+    PROFILER_ENABLE;
+
+    if (timeline)
+        Zprofiler_enable_timeline(1<<20, PROFILER_TIMELINE_OVERWRITE);
+    if (aggregate)
+        Zprofiler_enable_aggregation(1<<16, PROFILER_AGGREGATION_DROP);
+    int perfMode = perf ? Zprofiler_enable_perf_counters() : PROFILER_PERF_NONE;
+
+    makeSites(1000);
+
+    printf("{\n\"version\":1,\n");
+    printf("\"ticksPerSecond\":%.0f,\n", gProfilerTicksPerSecond);
+    printf("\"overheadNs\":%.2f,\n", ZprofilerTicksToMs(1) * gProfilerOverheadTicks * 1e6);
+    printf("\"options\":{\"pairs\":%ld,\"timeline\":%s,\"aggregate\":%s,\"perf\":\"%s\"},\n", pairs, timeline ? "true" : "false", aggregate ? "true" : "false",
+           perfMode == PROFILER_PERF_HARDWARE ? "hardware" : (perfMode == PROFILER_PERF_SOFTWARE ? "software" : "none"));
+
+    printf("\"threads\":[");
+    for (int threadCount = 1; threadCount <= maxThreads; threadCount++)
+    {
+        std::vector<std::thread> threads;
+        std::vector<double> nsPerPair(threadCount);
+
+        benchClock::time_point start = benchClock::now();
+        for (int i = 0; i < threadCount; i++)
+            threads.push_back(std::thread(benchThread, pairs, &nsPerPair[i]));
+        for (int i = 0; i < threadCount; i++)
+            threads[i].join();
+        double seconds = nsSince(start) * 1e-9;
+
+        double avg = 0, worst = 0;
+        for (int i = 0; i < threadCount; i++)
+        {
+            avg += nsPerPair[i];
+            worst = std::max(worst, nsPerPair[i]);
+        }
+        avg /= threadCount;
+
+        printf("%s\n  {\"threads\":%d,\"nsPerPair\":%.2f,\"nsPerPairWorst\":%.2f,\"mpairsPerSecond\":%.2f}",
+               threadCount > 1 ? "," : "", threadCount, avg, worst, double(pairs) * threadCount / seconds * 1e-6);
+        fprintf(stderr, "threads %d: %.2f ns/pair\n", threadCount, avg);
+    }
+    printf("\n],\n");
+
+    static const int depths[] = { 1, 4, 16, 64, 256 };
+    printf("\"depth\":[");
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+    {
+        double ns = benchDepth(pairs, depths[i]);
+        printf("%s\n  {\"depth\":%d,\"nsPerPair\":%.2f}", i ? "," : "", depths[i], ns);
+        fprintf(stderr, "depth %d: %.2f ns/pair\n", depths[i], ns);
+    }
+    printf("\n],\n");
+
+    static const int siteCounts[] = { 1, 10, 100, 1000 };
+    printf("\"sites\":[");
+    for (size_t i = 0; i < sizeof(siteCounts) / sizeof(siteCounts[0]); i++)
+    {
+        double ns = benchSites(pairs, siteCounts[i]);
+        printf("%s\n  {\"sites\":%d,\"nsPerPair\":%.2f}", i ? "," : "", siteCounts[i], ns);
+        fprintf(stderr, "sites %d: %.2f ns/pair\n", siteCounts[i], ns);
+    }
+    printf("\n],\n");
+
+    static const int recursionDepths[] = { 4, 64, 1024 };
+    printf("\"recursion\":[");
+    for (size_t i = 0; i < sizeof(recursionDepths) / sizeof(recursionDepths[0]); i++)
+    {
+        double ns = benchRecursion(pairs, recursionDepths[i]);
+        printf("%s\n  {\"depth\":%d,\"nsPerPair\":%.2f}", i ? "," : "", recursionDepths[i], ns);
+        fprintf(stderr, "recursion %d: %.2f ns/pair\n", recursionDepths[i], ns);
+    }
+    printf("\n],\n");
+
+    static const unsigned int periods[] = { 1, 16, PROFILER_SAMPLING_ADAPTIVE };
+    printf("\"sampled\":[");
+    for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+    {
+        double ns = benchSampled(pairs, periods[i]);
+        printf("%s\n  {\"period\":%u,\"nsPerCall\":%.2f}", i ? "," : "", periods[i], ns);
+        if (periods[i] == PROFILER_SAMPLING_ADAPTIVE)
+            fprintf(stderr, "sampled adaptive: %.2f ns/call\n", ns);
+        else
+            fprintf(stderr, "sampled 1/%u: %.2f ns/call\n", periods[i], ns);
+    }
+    printf("\n],\n");
+
+    // outer + outer * inner contexts
+    static const int reportTrees[][2] = { { 100, 99 }, { 1000, 99 } };
+    printf("\"report\":[");
+    for (size_t i = 0; i < sizeof(reportTrees) / sizeof(reportTrees[0]); i++)
+    {
+        int contexts = reportTrees[i][0] * (1 + reportTrees[i][1]);
+        double ms = benchReport(reportTrees[i][0], reportTrees[i][1]);
+        printf("%s\n  {\"contexts\":%d,\"ms\":%.2f}", i ? "," : "", contexts, ms);
+        fprintf(stderr, "report %d contexts: %.2f ms\n", contexts, ms);
+    }
+    printf("\n],\n");
+
+    double plainNs = benchLock(pairs, false);
+    double profiledNs = benchLock(pairs, true);
+    printf("\"lock\":{\"nsPerPairPlain\":%.2f,\"nsPerPair\":%.2f}\n}\n", plainNs, profiledNs);
+    fprintf(stderr, "lock: %.2f ns/pair, %.2f ns/pair plain\n", profiledNs, plainNs);
+
+    Zprofiler_disable_aggregation();
+    Zprofiler_disable_perf_counters();
+    PROFILER_DISABLE;
+
+    return 0;
+}
@@ -110,29 +110,41 @@
 // Hello, World!
 // v = -1530.3564
 // v = -190.7513
+// Profiler:Profiler overhead: 52.6 ns per section, 24.1 ns of it measured by the section itself. Both are taken out of the times.
+//
 // Profiler:CALLSTACK of Thread 0
-// Profiler:_______________________________________________________________________________________
-// Profiler:| Total time   | Avg Time     |  Min time    |  Max time    | Calls  | Section
-// Profiler:_______________________________________________________________________________________
-// Profiler:|      79.0000 |      79.0000 |      79.0000 |      79.0000 |     1  | Main
-// Profiler:|      79.0000 |      39.5000 |      38.0000 |      41.0000 |     2  |   myFunction
-// Profiler:_______________________________________________________________________________________
+// Profiler:__________________________________________________________________________________________________________________________________________________________________
+// Profiler:| Total time   | Avg Time     |  Min time    |  Max time    |  p50 time    |  p90 time    |  p99 time    | p99.9 time   |  Std dev     | Calls   | Section
+// Profiler:__________________________________________________________________________________________________________________________________________________________________
+// Profiler:|      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |       0.0000 |       1 | Main
+// Profiler:|      79.0000 |      39.5000 |      38.0000 |      41.0000 |      38.0000 |      41.0000 |      41.0000 |      41.0000 |       1.5000 |       2 |   myFunction
+// Profiler:__________________________________________________________________________________________________________________________________________________________________
 //
 // Profiler:
 //
 // Profiler:DUMP of Thread 0
-// Profiler:_______________________________________________________________________________________
-// Profiler:| Total time   | Avg Time     |  Min time    |  Max time    | Calls  | Section
-// Profiler:_______________________________________________________________________________________
-// Profiler:|      79.0000 |      79.0000 |      79.0000 |      79.0000 |      1 | Main
-// Profiler:|      79.0000 |      39.5000 |      38.0000 |      41.0000 |      2 | myFunction
-// Profiler:_______________________________________________________________________________________
+// Profiler:__________________________________________________________________________________________________________________________________________________________________
+// Profiler:| Total time   | Avg Time     |  Min time    |  Max time    |  p50 time    |  p90 time    |  p99 time    | p99.9 time   |  Std dev     | Calls   | Section
+// Profiler:__________________________________________________________________________________________________________________________________________________________________
+// Profiler:|      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |      79.0000 |       0.0000 |       1 | Main
+// Profiler:|      79.0000 |      39.5000 |      38.0000 |      41.0000 |      38.0000 |      41.0000 |      41.0000 |      41.0000 |       1.5000 |       2 | myFunction
+// Profiler:__________________________________________________________________________________________________________________________________________________________________
 //
 // The first list correspond to the callstack ( with left spaced function name). You might see a
 // a profiled block multiple time depending on where it was called.
 // The second list is a flat one. Profiled block only appear once.
 // Time unit is ms
 //
+// Each thread records into its own context, so PROFILER_START/PROFILER_END never take
+// a lock. Threads are only merged when LogProfiler is called.
+//
+// Beyond these two tables, sections can be filtered at compile time by category and level,
+// sampled, and given counters, allocation and perf counter stats. Reports add percentiles,
+// self times and intervals, and can be exported as JSON, CSV or folded stacks, published live
+// to shared memory, or saved for the tools in tools/ to convert, merge and diff. Async spans,
+// queues and locks have tables of their own. Each feature is documented next to its
+// declarations below, and README.md walks through all of them.
+//
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 #ifndef LIBPROFILER_H__
@@ -143,15 +155,25 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <vector>
+#include <deque>
 #include <map>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <mutex>
+#include <thread>
+#include <chrono>
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // PROFILE/LOG
 
-#ifndef ProfilerPrintf
-#define ProfilerPrintf printf
+#ifndef LIB_PROFILER_PRINTF
+#define LIB_PROFILER_PRINTF(szText) printf("%s", szText)
 #endif
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -221,6 +243,14 @@
 #   pragma message("Using 32bit memory address space.")
 #endif
 
+// Thread local storage. Only used for plain pointers, so the compiler
+// keywords are enough (no need for C++11 thread_local constructors)
+#if IS_COMPILER_MSVC
+#define ZPROFILER_TLS __declspec(thread)
+#else
+#define ZPROFILER_TLS __thread
+#endif
+
 #if IS_OS_WINDOWS
 #if !defined(snprintf)
 #define snprintf sprintf_s
@@ -247,12 +277,21 @@ inline void LOG(const char *format,...)
     va_list ptr_arg;
     va_start( ptr_arg, format );
 
-    static char tmps[1024];
-    vsprintf( tmps, format, ptr_arg );
-
-    LIB_PROFILER_PRINTF( tmps );
+    char tmps[1024];
+    int length = vsnprintf( tmps, sizeof(tmps), format, ptr_arg );
     
     va_end(ptr_arg);
+    
+    if( length>=(int)sizeof(tmps) )
+    {
+        std::string longText((size_t)length+1, 0);
+        va_start( ptr_arg, format );
+        vsnprintf( &longText[0], longText.size(), format, ptr_arg );
+        va_end(ptr_arg);
+        LIB_PROFILER_PRINTF( longText.c_str() );
+        return;
+    }
+    LIB_PROFILER_PRINTF( tmps );
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -270,6 +309,14 @@ inline char* ZGetCurrentDirectory(int bufLength, char *pszDest)
 
 #elif IS_OS_LINUX
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <linux/perf_event.h>
 typedef pthread_mutex_t ZCriticalSection_t;
 inline char* ZGetCurrentDirectory(int bufLength, char *pszDest)
 {
@@ -278,6 +325,13 @@ inline char* ZGetCurrentDirectory(int bufLength, char *pszDest)
 
 #elif IS_OS_MACOSX
 #import <CoreServices/CoreServices.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
 typedef MPCriticalRegionID ZCriticalSection_t;
 inline char* ZGetCurrentDirectory(int bufLength, char *pszDest)
 {
@@ -345,593 +399,7018 @@ __inline void UnLockCriticalSection(ZCriticalSection_t *cs)
 }
 
 
+//
+// A profiled call site. PROFILER_START declares one as a function-local static, so it
+// is registered (and given its id) only the first time the code runs. After that,
+// starting a profile only passes the id around.
+//
+struct ZProfilerSite;
+unsigned int Zprofiler_register_site( ZProfilerSite *site );
+
+struct ZProfilerSite
+{
+    ZProfilerSite( const char *siteName, const char *siteFile, int siteLine, unsigned int siteSamplePeriod = 1 )
+    : name(siteName), file(siteFile), line(siteLine), samplePeriod(siteSamplePeriod)
+    {
+        id = Zprofiler_register_site(this);
+    }
+    
+    // A site registered by the caller, which holds the sites lock
+    ZProfilerSite( const char *siteName, const char *siteFile, int siteLine, unsigned int siteSamplePeriod, unsigned int siteId )
+    : name(siteName), file(siteFile), line(siteLine), id(siteId), samplePeriod(siteSamplePeriod)
+    {
+    }
+    
+    const char		*name;
+    const char		*file;
+    int				line;
+    unsigned int	id;
+    unsigned int	samplePeriod;			// For PROFILER_START_SAMPLED
+};
+
+//
+// Categories and levels. A section is compiled in only when its category is in
+// LIB_PROFILER_CATEGORIES and its level is at most LIB_PROFILER_LEVEL, so a release
+// build can keep coarse sections and drop fine ones entirely. Specialize
+// ZProfilerFilter for a finer selection.
+//
+#define PROFILER_CATEGORY_DEFAULT	(1<<0)
+#define PROFILER_CATEGORY_NET		(1<<1)
+#define PROFILER_CATEGORY_IO		(1<<2)
+#define PROFILER_CATEGORY_DB		(1<<3)
+#define PROFILER_CATEGORY_RENDER	(1<<4)
+#define PROFILER_CATEGORY_USER		(1<<8)	// First bit left to the application
+
+#define PROFILER_LEVEL_COARSE		0
+#define PROFILER_LEVEL_NORMAL		1
+#define PROFILER_LEVEL_FINE			2
+#define PROFILER_LEVEL_VERBOSE		3
+
+#ifndef LIB_PROFILER_CATEGORIES
+#define LIB_PROFILER_CATEGORIES		0xFFFFFFFF
+#endif
+
+#ifndef LIB_PROFILER_LEVEL
+#define LIB_PROFILER_LEVEL			PROFILER_LEVEL_VERBOSE
+#endif
+
+template<unsigned int Category, unsigned int Level>
+struct ZProfilerFilter
+{
+    static const bool enabled = ((Category & (LIB_PROFILER_CATEGORIES)) != 0) && (Level <= (LIB_PROFILER_LEVEL));
+};
+
+//
+// Zprofiler_enable measures what a PROFILER_START/PROFILER_END pair costs the section
+// around it, and reports take it out of a section once per call made inside it, and
+// the part a section measures itself out of each of its calls. The correction is spread
+// evenly, so min, max and percentiles shift by the average per call. Define
+// LIB_PROFILER_NO_COMPENSATION to turn it off.
+//
 bool Zprofiler_enable();
 void Zprofiler_disable();
+void Zprofiler_start( unsigned int siteId );
+// Finds the site by name in a map under the lock of all sites on every call,
+// where PROFILER_START only passes an id: keep it off hot paths.
 void Zprofiler_start( const char *profile_name );
 void Zprofiler_end( );
 void LogProfiler();
 
-//defines
-
-#define PROFILER_ENABLE Zprofiler_enable()
-#define PROFILER_DISABLE Zprofiler_disable()
-#define PROFILER_START(x) Zprofiler_start(QUOTE(x))
-#define PROFILER_END() Zprofiler_end()
+//
+// Async spans. PROFILER_ASYNC_BEGIN(name, id) starts a span that PROFILER_ASYNC_END(id)
+// ends, on the same thread or another one: a request read on an I/O thread and
+// answered on a worker. Spans don't go on the call stacks. Open spans are kept in a
+// table of LIB_PROFILER_ASYNC_SPANS slots, claimed with compare and swap in the
+// LIB_PROFILER_ASYNC_PROBES slots after the hash of the id, and the thread ending a
+// span adds its time to the stats of the span name. LogProfiler shows them in an
+// ASYNC table. Ids must be unique among the open spans. A span whose end never
+// comes stays open until Zprofiler_disable, after which a begin takes its slot back
+// and the table counts it as never ended; the end of a span dropped because the
+// table was full isn't counted as unmatched.
+//
+#ifndef LIB_PROFILER_ASYNC_SPANS
+#define LIB_PROFILER_ASYNC_SPANS	4096				// Power of 2
+#endif
 
-#else
+#ifndef LIB_PROFILER_ASYNC_PROBES
+#define LIB_PROFILER_ASYNC_PROBES	32
+#endif
 
-#define LogProfiler()
+void Zprofiler_async_begin( unsigned int siteId, uint64_t id );
+void Zprofiler_async_end( uint64_t id );
 
-#define PROFILER_ENABLE
-#define PROFILER_DISABLE
-#define PROFILER_START(x)
-#define PROFILER_END()
+//
+// Queue waits. PROFILER_QUEUE_PUSH(name, stamp) sets stamp, a uint64_t carried by the
+// item, when the item goes in the queue name, and PROFILER_QUEUE_POP(name, stamp) adds
+// the time since then to the waits of the queue when the item comes out. Pushes and
+// pops are counted with an atomic add each, for the depth high-water mark and the
+// items popped per second, and the thread popping keeps the waits. LogProfiler shows
+// the queues in a QUEUES table after the sections, waits in the time columns.
+//
+#ifndef LIB_PROFILER_MAX_QUEUES
+#define LIB_PROFILER_MAX_QUEUES	64
 #endif
 
-#if USE_PROFILER
-#ifdef LIB_PROFILER_IMPLEMENTATION
+struct ZProfilerQueue;
+unsigned int Zprofiler_register_queue( ZProfilerQueue *queue );
 
-using namespace std;
+struct ZProfilerQueue
+{
+    ZProfilerQueue( const char *queueName ) : name(queueName)
+    {
+        id = Zprofiler_register_queue(this);
+    }
+    
+    const char		*name;
+    unsigned int	id;						// 0 when there are too many queues
+};
 
-void TimerInit();
-//#if defined(WIN32)
-double	startHighResolutionTimer( void );
-/*
- #elif defined(_MAC_)
- void	startHighResolutionTimer(unsigned long time[2]);
- #else
- void	startHighResolutionTimer(unsigned long time[2]);
- #endif
- */
-//unsigned long	endHighResolutionTimer(unsigned long time[2]);
+uint64_t Zprofiler_queue_push( unsigned int queueId );
+void Zprofiler_queue_pop( unsigned int queueId, uint64_t stamp );
+
+//
+// Locks. ZProfilerMutex<std::mutex> and ZProfilerMutex<ZProfilerPthreadMutex> are mutexes
+// named when constructed, with lock, try_lock and unlock so std::lock_guard and
+// std::unique_lock take them. Every acquisition adds how long the thread held the lock
+// to the stats of the lock in the innermost section open on the thread, and when
+// try_lock didn't get it at once, how long the thread waited, counted as contended.
+// Reports take the other acquisitions as waits of 0. The stats are found before the
+// lock is taken, from a small per thread cache, and added once it is released: an
+// uncontended acquisition only adds two tick reads. The lock benchmark of
+// benchmark.cpp compares it with a plain std::mutex. LogProfiler shows a LOCKS table,
+// waits in the time columns.
+//
+struct stProfilerLockStats;
 
+unsigned int Zprofiler_register_lock( const char *name );
+uint64_t Zprofiler_get_ticks();
+stProfilerLockStats *Zprofiler_lock_stats( unsigned int lockId );
+void Zprofiler_lock_released( stProfilerLockStats *stats, uint64_t waitStart, uint64_t lockTime );
 
-#if IS_OS_WINDOWS
-// Create A Structure For The Timer Information
-struct
+template<typename Mutex>
+struct ZProfilerMutex
+{
+    ZProfilerMutex( const char *lockName ) : name(lockName), id(Zprofiler_register_lock(lockName)), stats(NULL), waitStart(0), lockTime(0) {}
+    
+    void lock()
+    {
+        stProfilerLockStats *lockStats = Zprofiler_lock_stats(id);
+        uint64_t lockWaitStart = 0;
+        if( !mutex.try_lock() )
+        {
+            lockWaitStart = Zprofiler_get_ticks();
+            mutex.lock();
+        }
+        lockTime	= Zprofiler_get_ticks();
+        stats		= lockStats;
+        waitStart	= lockWaitStart;
+    }
+    bool try_lock()
+    {
+        stProfilerLockStats *lockStats = Zprofiler_lock_stats(id);
+        if( !mutex.try_lock() )
+        {
+            return false;
+        }
+        lockTime	= Zprofiler_get_ticks();
+        stats		= lockStats;
+        waitStart	= 0;
+        return true;
+    }
+    // Wait and hold are recorded once the lock is released, not to make it longer
+    void unlock()
+    {
+        stProfilerLockStats *lockStats = stats;
+        uint64_t lockWaitStart = waitStart, lockStart = lockTime;
+        mutex.unlock();
+        Zprofiler_lock_released(lockStats, lockWaitStart, lockStart);
+    }
+    
+    Mutex					mutex;
+    const char				*name;
+    unsigned int			id;
+    
+    // Of the thread holding the lock. waitStart is 0 when it wasn't contended.
+    stProfilerLockStats		*stats;
+    uint64_t				waitStart;
+    uint64_t				lockTime;
+};
+
+//
+// Intervals. PROFILER_FRAME() closes the current interval (a frame, a tick, a batch
+// of requests) and keeps the stats of every section over it, all threads merged,
+// while recording goes on. The last LIB_PROFILER_INTERVAL_HISTORY intervals are kept
+// to compare a spike with the ones before. Min and max times of an interval are
+// taken from its histogram.
+//
+#ifndef LIB_PROFILER_INTERVAL_HISTORY
+#define LIB_PROFILER_INTERVAL_HISTORY	128
+#endif
+
+// Times in ms
+typedef struct stProfilerIntervalSection
+{
+    unsigned int	siteId;
+    const char		*name;
+    unsigned long	nbCalls;
+    double			totalTime;				// Calls made inside a call of the same section aren't counted twice
+    double			selfTime;				// Time outside of the sections called inside
+    double			avgTime;
+    double			minTime;
+    double			maxTime;
+    double			p50Time;
+    double			p90Time;
+    double			p99Time;
+    double			p999Time;
+    double			stdDev;
+    unsigned long	nbSampled;				// Calls timed when the section is sampled, 0 otherwise
+    double			sampleError;			// Relative error of the total time of a sampled section
+} tdstProfilerIntervalSection;
+
+typedef struct stProfilerInterval
 {
-    __int64			frequency;									// Timer Frequency
-    float			resolution;									// Timer Resolution
-    unsigned long	mm_timer_start;								// Multimedia Timer Start Value
-    unsigned long	mm_timer_elapsed;							// Multimedia Timer Elapsed Time
-    bool			performance_timer;							// Using The Performance Timer?
-    __int64			performance_timer_start;					// Performance Timer Start Value
-    __int64			performance_timer_elapsed;					// Performance Timer Elapsed Time
-} timer;														// Structure Is Named timer
+    uint64_t		index;					// Intervals closed since Zprofiler_enable
+    double			startTime;				// ms since Zprofiler_enable
+    double			duration;				// ms
+    std::vector<tdstProfilerIntervalSection> sections;	// Sections called in the interval, by site id
+} tdstProfilerInterval;
 
-#endif  //  IS_OS_WINDOWS
+void Zprofiler_frame();
+void Zprofiler_set_interval_history( unsigned int count );
+bool Zprofiler_get_interval( unsigned int age, tdstProfilerInterval &interval );	// age 0 is the last closed interval
+void LogProfilerInterval( unsigned int age );
 
+//
+// Report order. The DUMP tables and intervals are sorted by sortKey, biggest first, and
+// LogProfiler ends with the topSections first sections of all threads merged
+// (LIB_PROFILER_TOP_SECTIONS by default, 0 for none). Sorted by self time by default.
+//
+#define PROFILER_SORT_TOTAL		0
+#define PROFILER_SORT_SELF		1
+#define PROFILER_SORT_AVG		2
+#define PROFILER_SORT_CALLS		3
+#define PROFILER_SORT_P99		4
 
-typedef struct stGenProfilerData
+#ifndef LIB_PROFILER_TOP_SECTIONS
+#define LIB_PROFILER_TOP_SECTIONS	20
+#endif
+
+void Zprofiler_set_report_order( int sortKey, unsigned int topSections );
+
+//
+// Exports. The report of LogProfiler in files other tools read, every section of
+// all threads included: Zprofiler_export_json writes the calling context tree of
+// each thread with all the stats, its flat table and the one of all threads.
+// Zprofiler_export_csv writes the flat tables, one line per section and thread.
+// Both have times in ms. Zprofiler_export_folded writes one line per call path
+// with its self time in ns, "Main;myFunction 70070800", for flamegraph.pl or speedscope.
+//
+bool Zprofiler_export_json( const char *filename );
+bool Zprofiler_export_csv( const char *filename );
+bool Zprofiler_export_folded( const char *filename );
+
+//
+// Live stats, Linux and MacOSX. Zprofiler_start_publishing starts a thread that walks the
+// trees every periodMs and writes the sections of all threads, merged and sorted by the
+// report key, to the POSIX shared memory object name ("/libprofiler.<pid>" when NULL).
+// Other processes of the same user read it with Zprofiler_read_published, as tools/
+// libProfilerTop.cpp does, while recording goes on. The object is created with mode 0600;
+// when one of the same name exists, it is only replaced if the process in its head is
+// gone, else publishing fails. The writer makes sequence odd while it
+// writes and even again after, and a reader keeps its copy only if sequence was even and
+// didn't change.
+//
+#define PROFILER_SHARED_MAGIC		"LPSHARED"
+#define PROFILER_SHARED_VERSION		1
+
+#ifndef LIB_PROFILER_SHARED_SECTIONS
+#define LIB_PROFILER_SHARED_SECTIONS	256
+#endif
+
+// Times in ms
+typedef struct stProfilerSharedSection
 {
+    char			name[64];
+    uint64_t		nbCalls;
     double			totalTime;
-    double			averageTime;
+    double			selfTime;
+    double			avgTime;
     double			minTime;
     double			maxTime;
-    double			lastTime;				// Time of the previous passage
-    double			elapsedTime;			// Elapsed Time
-    unsigned long	nbCalls;				// Numbers of calls
-    char			szBunchCodeName[1024];	// temporary.
-} tdstGenProfilerData;
+    double			p50Time;
+    double			p90Time;
+    double			p99Time;
+    double			p999Time;
+    double			stdDev;
+} tdstProfilerSharedSection;
 
-//  Hold the call stack
-typedef std::vector<tdstGenProfilerData> tdCallStackType;
+// Head of the shared memory object, followed by maxSections sections
+typedef struct stProfilerSharedStats
+{
+    char					magic[8];
+    uint32_t				version;
+    uint32_t				maxSections;
+    std::atomic<uint64_t>	sequence;
+    uint64_t				processId;
+    uint64_t				nbUpdates;
+    double					time;					// ms since Zprofiler_enable
+    uint32_t				nbThreads;
+    uint32_t				nbSections;				// Sections of the process, maxSections at most are written
+} tdstProfilerSharedStats;
 
-//	Hold the sequence of profiler_starts
-std::map<std::string, tdstGenProfilerData> mapProfilerGraph;
+// A consistent copy of the shared stats
+typedef struct stProfilerPublishedStats
+{
+    unsigned long								processId;
+    uint64_t									nbUpdates;
+    double										time;
+    unsigned int								nbThreads;
+    unsigned int								nbSections;
+    std::vector<tdstProfilerSharedSection>		sections;
+} tdstProfilerPublishedStats;
 
-// Hold profiler data vector in function of the thread
-map<unsigned long, tdCallStackType> mapCallsByThread;
+bool Zprofiler_start_publishing( const char *name, unsigned int periodMs );
+void Zprofiler_stop_publishing();
+bool Zprofiler_read_published( const char *name, tdstProfilerPublishedStats &stats );
 
-// Critical section
-ZCriticalSection_t	*gProfilerCriticalSection;
+//
+// Timeline. When enabled, every thread also appends begin/end events to a ring
+// buffer of eventsPerThread events, allocated the first time it records one.
+// When the ring is full, PROFILER_TIMELINE_OVERWRITE keeps the most recent events
+// and PROFILER_TIMELINE_STOP keeps the first ones. Enabling it again with other
+// settings gives each thread a new empty ring on its next event. Rings are kept
+// after Zprofiler_disable_timeline, to export them, until then.
+// Zprofiler_export_chrome_trace writes the events as Chrome Trace Event JSON,
+// to load in chrome://tracing or Perfetto. It can run while threads record: the
+// events they overwrite during the export are left out.
+//
+#define PROFILER_TIMELINE_OVERWRITE	0
+#define PROFILER_TIMELINE_STOP		1
 
+void Zprofiler_enable_timeline( unsigned int eventsPerThread, int policy );
+void Zprofiler_disable_timeline();
+bool Zprofiler_export_chrome_trace( const char *filename );
 
-// Critical section functions
-/*
- void NewCriticalSection( void );
- void DestroyCriticalSection( void );
- void LockCriticalSection( void );
- void UnLockCriticalSection( void );
- */
+//
+// Capture. Streams every begin/end event to a binary file instead of keeping them
+// in memory. Threads fill fixed size chunks of varint encoded events (time delta,
+// site) and a writer thread appends full chunks and new site names to the file.
+// Read it back with tools/libProfilerConvert.cpp.
+//
+bool Zprofiler_start_capture( const char *filename );
+void Zprofiler_stop_capture();
 
 //
-// Activate the profiler
+// Saved profiles. Zprofiler_save_profile writes what LogProfiler reports to a file: the
+// trees of all threads with their histograms, counters and sampling, the async, queue
+// and lock stats, and the timeline when it's enabled. "%p" in the file name is replaced
+// by the process id, for a file per process. Times are saved with the profiler overhead
+// taken out, so programs loading profiles set the overhead to 0. Zprofiler_load_profile
+// adds a saved profile to the contexts of this process, a context per saved thread or
+// one for the whole process, named by its process id. tools/libProfilerMerge.cpp merges
+// the profiles of many processes. Without USE_PROFILER, Zprofiler_save_profile returns
+// false, and Zprofiler_load_profile and tdstProfilerSavedProcess don't exist: loading is
+// for tools built with USE_PROFILER.
 //
-bool Zprofiler_enable()
+typedef struct stProfilerSavedEvent
 {
-    // Initialize the timer
-    TimerInit();
-    
-    // Create the mutex
-    gProfilerCriticalSection = NewCriticalSection();
-    
-    // Clear maps
-    /*
-     mapCallsByThread.clear();
-     mapProfilerGraph.clear();
-     mapCallsByThread.clear();
-     */
-    
-    
-    
-    return true;
-}
+    unsigned long	threadId;
+    uint64_t		time;					// ns since the profiler was enabled in the process
+    unsigned int	siteId;					// Of this process
+    unsigned int	type;					// PROFILER_EVENT_BEGIN or PROFILER_EVENT_END
+} tdstProfilerSavedEvent;
+
+typedef struct stProfilerSavedProcess
+{
+    unsigned long		processId;
+    std::string			hostName;
+    uint64_t			monotonicStart;		// ns on the steady clock of the host when the profiler was enabled
+    uint64_t			realtimeStart;		// ns since the epoch at the same time
+    double				duration;			// ms from Zprofiler_enable to the save
+    unsigned int		nbThreads;
+    std::vector<tdstProfilerSavedEvent>	events;	// Timeline, in the order it was recorded by each thread
+} tdstProfilerSavedProcess;
+
+bool Zprofiler_save_profile( const char *filename );
+bool Zprofiler_load_profile( const char *filename, bool mergeThreads, tdstProfilerSavedProcess &process );
 
 //
-// Deactivate the profiler
+// Background aggregation. When enabled, PROFILER_END only pushes (context, time)
+// in a single producer queue of recordsPerThread records owned by its thread, and
+// a profiler thread updates the stats. When a queue is full, PROFILER_AGGREGATION_DROP
+// drops the record and counts it, PROFILER_AGGREGATION_WAIT waits for room.
 //
-void Zprofiler_disable()
-{
-    // Dump to file
-    //Zprofiler_dumpToFile( DUMP_FILENAME );
-    
-    // Clear maps
-    mapCallsByThread.clear();
-    mapProfilerGraph.clear();
-    mapCallsByThread.clear();
-    
-    // Delete the mutex
-    DestroyCriticalSection(gProfilerCriticalSection);
-}
-#if IS_OS_MACOSX
-unsigned long GetCurrentThreadId() { return 0; }
-#elif IS_OS_LINUX
-unsigned long GetCurrentThreadId() { return 0; }
+#define PROFILER_AGGREGATION_DROP	0
+#define PROFILER_AGGREGATION_WAIT	1
+
+void Zprofiler_enable_aggregation( unsigned int recordsPerThread, int policy );
+void Zprofiler_disable_aggregation();
+
+//
+// Sampling. PROFILER_START_SAMPLED(x, period) times 1 call in period and only counts
+// the others. Reports scale the timed calls up to all the calls and show the estimated
+// error. With PROFILER_SAMPLING_ADAPTIVE, each thread picks a period so that timing
+// the section costs at most the sampling budget, a fraction of the time
+// (LIB_PROFILER_SAMPLING_BUDGET by default). End it with PROFILER_END(). Sections
+// called under a call that isn't timed are counted under its parent.
+//
+#define PROFILER_SAMPLING_ADAPTIVE	0
+
+#ifndef LIB_PROFILER_SAMPLING_BUDGET
+#define LIB_PROFILER_SAMPLING_BUDGET	0.01
 #endif
 
+void Zprofiler_start_sampled( ZProfilerSite *site );
+void Zprofiler_set_sampling( const char *profile_name, unsigned int period );
+void Zprofiler_set_sampling_budget( double budget );
+
 //
-// Start the profiling of a bunch of code
+// Counters. PROFILER_COUNTER(x, value) adds value to the counter x of the innermost
+// open section of the calling thread, PROFILER_ADD(value) to its "items" counter.
+// LogProfiler prints the totals next to the section and the rate per second of
+// its time. Values added outside any section are dropped.
 //
-void Zprofiler_start( const char *profile_name )
+struct ZProfilerCounter;
+unsigned int Zprofiler_register_counter( ZProfilerCounter *counter );
+
+struct ZProfilerCounter
 {
-    LockCriticalSection(gProfilerCriticalSection);
-    
-    unsigned long ulThreadId = GetCurrentThreadId();
-    
-    // Add the profile name in the callstack vector
-    tdstGenProfilerData	GenProfilerData;
-    memset(&GenProfilerData, 0, sizeof(GenProfilerData));
-    GenProfilerData.lastTime	= startHighResolutionTimer();
-    GenProfilerData.minTime		= 0xFFFFFFFF;
-    
-    // Find or add callstack
-    tdCallStackType TmpCallStack;
-    map<unsigned long, tdCallStackType>::iterator IterCallsByThreadMap = mapCallsByThread.find(ulThreadId);
-    if( IterCallsByThreadMap == mapCallsByThread.end() )
-    {
-        // Not found. So insert the new pair
-        mapCallsByThread.insert(std::make_pair(ulThreadId, TmpCallStack));
-        IterCallsByThreadMap = mapCallsByThread.find(ulThreadId);
-    }
-    
-    // It's the first element of the vector
-    if ((*IterCallsByThreadMap).second.empty())
-    {
-        GenProfilerData.nbCalls	= 1;
-        sprintf(GenProfilerData.szBunchCodeName, "%s%d%s%s", _NAME_SEPARATOR_, (int)ulThreadId, _THREADID_NAME_SEPARATOR_, profile_name);
-        (*IterCallsByThreadMap).second.push_back( GenProfilerData );
-    }
-    // It's not the first element of the vector
-    else
+    ZProfilerCounter( const char *counterName ) : name(counterName)
     {
-        // Update the number of calls
-        GenProfilerData.nbCalls++;
-        
-        // We need to construct the string with the previous value of the
-        // profile_start
-        char *previousString = (*IterCallsByThreadMap).second[(*IterCallsByThreadMap).second.size()-1].szBunchCodeName;
-        
-        // Add the current profile start string
-        strcpy(GenProfilerData.szBunchCodeName, previousString);
-        strcat(GenProfilerData.szBunchCodeName, _NAME_SEPARATOR_);
-        strcat(GenProfilerData.szBunchCodeName, profile_name);
-        
-        // Push it
-        (*IterCallsByThreadMap).second.push_back( GenProfilerData );
+        id = Zprofiler_register_counter(this);
     }
     
-    UnLockCriticalSection(gProfilerCriticalSection);
-}
+    const char		*name;
+    unsigned int	id;
+};
+
+#define PROFILER_COUNTER_ITEMS	0
+
+void Zprofiler_add( unsigned int counterId, uint64_t value );
 
 //
-// Stop the profiling of a bunch of code
+// Allocation tracking. Define LIB_PROFILER_TRACK_ALLOCATIONS to 1 before the
+// LIB_PROFILER_IMPLEMENTATION include to replace operator new/delete, and on Linux
+// malloc/free and co., with versions counting the allocations, bytes and peak live
+// bytes of the innermost open section of the calling thread.
 //
-void Zprofiler_end( )
+#ifndef LIB_PROFILER_TRACK_ALLOCATIONS
+#define LIB_PROFILER_TRACK_ALLOCATIONS	0
+#endif
+
+//
+// Performance counters, Linux only. Zprofiler_enable_perf_counters opens a perf_event_open
+// group per thread, the next time it starts a section, and reads it when a section
+// starts and ends: cycles, instructions, LLC misses and branch misses with
+// PROFILER_PERF_HARDWARE, or task clock, page faults and context switches with
+// PROFILER_PERF_SOFTWARE when the PMU isn't available. Returns the kind of events
+// counted, PROFILER_PERF_NONE if none. A thread keeps its group until it exits.
+//
+#define PROFILER_PERF_NONE		0
+#define PROFILER_PERF_HARDWARE	1
+#define PROFILER_PERF_SOFTWARE	2
+
+int Zprofiler_enable_perf_counters();
+void Zprofiler_disable_perf_counters();
+
+//defines
+
+#define PROFILER_ENABLE Zprofiler_enable()
+#define PROFILER_DISABLE Zprofiler_disable()
+#define PROFILER_FRAME() Zprofiler_frame()
+#define PROFILER_START_CAT(x, category, level) do { if( ZProfilerFilter<(category), (level)>::enabled ) { static ZProfilerSite zprofilerSite(QUOTE(x), __FILE__, __LINE__); Zprofiler_start(zprofilerSite.id); } } while(0)
+#define PROFILER_END_CAT(category, level) do { if( ZProfilerFilter<(category), (level)>::enabled ) Zprofiler_end(); } while(0)
+#define PROFILER_START(x) PROFILER_START_CAT(x, PROFILER_CATEGORY_DEFAULT, PROFILER_LEVEL_NORMAL)
+#define PROFILER_END() PROFILER_END_CAT(PROFILER_CATEGORY_DEFAULT, PROFILER_LEVEL_NORMAL)
+#define PROFILER_START_SAMPLED_CAT(x, period, category, level) do { if( ZProfilerFilter<(category), (level)>::enabled ) { static ZProfilerSite zprofilerSite(QUOTE(x), __FILE__, __LINE__, (period)); Zprofiler_start_sampled(&zprofilerSite); } } while(0)
+#define PROFILER_START_SAMPLED(x, period) PROFILER_START_SAMPLED_CAT(x, period, PROFILER_CATEGORY_DEFAULT, PROFILER_LEVEL_NORMAL)
+#define PROFILER_COUNTER(x, value) do { static ZProfilerCounter zprofilerCounter(QUOTE(x)); Zprofiler_add(zprofilerCounter.id, (value)); } while(0)
+#define PROFILER_ADD(value) Zprofiler_add(PROFILER_COUNTER_ITEMS, (value))
+#define PROFILER_ASYNC_BEGIN(x, spanId) do { static ZProfilerSite zprofilerSite(QUOTE(x), __FILE__, __LINE__); Zprofiler_async_begin(zprofilerSite.id, (uint64_t)(spanId)); } while(0)
+#define PROFILER_ASYNC_END(spanId) Zprofiler_async_end((uint64_t)(spanId))
+#define PROFILER_QUEUE_PUSH(x, stamp) do { static ZProfilerQueue zprofilerQueue(QUOTE(x)); (stamp) = Zprofiler_queue_push(zprofilerQueue.id); } while(0)
+#define PROFILER_QUEUE_POP(x, stamp) do { static ZProfilerQueue zprofilerQueue(QUOTE(x)); Zprofiler_queue_pop(zprofilerQueue.id, (stamp)); } while(0)
+
+#else
+
+#define LogProfiler()
+#define Zprofiler_set_interval_history(count)
+#define Zprofiler_get_interval(age, interval) false
+#define LogProfilerInterval(age)
+#define Zprofiler_set_report_order(sortKey, topSections)
+#define Zprofiler_export_json(filename) false
+#define Zprofiler_export_csv(filename) false
+#define Zprofiler_export_folded(filename) false
+#define Zprofiler_save_profile(filename) false
+#define Zprofiler_start_publishing(name, periodMs) false
+#define Zprofiler_stop_publishing()
+#define Zprofiler_enable_timeline(eventsPerThread, policy)
+#define Zprofiler_disable_timeline()
+#define Zprofiler_export_chrome_trace(filename) false
+#define Zprofiler_start_capture(filename) false
+#define Zprofiler_stop_capture()
+#define Zprofiler_enable_aggregation(recordsPerThread, policy)
+#define Zprofiler_disable_aggregation()
+#define Zprofiler_set_sampling(profile_name, period)
+#define Zprofiler_set_sampling_budget(budget)
+#define Zprofiler_enable_perf_counters() 0
+#define Zprofiler_disable_perf_counters()
+
+#define PROFILER_ENABLE
+#define PROFILER_DISABLE
+#define PROFILER_FRAME()
+#define PROFILER_START_CAT(x, category, level)
+#define PROFILER_END_CAT(category, level)
+#define PROFILER_START(x)
+#define PROFILER_END()
+#define PROFILER_START_SAMPLED_CAT(x, period, category, level)
+#define PROFILER_START_SAMPLED(x, period)
+#define PROFILER_COUNTER(x, value)
+#define PROFILER_ADD(value)
+#define PROFILER_ASYNC_BEGIN(x, spanId)
+#define PROFILER_ASYNC_END(spanId)
+#define PROFILER_QUEUE_PUSH(x, stamp)
+#define PROFILER_QUEUE_POP(x, stamp)
+
+template<typename Mutex>
+struct ZProfilerMutex
 {
-    unsigned long ulThreadId = GetCurrentThreadId();
-    
-    // Retrieve the right entry in function of the threadId
-    map<unsigned long, tdCallStackType>::iterator IterCallsByThreadMap = mapCallsByThread.find(ulThreadId);
-    
-    // Check if vector is empty
-    if( (*IterCallsByThreadMap).second.empty() )
-    {
-        LOG( "Il y a une erreur dans le vecteur CallStack !!!\n\n");
-        return;
-    }
+    ZProfilerMutex( const char *lockName ) { (void)lockName; }
     
-    LockCriticalSection(gProfilerCriticalSection);
+    void lock() { mutex.lock(); }
+    bool try_lock() { return mutex.try_lock(); }
+    void unlock() { mutex.unlock(); }
     
-    // Retrieve the last element from the callstack vector
-    tdstGenProfilerData	GenProfilerData;
-    GenProfilerData	= (*IterCallsByThreadMap).second[(*IterCallsByThreadMap).second.size()-1];
-    
-    // Compute elapsed time
-    GenProfilerData.elapsedTime += startHighResolutionTimer()-GenProfilerData.lastTime;
-    GenProfilerData.totalTime	+= GenProfilerData.elapsedTime;
-    
-    // Find if this entry exists in the map
-    std::map<std::string, tdstGenProfilerData>::iterator	IterMap;
-    IterMap	= mapProfilerGraph.find( GenProfilerData.szBunchCodeName );
-    if( IterMap!=mapProfilerGraph.end() )
-    {
-        (*IterMap).second.nbCalls++;
-        
-        // Retrieve time information to compute min and max time
-        double minTime		= (*IterMap).second.minTime;
-        double maxTime		= (*IterMap).second.maxTime;
-        //double totalTime	= (*IterMap).second.totalTime;
-        
-        if( GenProfilerData.elapsedTime<minTime )
-        {
-            (*IterMap).second.minTime	= GenProfilerData.elapsedTime;
-        }
-        
-        if( GenProfilerData.elapsedTime>maxTime )
-        {
-            (*IterMap).second.maxTime	= GenProfilerData.elapsedTime;
-        }
-        
-        // Compute Total Time
-        (*IterMap).second.totalTime	   += GenProfilerData.elapsedTime;
-        // Compute Average Time
-        (*IterMap).second.averageTime	= (*IterMap).second.totalTime/(*IterMap).second.nbCalls;
-        
-    }
-    else
-    {
-        GenProfilerData.minTime	= GenProfilerData.elapsedTime;
-        GenProfilerData.maxTime	= GenProfilerData.elapsedTime;
-        
-        // Compute Average Time
-        GenProfilerData.averageTime	= GenProfilerData.totalTime/GenProfilerData.nbCalls;
-        
-        // Insert this part of the call stack into the Progiler Graph
-        mapProfilerGraph.insert( std::make_pair(GenProfilerData.szBunchCodeName, GenProfilerData) );
-    }
+    Mutex	mutex;
+};
+#endif
+
+#if IS_OS_LINUX || IS_OS_MACOSX
+#include <pthread.h>
+
+//
+// pthread_mutex_t with the interface of std::mutex, to wrap in a ZProfilerMutex
+//
+struct ZProfilerPthreadMutex
+{
+    ZProfilerPthreadMutex() { pthread_mutex_init(&mutex, NULL); }
+    ~ZProfilerPthreadMutex() { pthread_mutex_destroy(&mutex); }
     
-    // Now, pop back the GenProfilerData from the vector callstack
-    (*IterCallsByThreadMap).second.pop_back();
+    void lock() { pthread_mutex_lock(&mutex); }
+    bool try_lock() { return pthread_mutex_trylock(&mutex)==0; }
+    void unlock() { pthread_mutex_unlock(&mutex); }
+    pthread_mutex_t *native_handle() { return &mutex; }
     
-    UnLockCriticalSection(gProfilerCriticalSection);
-}
+    pthread_mutex_t	mutex;
+};
+#endif
 
+#if USE_PROFILER
+#ifdef LIB_PROFILER_IMPLEMENTATION
+
+using namespace std;
+
+////
+////	Gestion des timers
+////
 //
-// Dump all data in a file
+// Time is read as integer ticks and stays in ticks until a report converts it.
+// On x86 with an invariant TSC, ticks are rdtsc cycles calibrated against the
+// monotonic clock. Otherwise they come from CLOCK_MONOTONIC_RAW (ns), the
+// performance counter on Windows or mach_absolute_time on MacOSX.
+// Define LIB_PROFILER_NO_TSC to always use the OS clock.
+// Define LIB_PROFILER_CLOCK (a function returning a 64 bit tick count) and
+// LIB_PROFILER_CLOCK_FREQUENCY (ticks per second) to plug another clock.
 //
 
-bool MyDataSortPredicate(const tdstGenProfilerData un, const tdstGenProfilerData deux)
+#if !defined(LIB_PROFILER_CLOCK) && !defined(LIB_PROFILER_NO_TSC) && \
+    ( defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86) )
+#define LIB_PROFILER_USE_TSC 1
+#if IS_COMPILER_MSVC
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#else
+#define LIB_PROFILER_USE_TSC 0
+#endif
+
+#if IS_OS_MACOSX
+#include <mach/mach_time.h>
+#endif
+
+// Ticks per second of ZprofilerGetTicks
+double	gProfilerTicksPerSecond = 1000000000.0;
+
+// Ticks when the profiler was enabled, origin of the timeline
+uint64_t	gProfilerStartTicks = 0;
+
+#if LIB_PROFILER_USE_TSC
+// false when the TSC can't be trusted (not invariant)
+bool	gProfilerUseTSC = false;
+#endif
+
+//
+// Read the OS monotonic clock
+//
+inline uint64_t ZprofilerGetClockTicks()
 {
-    return un.szBunchCodeName > deux.szBunchCodeName;
+#if defined(LIB_PROFILER_CLOCK)
+    return LIB_PROFILER_CLOCK();
+#elif IS_OS_WINDOWS
+    LARGE_INTEGER time;
+    QueryPerformanceCounter(&time);
+    return (uint64_t)time.QuadPart;
+#elif IS_OS_MACOSX
+    return mach_absolute_time();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
 }
 
-void LogProfiler()
+//
+// Ticks per second of ZprofilerGetClockTicks
+//
+double ZprofilerGetClockFrequency()
 {
+#if defined(LIB_PROFILER_CLOCK)
+    return (double)(LIB_PROFILER_CLOCK_FREQUENCY);
+#elif IS_OS_WINDOWS
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (double)frequency.QuadPart;
+#elif IS_OS_MACOSX
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    return 1000000000.0 * (double)timebase.denom / (double)timebase.numer;
+#else
+    return 1000000000.0;
+#endif
+}
+
+inline uint64_t ZprofilerGetTicks()
+{
+#if LIB_PROFILER_USE_TSC
+    if( gProfilerUseTSC )
+    {
+        return __rdtsc();
+    }
+#endif
+    return ZprofilerGetClockTicks();
+}
+
+// Initialize Our Timer (Get It Ready)
+void TimerInit()
+{
+    gProfilerTicksPerSecond = ZprofilerGetClockFrequency();
+    
+#if LIB_PROFILER_USE_TSC
+    // Only an invariant TSC ticks at a constant rate across P-states and cores
+    unsigned int regs[4] = { 0, 0, 0, 0 };
+#if IS_COMPILER_MSVC
+    __cpuid((int*)regs, 0x80000007);
+#else
+    __get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+    gProfilerUseTSC = (regs[3] & (1<<8)) != 0;
+    
+    if( gProfilerUseTSC )
+    {
+        // Calibrate against the monotonic clock for about 20ms
+        double clockFrequency = ZprofilerGetClockFrequency();
+        uint64_t clockStart = ZprofilerGetClockTicks();
+        uint64_t tscStart = __rdtsc();
+        uint64_t clockEnd;
+        do
+        {
+            clockEnd = ZprofilerGetClockTicks();
+        } while( double(clockEnd-clockStart) < clockFrequency*0.02 );
+        uint64_t tscEnd = __rdtsc();
+        
+        gProfilerTicksPerSecond = double(tscEnd-tscStart) * clockFrequency / double(clockEnd-clockStart);
+    }
+#endif
+}
+
+inline double ZprofilerTicksToMs( uint64_t ticks )
+{
+    return double(ticks) * 1000.0 / gProfilerTicksPerSecond;
+}
+
+
+typedef struct stGenProfilerData
+{
+    uint64_t		totalTime;				// In ticks
+    uint64_t		minTime;
+    uint64_t		maxTime;
+    double			sumSquares;				// Sum of squared times, for the standard deviation
+    unsigned long	nbCalls;				// Numbers of calls
+} tdstGenProfilerData;
+
+//
+// Log-linear (HDR style) histogram of times in ticks. Values below 2^SUB_BITS get a
+// bucket each; above, each power of two is split in 2^SUB_BITS buckets, so a
+// bucket is never wider than 1/2^SUB_BITS of the values it holds. Values past
+// 2^MAX_BITS ticks all go in the last bucket.
+//
+#ifndef LIB_PROFILER_HISTOGRAM_SUB_BITS
+#define LIB_PROFILER_HISTOGRAM_SUB_BITS	3
+#endif
+
+#ifndef LIB_PROFILER_HISTOGRAM_MAX_BITS
+#define LIB_PROFILER_HISTOGRAM_MAX_BITS	40
+#endif
+
+#define PROFILER_HISTOGRAM_SUB_BUCKETS	(1<<LIB_PROFILER_HISTOGRAM_SUB_BITS)
+#define PROFILER_HISTOGRAM_BUCKETS		((LIB_PROFILER_HISTOGRAM_MAX_BITS-LIB_PROFILER_HISTOGRAM_SUB_BITS+1)*PROFILER_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct stProfilerHistogram
+{
+    unsigned int	buckets[PROFILER_HISTOGRAM_BUCKETS];
+} tdstProfilerHistogram;
+
+inline unsigned int ZprofilerMostSignificantBit( uint64_t value )
+{
+#if IS_COMPILER_MSVC
+    unsigned long bit;
+    _BitScanReverse64(&bit, value);
+    return (unsigned int)bit;
+#else
+    return 63-(unsigned int)__builtin_clzll(value);
+#endif
+}
+
+inline unsigned int ZprofilerHistogramBucket( uint64_t value )
+{
+    if( value<PROFILER_HISTOGRAM_SUB_BUCKETS )
+    {
+        return (unsigned int)value;
+    }
+    unsigned int shift = ZprofilerMostSignificantBit(value)-LIB_PROFILER_HISTOGRAM_SUB_BITS;
+    unsigned int bucket = (shift+1)*PROFILER_HISTOGRAM_SUB_BUCKETS + (unsigned int)(value>>shift) - PROFILER_HISTOGRAM_SUB_BUCKETS;
+    return (bucket<PROFILER_HISTOGRAM_BUCKETS) ? bucket : PROFILER_HISTOGRAM_BUCKETS-1;
+}
+
+// Smallest value of a bucket
+inline uint64_t ZprofilerHistogramBucketValue( unsigned int bucket )
+{
+    if( bucket<PROFILER_HISTOGRAM_SUB_BUCKETS )
+    {
+        return bucket;
+    }
+    unsigned int shift = bucket/PROFILER_HISTOGRAM_SUB_BUCKETS-1;
+    return (uint64_t)(bucket%PROFILER_HISTOGRAM_SUB_BUCKETS+PROFILER_HISTOGRAM_SUB_BUCKETS)<<shift;
+}
+
+// Heap use of a section, with LIB_PROFILER_TRACK_ALLOCATIONS
+typedef struct stProfilerAllocations
+{
+    uint64_t		nbAllocs;
+    uint64_t		allocBytes;
+    uint64_t		nbFrees;
+    uint64_t		freeBytes;
+    uint64_t		peakBytes;				// Most bytes allocated by the thread and still live during a call
+} tdstProfilerAllocations;
+
+// Events of a perf_event_open group, in group order
+#define PROFILER_PERF_COUNTERS	4
+
+// Stats of a section merged from its contexts, for reports
+typedef struct stProfilerSectionStats
+{
+    tdstGenProfilerData		data;
+    tdstProfilerHistogram	histogram;
+    uint64_t				overheadTime;			// Profiler overhead taken out of the total time
+    uint64_t				selfTime;				// Time outside of the sections called inside
+    uint64_t				nestedTime;				// Time of calls made inside a call of the same section
+    uint64_t				nbSampled;				// Calls timed when the section is sampled, 0 otherwise
+    uint64_t				nbSiteCalls;			// Calls counted by a sampled site, timed or not
+    std::map<unsigned int, uint64_t>	counters;	// Counter totals by counter id
+    tdstProfilerAllocations	allocations;
+    uint64_t				perfCounts[PROFILER_PERF_COUNTERS];
+} tdstProfilerSectionStats;
+
+//
+// A node of the calling context tree: one site called through one path.
+// Children are linked from firstChild through nextSibling, newest first.
+//
+typedef struct stProfilerNode
+{
+    unsigned int				parent;
+    std::atomic<unsigned int>	firstChild;			// Set with a release store once the child is filled in
+    std::atomic<unsigned int>	nextSibling;
+    unsigned int				siteId;
+    unsigned int				lastChild;			// Child found by the previous lookup
+    std::atomic<unsigned int>	firstCounter;		// Counters added in this context, PROFILER_NO_COUNTER if none
+    tdstGenProfilerData			data;
+    tdstProfilerAllocations		allocations;
+    uint64_t					perfCounts[PROFILER_PERF_COUNTERS];	// Totals of the perf events over the calls
+} tdstProfilerNode;
+
+// Node 0 is the root of every thread tree. It is never a child, so 0 also means "no node"
+#define PROFILER_ROOT_NODE 0
+#define PROFILER_NO_NODE 0
+
+// Deeper contexts are counted in the node at this depth
+#ifndef LIB_PROFILER_MAX_DEPTH
+#define LIB_PROFILER_MAX_DEPTH 256
+#endif
+
+//
+// Depth of profiler code running on the thread, with LIB_PROFILER_TRACK_ALLOCATIONS.
+// The allocation hooks ignore the blocks the profiler allocates for itself
+// while it is set, so they aren't counted in the open section.
+//
+#if LIB_PROFILER_TRACK_ALLOCATIONS
+ZPROFILER_TLS unsigned int gProfilerInProfiler = 0;
+
+struct ZProfilerInternalScope
+{
+    ZProfilerInternalScope() { gProfilerInProfiler++; }
+    ~ZProfilerInternalScope() { gProfilerInProfiler--; }
+};
+#define ZPROFILER_INTERNAL_SCOPE ZProfilerInternalScope internalScope
+#else
+#define ZPROFILER_INTERNAL_SCOPE
+#endif
+
+//
+// Growable array whose elements never move, so a node can be referenced while
+// the tree grows. Elements are allocated by chunks of 2^ChunkBits. Only the
+// owner thread adds elements: count and the chunks are published with release
+// stores, so other threads can read the first size() elements.
+//
+template<typename T, unsigned int ChunkBits = 10, unsigned int MaxChunks = 4096>
+struct ZProfilerChunkArray
+{
+    ZProfilerChunkArray() : count(0)
+    {
+        for(unsigned int i=0;i<MaxChunks;i++)
+            chunks[i].store(NULL, std::memory_order_relaxed);
+    }
+    ~ZProfilerChunkArray()
+    {
+        for(unsigned int i=0;i<MaxChunks && chunks[i].load(std::memory_order_relaxed);i++)
+            delete [] chunks[i].load(std::memory_order_relaxed);
+    }
+    
+    T &operator[](unsigned int index)
+    {
+        return chunks[index>>ChunkBits].load(std::memory_order_relaxed)[index&((1<<ChunkBits)-1)];
+    }
+    const T &operator[](unsigned int index) const
+    {
+        return chunks[index>>ChunkBits].load(std::memory_order_relaxed)[index&((1<<ChunkBits)-1)];
+    }
+    
+    unsigned int size() const { return count.load(std::memory_order_acquire); }
+    bool full() const { return count.load(std::memory_order_relaxed)==(MaxChunks<<ChunkBits); }
+    
+    // Append a default element. Chunks are kept when cleared.
+    T &push_back()
+    {
+        unsigned int index = count.load(std::memory_order_relaxed);
+        unsigned int chunk = index>>ChunkBits;
+        if( !chunks[chunk].load(std::memory_order_relaxed) )
+        {
+            ZPROFILER_INTERNAL_SCOPE;
+            chunks[chunk].store(new T[1<<ChunkBits], std::memory_order_release);
+        }
+        T &element = (*this)[index];
+        element.~T();
+        new (&element) T();
+        count.store(index+1, std::memory_order_release);
+        return element;
+    }
+    void clear() { count.store(0, std::memory_order_release); }
+    
+    std::atomic<T*>				chunks[MaxChunks];
+    std::atomic<unsigned int>	count;
+};
+
+//
+// Find the child of a node calling a site, when the lastChild cache misses.
+// Open addressing on (parent, site), only used by the owner thread.
+//
+struct ZProfilerChildTable
+{
+    ZProfilerChildTable() : count(0) { slots.resize(256); }
+    
+    static unsigned int hash(unsigned int parent, unsigned int siteId)
+    {
+        unsigned long long key = ((unsigned long long)parent<<32)|siteId;
+        key *= 0x9E3779B97F4A7C15ULL;
+        return (unsigned int)(key>>32);
+    }
+    
+    unsigned int find(unsigned int parent, unsigned int siteId) const
+    {
+        unsigned int mask = (unsigned int)slots.size()-1;
+        for(unsigned int i = hash(parent, siteId)&mask; slots[i].node; i = (i+1)&mask)
+        {
+            if( slots[i].parent==parent && slots[i].siteId==siteId )
+                return slots[i].node;
+        }
+        return PROFILER_NO_NODE;
+    }
+    
+    void insert(unsigned int parent, unsigned int siteId, unsigned int node)
+    {
+        if( (count+1)*2>slots.size() )
+        {
+            ZPROFILER_INTERNAL_SCOPE;
+            std::vector<stSlot> old(slots.size()*2);
+            old.swap(slots);
+            count = 0;
+            for(size_t i=0;i<old.size();i++)
+                if( old[i].node )
+                    insert(old[i].parent, old[i].siteId, old[i].node);
+        }
+        unsigned int mask = (unsigned int)slots.size()-1;
+        unsigned int i = hash(parent, siteId)&mask;
+        while( slots[i].node )
+            i = (i+1)&mask;
+        slots[i].parent	= parent;
+        slots[i].siteId	= siteId;
+        slots[i].node	= node;
+        count++;
+    }
+    
+    void clear()
+    {
+        slots.assign(256, stSlot());
+        count = 0;
+    }
+    
+    struct stSlot
+    {
+        stSlot() : parent(0), siteId(0), node(PROFILER_NO_NODE) {}
+        unsigned int parent;
+        unsigned int siteId;
+        unsigned int node;
+    };
+    std::vector<stSlot>	slots;
+    size_t				count;
+};
+
+// Total of a counter in a context. The counters of a node are linked from
+// its firstCounter through next.
+typedef struct stProfilerCounterValue
+{
+    uint64_t		value;
+    unsigned int	counterId;
+    unsigned int	next;
+} tdstProfilerCounterValue;
+
+// Counter value 0 of every thread is unused, so 0 means "no counter"
+#define PROFILER_NO_COUNTER 0
+
+// A timeline event
+typedef struct stProfilerEvent
+{
+    uint64_t		time;					// In ticks
+    unsigned int	siteId;
+    unsigned int	type;					// PROFILER_EVENT_BEGIN or PROFILER_EVENT_END
+} tdstProfilerEvent;
+
+#define PROFILER_EVENT_BEGIN	0
+#define PROFILER_EVENT_END		1
+
+//
+// Capture file: PROFILER_CAPTURE_MAGIC, then varints: version, ticks per second,
+// start ticks, process id. Then records, each starting with a type byte:
+// PROFILER_CAPTURE_SITE	varint id, varint line, string name, string file
+// PROFILER_CAPTURE_CHUNK	varint thread id, varint base time, varint lost chunks,
+//							varint size, then size bytes of events
+// PROFILER_CAPTURE_END
+// Strings are a varint length followed by the characters. An event is the varint
+// delta from the previous event time (the base time for the first one) then the
+// varint (siteId<<1)|type.
+//
+#define PROFILER_CAPTURE_MAGIC			"LPROFCAP"
+#define PROFILER_CAPTURE_VERSION		1
+#define PROFILER_CAPTURE_SITE			1
+#define PROFILER_CAPTURE_CHUNK			2
+#define PROFILER_CAPTURE_END			3
+#define PROFILER_CAPTURE_MAX_EVENT_SIZE	15
+
+//
+// Saved profile: PROFILER_PROFILE_MAGIC, then varint version, double ticks per second,
+// varint process id, string host name, varint steady and system clocks in ns when the
+// profiler was enabled, varint ticks since then, varint perf mode, varint async spans
+// dropped and unmatched. Then records, each starting with a type byte:
+// PROFILER_PROFILE_SITE		varint id, varint line, string name, string file
+// PROFILER_PROFILE_COUNTER		varint id, string name
+// PROFILER_PROFILE_QUEUE		varint id, string name, varint pushed, popped, max depth
+// PROFILER_PROFILE_LOCK		varint id, string name
+// PROFILER_PROFILE_THREAD		varint thread id, varint calls dropped, then each list as a
+//								varint count followed by its items:
+//								nodes after the root: varint parent, varint site id, stats,
+//								5 varint allocations, 4 varint perf counts, counters as
+//								a varint count of (varint id, varint value)
+//								sampled sites: varint site id, varint calls, varint timed
+//								async spans: varint site id, stats
+//								queue waits: varint queue id, stats
+//								locks: varint lock id, varint site id, varint contended,
+//								stats of the waits, stats of the hold times
+//								timeline events: varint delta from the previous event
+//								time (the enable time for the first one), then the
+//								varint (siteId<<1)|type
+// PROFILER_PROFILE_END
+// Stats are varint calls, total, min and max ticks, double sum of squares, then the
+// histogram as a varint count of (varint bucket delta, varint calls) for the buckets
+// that have calls. Doubles are the varint of their bits.
+//
+#define PROFILER_PROFILE_MAGIC			"LPROFILE"
+#define PROFILER_PROFILE_VERSION		1
+#define PROFILER_PROFILE_SITE			1
+#define PROFILER_PROFILE_COUNTER		2
+#define PROFILER_PROFILE_QUEUE			3
+#define PROFILER_PROFILE_LOCK			4
+#define PROFILER_PROFILE_THREAD			5
+#define PROFILER_PROFILE_END			6
+
+#ifndef LIB_PROFILER_CAPTURE_CHUNK_SIZE
+#define LIB_PROFILER_CAPTURE_CHUNK_SIZE	(64*1024)
+#endif
+
+// Chunks allocated at most. When the writer falls behind, threads reuse their chunk
+// and the events it held are lost.
+#ifndef LIB_PROFILER_CAPTURE_MAX_CHUNKS
+#define LIB_PROFILER_CAPTURE_MAX_CHUNKS	256
+#endif
+
+typedef struct stProfilerCaptureChunk
+{
+    unsigned long	threadId;
+    uint64_t		baseTime;				// Time of the first event
+    uint64_t		lastTime;				// Time of the last event
+    unsigned int	lostChunks;				// Chunks of this thread lost just before this one
+    unsigned int	size;
+    unsigned char	data[LIB_PROFILER_CAPTURE_CHUNK_SIZE];
+} tdstProfilerCaptureChunk;
+
+// Time of a call, queued for the aggregation thread
+typedef struct stProfilerRecord
+{
+    uint64_t		time;
+    unsigned int	node;
+} tdstProfilerRecord;
+
+// Calls of a sampled site on a thread
+typedef struct stProfilerSiteSampling
+{
+    uint64_t		nbCalls;				// Timed or not
+    uint64_t		nbSampled;				// Timed
+    uint64_t		lastSampleTime;
+    unsigned int	countdown;				// Calls left until the next timed one
+    unsigned int	period;					// Adaptive period
+} tdstProfilerSiteSampling;
+
+// An open async span. state moves from FREE to BUSY to OPEN when the span
+// begins, and from OPEN to BUSY to FREE when it ends: only the thread that
+// made it BUSY writes the other members. A span still OPEN from an older
+// generation is an orphan, its end never came, and a begin can take it back
+// from OPEN to BUSY. Reports read generation and startTime of open spans.
+typedef struct stProfilerAsyncSpan
+{
+    std::atomic<unsigned int>	state;
+    std::atomic<uint64_t>		id;
+    unsigned int				siteId;
+    std::atomic<unsigned int>	generation;
+    std::atomic<uint64_t>		startTime;
+} tdstProfilerAsyncSpan;
+
+#define PROFILER_ASYNC_FREE		0
+#define PROFILER_ASYNC_BUSY		1
+#define PROFILER_ASYNC_OPEN		2
+
+// Times of one id on a thread: the async spans of a site, the waits of a queue
+typedef struct stProfilerIdStats
+{
+    unsigned int			id;
+    tdstGenProfilerData		data;
+    tdstProfilerHistogram	histogram;
+} tdstProfilerIdStats;
+
+//
+// Stats by id, only added to by the owner thread. slots holds the index of an
+// id in stats plus 1, 0 when it has none yet. count is the number of stats
+// reports can read.
+//
+struct ZProfilerIdStatsTable
+{
+    // NULL when the table is full
+    tdstProfilerIdStats *get(unsigned int id)
+    {
+        while( slots.size()<=id && !slots.full() )
+            slots.push_back();
+        if( slots.size()<=id )
+            return NULL;
+        unsigned int index = slots[id];
+        if( !index )
+        {
+            if( stats.full() )
+                return NULL;
+            stats.push_back().id = id;
+            index = stats.size();
+            slots[id] = index;
+            
+            // Reports read the stats while they are added
+            count.store(index, std::memory_order_release);
+        }
+        return &stats[index-1];
+    }
+    
+    void clear()
+    {
+        slots.clear();
+        stats.clear();
+        count.store(0);
+    }
+    
+    ZProfilerChunkArray<unsigned int, 10, 256>			slots;
+    ZProfilerChunkArray<tdstProfilerIdStats, 4, 4096>	stats;
+    std::atomic<unsigned int>							count;
+};
+
+// Items pushed and popped by a queue, and the most it held. Pushes and pops
+// come from different threads, so they have their own cache lines.
+typedef struct stProfilerQueueCounts
+{
+    std::atomic<uint64_t>	nbPushed;
+    std::atomic<uint64_t>	maxDepth;
+    char					padding[48];
+    std::atomic<uint64_t>	nbPopped;
+    char					padding2[56];
+} tdstProfilerQueueCounts;
+
+// Acquisitions of a lock by a thread, in one section
+typedef struct stProfilerLockStats
+{
+    unsigned int			lockId;
+    unsigned int			siteId;					// Innermost section open when the lock was taken, 0 if none
+    uint64_t				nbContended;			// Acquisitions that had to wait
+    tdstGenProfilerData		wait;
+    tdstProfilerHistogram	waitHistogram;
+    tdstGenProfilerData		hold;
+    tdstProfilerHistogram	holdHistogram;
+} tdstProfilerLockStats;
+
+// Lock stats a thread found last for a lock, NULL when none
+#define PROFILER_LOCK_CACHE	8
+
+typedef struct stProfilerLockCacheEntry
+{
+    unsigned int			lockId;
+    unsigned int			siteId;
+    tdstProfilerLockStats	*stats;
+} tdstProfilerLockCacheEntry;
+
+// Hold times and contention of a lock in a section, for its row in reports
+typedef struct stProfilerLockInfo
+{
+    const char				*section;				// NULL outside any section
+    uint64_t				nbContended;
+    tdstGenProfilerData		hold;
+    tdstProfilerHistogram	holdHistogram;
+} tdstProfilerLockInfo;
+
+// Counts of a queue, for its row in reports
+typedef struct stProfilerQueueInfo
+{
+    uint64_t		nbPushed;
+    uint64_t		nbPopped;
+    uint64_t		maxDepth;
+    uint64_t		depth;					// When the report was made
+    double			popsPerSecond;			// Since Zprofiler_enable
+} tdstProfilerQueueInfo;
+
+// Counts of the async span table, for the ASYNC table in reports
+typedef struct stProfilerAsyncInfo
+{
+    uint64_t		nbDropped;				// Begins that found no free slot
+    uint64_t		nbUnmatched;			// Ends that found no open span
+    uint64_t		nbOrphaned;				// Begun before Zprofiler_disable and never ended
+    uint64_t		nbOpen;					// When the report was made
+    double			oldestOpen;				// ms
+} tdstProfilerAsyncInfo;
+
+// An open profile in the call stack
+typedef struct stProfilerFrame
+{
+    unsigned int	node;
+    bool			counted;				// false for recursive calls and frames past LIB_PROFILER_MAX_DEPTH
+    bool			perfRead;				// perfStart was read
+    uint64_t		startTime;
+    uint64_t		perfStart[PROFILER_PERF_COUNTERS];
+#if LIB_PROFILER_TRACK_ALLOCATIONS
+    int64_t			startLiveBytes;			// Live bytes of the thread when the frame was pushed
+    int64_t			peakLiveBytes;			// Most live bytes of the thread since then
+#endif
+} tdstProfilerFrame;
+
+//  Hold the call stack
+typedef std::vector<tdstProfilerFrame> tdCallStackType;
+
+//
+// Everything a thread needs to record: its own call stack and its own tree.
+// A context is registered once, the first time a thread starts a profile, and
+// is only ever touched by that thread. Threads are merged in LogProfiler.
+//
+typedef struct stProfilerThreadContext
+{
+    std::atomic<unsigned long>	threadId;			// Changes when a new thread takes the context
+    
+    // gProfilerGeneration when the tree was last emptied. resets is odd while
+    // ZprofilerResetThreadContext empties it: a report that saw it change while
+    // reading the tree leaves the tree out.
+    std::atomic<unsigned int>	generation;
+    std::atomic<unsigned int>	resets;
+    
+    // Hold the call stack
+    tdCallStackType	callStack;
+    
+    // Calling context tree. Memory grows with the number of distinct contexts.
+    // The histogram of a node has the same index as the node.
+    ZProfilerChunkArray<tdstProfilerNode, 10, 1024>			nodes;
+    ZProfilerChunkArray<tdstProfilerHistogram, 7, 8192>		histograms;
+    ZProfilerChildTable										children;
+    ZProfilerChunkArray<tdstProfilerCounterValue, 10, 1024>	counters;
+    
+    // Bytes allocated minus bytes freed by the thread, with LIB_PROFILER_TRACK_ALLOCATIONS.
+    // Goes below 0 when it frees memory allocated by another thread.
+    int64_t					liveBytes;
+    
+    // perf_event_open group, opened by the thread itself. perfMode is the kind of
+    // events it was opened for, perfNbEvents is 0 when it couldn't be opened.
+    int						perfMode;
+    unsigned int			perfNbEvents;
+    bool					perfRdpmc;				// Every event can be read with rdpmc
+    int						perfFds[PROFILER_PERF_COUNTERS];
+    void					*perfPages[PROFILER_PERF_COUNTERS];
+    
+    // Sampled sites, by site id. Calls that aren't timed push the call stack
+    // depth they were made at, so PROFILER_END knows when it ends one of them.
+    ZProfilerChunkArray<tdstProfilerSiteSampling, 8, 256>	sampling;
+    unsigned int											skipped[LIB_PROFILER_MAX_DEPTH];
+    unsigned int											nbSkipped;
+    
+    // Times of the async spans ended by the thread, by site id, and waits of
+    // the items it popped, by queue id
+    ZProfilerIdStatsTable									asyncStats;
+    ZProfilerIdStatsTable									queueWaits;
+    
+    // Lock stats of the thread, found by (lock id, site id) in lockTable, which
+    // holds their index plus 1. lockCount is the number reports can read.
+    ZProfilerChunkArray<tdstProfilerLockStats, 4, 4096>		lockStats;
+    ZProfilerChildTable										lockTable;
+    std::atomic<unsigned int>								lockCount;
+    
+    // Last stats Zprofiler_lock_stats found, by lock id modulo PROFILER_LOCK_CACHE,
+    // so a lock taken again in the same section skips lockTable
+    tdstProfilerLockCacheEntry								lockCache[PROFILER_LOCK_CACHE];
+    
+    // Timeline ring buffer, allocated on the first event and again when the
+    // timeline is enabled with new settings, under ZprofilerThreadsCriticalSection.
+    // nbEvents is stored with release once the event is written.
+    tdstProfilerEvent		*events;
+    unsigned int			eventMask;			// Ring size - 1
+    int						eventPolicy;
+    unsigned int			eventGeneration;	// gProfilerTimelineGeneration the ring was allocated for
+    std::atomic<uint64_t>	nbEvents;			// Events recorded since the ring was allocated
+    uint64_t				nbEventsDropped;	// Events not recorded with PROFILER_TIMELINE_STOP
+    
+    // Capture chunk being filled. captureBusy is set while an event is written,
+    // so Zprofiler_stop_capture knows when it can take the chunk.
+    tdstProfilerCaptureChunk	*captureChunk;
+    unsigned int				captureLostChunks;
+    std::atomic<int>			captureBusy;
+    
+    // Aggregation queue, allocated on the first record. The thread only moves
+    // recordTail and the aggregation thread only moves recordHead.
+    tdstProfilerRecord			*records;
+    unsigned int				recordMask;			// Queue size - 1
+    int							recordPolicy;
+    uint64_t					recordHeadCache;	// Last recordHead seen by the thread
+    uint64_t					nbRecordsDropped;
+    char						recordPadding[64];
+    std::atomic<uint64_t>		recordTail;
+    char						recordPadding2[64];
+    std::atomic<uint64_t>		recordHead;
+    
+    // Set under ZprofilerThreadsCriticalSection when the thread exited, its stats
+    // merged in the retired context, until a new thread takes the context
+    bool						exited;
+    
+    // The context of ZprofilerCalibrate: it only adds times to its nodes, and
+    // records no timeline, capture or aggregation events
+    bool						calibration;
+    
+    // Next registered thread
+    struct stProfilerThreadContext *next;
+} tdstProfilerThreadContext;
+
+// Contexts of all the threads that ever profiled something. Contexts are never
+// freed, so a thread can keep its pointer across Zprofiler_disable/enable. The
+// context of a thread that exited is given to the next thread that registers.
+tdstProfilerThreadContext *gProfilerThreadContexts = NULL;
+
+// Context of the current thread
+ZPROFILER_TLS tdstProfilerThreadContext *gProfilerThreadContext = NULL;
+
+// Bumped by Zprofiler_disable. Threads empty their own tree when they see it
+// changed, and contexts from an older generation are left out of reports.
+std::atomic<unsigned int>	gProfilerGeneration(0);
+
+// Registered sites, indexed by id. Id 0 is never given to a site.
+std::vector<ZProfilerSite*> gProfilerSites(1, (ZProfilerSite*)NULL);
+
+// Sites created by Zprofiler_start(const char*), by name
+std::map<std::string, ZProfilerSite*> mapProfilerSitesByName;
+
+// Counter names, indexed by id. Counters of the same name share their id.
+std::vector<const char*> gProfilerCounterNames(1, "items");
+
+// Process id written in exports
+unsigned long	gProfilerProcessId = 0;
+
+// Timeline settings. The other settings are written before gProfilerTimelineEnabled
+// is set, and read after it is seen set.
+std::atomic<bool>	gProfilerTimelineEnabled(false);
+unsigned int	gProfilerTimelineEvents = 0;
+int				gProfilerTimelinePolicy = PROFILER_TIMELINE_OVERWRITE;
+
+// Changed by every Zprofiler_enable_timeline, for threads to reallocate their ring
+std::atomic<unsigned int>	gProfilerTimelineGeneration(0);
+
+// Measured cost of a PROFILER_START/PROFILER_END pair, as seen by the section
+// around it, and the part of it a section measures itself. Subtracted from
+// parents and from sections in reports.
+double	gProfilerOverheadTicks = 0.0;
+double	gProfilerSelfOverheadTicks = 0.0;
+
+// Fraction of the time adaptive sampling may spend timing a sampled site
+double	gProfilerSamplingBudget = LIB_PROFILER_SAMPLING_BUDGET;
+
+// Report order, see Zprofiler_set_report_order
+int				gProfilerSortKey = PROFILER_SORT_SELF;
+unsigned int	gProfilerTopSections = LIB_PROFILER_TOP_SECTIONS;
+
+// perf_event_open groups are read while gProfilerPerfEnabled. gProfilerPerfMode
+// stays set after that, for reports.
+std::atomic<bool>	gProfilerPerfEnabled(false);
+std::atomic<int>	gProfilerPerfMode(PROFILER_PERF_NONE);
+
+// Set while a capture is running
+std::atomic<bool>	gProfilerCapturing(false);
+
+// Aggregation settings. gProfilerAggregating is set while threads queue their
+// records, gProfilerAggregatorRunning while the aggregation thread exists.
+std::atomic<bool>	gProfilerAggregating(false);
+std::atomic<bool>	gProfilerAggregatorRunning(false);
+unsigned int		gProfilerAggregationRecords = 0;
+int					gProfilerAggregationPolicy = PROFILER_AGGREGATION_DROP;
+
+// Open async spans, the spans that found no free slot or no open span, and the
+// orphans taken back by a begin. gProfilerAsyncDroppedOpen is the number of
+// dropped spans whose end hasn't come yet: an end that finds no open span is
+// one of them while it isn't 0.
+tdstProfilerAsyncSpan	gProfilerAsyncSpans[LIB_PROFILER_ASYNC_SPANS];
+std::atomic<uint64_t>	gProfilerAsyncDropped(0);
+std::atomic<uint64_t>	gProfilerAsyncDroppedOpen(0);
+std::atomic<uint64_t>	gProfilerAsyncUnmatched(0);
+std::atomic<uint64_t>	gProfilerAsyncOrphaned(0);
+
+// Queue names and counts, indexed by id. Id 0 is never given to a queue.
+std::vector<const char*>	gProfilerQueueNames(1, "");
+tdstProfilerQueueCounts		gProfilerQueueCounts[LIB_PROFILER_MAX_QUEUES];
+
+// Lock names, indexed by id
+std::vector<const char*>	gProfilerLockNames;
+
+void ZprofilerCaptureEvent( tdstProfilerThreadContext *context, unsigned int type, unsigned int siteId, uint64_t time );
+void ZprofilerResetIntervals();
+void ZprofilerAggregationSync();
+void ZprofilerCalibrate();
+
+
+// Critical section functions
+/*
+ void NewCriticalSection( void );
+ void DestroyCriticalSection( void );
+ void LockCriticalSection( void );
+ void UnLockCriticalSection( void );
+ */
+
+//
+// Sites can be registered before Zprofiler_enable and after Zprofiler_disable,
+// so they have their own critical section, created on first use.
+//
+ZCriticalSection_t *ZprofilerSitesCriticalSection()
+{
+    static ZCriticalSection_t *cs = NewCriticalSection();
+    return cs;
+}
+
+//
+// Guards the thread list. Created on first use and never destroyed, since
+// threads may register at any time.
+//
+ZCriticalSection_t *ZprofilerThreadsCriticalSection()
+{
+    static ZCriticalSection_t *cs = NewCriticalSection();
+    return cs;
+}
+
+//
+// Give an id to a site
+//
+unsigned int Zprofiler_register_site( ZProfilerSite *site )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    unsigned int id = (unsigned int)gProfilerSites.size();
+    gProfilerSites.push_back(site);
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+    return id;
+}
+
+//
+// Id of a name in names, from first on, added when it isn't there yet and names
+// has fewer than maxNames: as is, or a copy with copyName, for names that don't
+// outlive the call. 0 when names is full.
+//
+unsigned int ZprofilerRegisterName( vector<const char*> &names, unsigned int first, const char *name, size_t maxNames, bool copyName )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    unsigned int id = first;
+    while( id<names.size() && strcmp(names[id], name) )
+    {
+        id++;
+    }
+    if( id==names.size() )
+    {
+        if( id<maxNames )
+        {
+            names.push_back(copyName ? strdup(name) : name);
+        }
+        else
+        {
+            id = 0;
+        }
+    }
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+    return id;
+}
+
+//
+// Give an id to a counter, the one of the counter of the same name if any
+//
+unsigned int Zprofiler_register_counter( ZProfilerCounter *counter )
+{
+    return ZprofilerRegisterName(gProfilerCounterNames, 0, counter->name, (size_t)-1, false);
+}
+
+//
+// Give an id to a queue, the one of the queue of the same name if any
+//
+unsigned int Zprofiler_register_queue( ZProfilerQueue *queue )
+{
+    return ZprofilerRegisterName(gProfilerQueueNames, 1, queue->name, LIB_PROFILER_MAX_QUEUES, false);
+}
+
+//
+// Give an id to a lock, the one of the lock of the same name if any
+//
+unsigned int Zprofiler_register_lock( const char *name )
+{
+    return ZprofilerRegisterName(gProfilerLockNames, 0, name, (size_t)-1, false);
+}
+
+//
+// Find a site by its name, creating it the first time. The lookup and the
+// insertion are under the same lock, so threads starting the same name for the
+// first time get the same site.
+//
+ZProfilerSite *ZprofilerGetSiteByName( const char *profile_name )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    ZProfilerSite *site;
+    
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    std::map<std::string, ZProfilerSite*>::iterator IterSite = mapProfilerSitesByName.find(profile_name);
+    if( IterSite!=mapProfilerSitesByName.end() )
+    {
+        site = IterSite->second;
+    }
+    else
+    {
+        std::string *name = new std::string(profile_name);
+        site = new ZProfilerSite(name->c_str(), "", 0, 1, (unsigned int)gProfilerSites.size());
+        gProfilerSites.push_back(site);
+        mapProfilerSitesByName.insert(std::make_pair(*name, site));
+    }
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+    return site;
+}
+
+#if IS_OS_MACOSX
+unsigned long GetCurrentThreadId()
+{
+    uint64_t tid;
+    pthread_threadid_np(NULL, &tid);
+    return (unsigned long)tid;
+}
+#elif IS_OS_LINUX
+unsigned long GetCurrentThreadId() { return (unsigned long)syscall(SYS_gettid); }
+#endif
+
+unsigned long ZprofilerGetProcessId()
+{
+#if IS_OS_WINDOWS
+    return (unsigned long)GetCurrentProcessId();
+#else
+    return (unsigned long)getpid();
+#endif
+}
+
+//
+// Wait until the aggregation thread took the queued records of a thread. They
+// point in its tree.
+//
+void ZprofilerWaitRecords( tdstProfilerThreadContext *context )
+{
+    uint64_t recordTail = context->recordTail.load();
+    while( context->recordHead.load()!=recordTail )
+    {
+        if( !gProfilerAggregatorRunning.load() )
+        {
+            context->recordHead.store(recordTail);
+            break;
+        }
+        std::this_thread::yield();
+    }
+}
+
+//
+// Empty a thread tree, keeping its root
+//
+void ZprofilerResetThreadContext( tdstProfilerThreadContext *context )
+{
+    ZprofilerWaitRecords(context);
+    
+    context->resets.fetch_add(1, std::memory_order_acq_rel);
+    context->callStack.clear();
+    context->nodes.clear();
+    context->histograms.clear();
+    context->children.clear();
+    context->counters.clear();
+    context->sampling.clear();
+    context->nbSkipped	= 0;
+    context->asyncStats.clear();
+    context->queueWaits.clear();
+    context->lockStats.clear();
+    context->lockTable.clear();
+    context->lockCount.store(0);
+    memset(context->lockCache, 0, sizeof(context->lockCache));
+    
+    context->nodes.push_back();
+    context->histograms.push_back();
+    context->counters.push_back();
+    
+    context->nbEvents.store(0, std::memory_order_release);
+    context->nbEventsDropped	= 0;
+    context->generation.store(gProfilerGeneration.load(), std::memory_order_relaxed);
+    context->resets.fetch_add(1, std::memory_order_release);
+}
+
+inline bool ZprofilerIsContextCurrent( const tdstProfilerThreadContext *context )
+{
+    return context->generation.load(std::memory_order_relaxed)==gProfilerGeneration.load(std::memory_order_relaxed);
+}
+
+//
+// Start reading the tree of another thread. False when it is being emptied or
+// from an older generation, otherwise resets is kept for ZprofilerEndTreeRead.
+//
+inline bool ZprofilerBeginTreeRead( const tdstProfilerThreadContext *context, unsigned int &resets )
+{
+    resets = context->resets.load(std::memory_order_acquire);
+    return !(resets&1) && ZprofilerIsContextCurrent(context);
+}
+
+//
+// True when the tree wasn't emptied since ZprofilerBeginTreeRead, so what was
+// read from it can be kept
+//
+inline bool ZprofilerEndTreeRead( const tdstProfilerThreadContext *context, unsigned int resets )
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return context->resets.load(std::memory_order_relaxed)==resets;
+}
+
+//
+// Activate the profiler
+//
+bool Zprofiler_enable()
+{
+    // Initialize the timer
+    TimerInit();
+    gProfilerStartTicks = ZprofilerGetTicks();
+    gProfilerProcessId = ZprofilerGetProcessId();
+    
+    ZprofilerResetIntervals();
+    
+    ZprofilerCalibrate();
+    
+    return true;
+}
+
+//
+// Deactivate the profiler
+//
+void Zprofiler_disable()
+{
+    // Dump to file
+    //Zprofiler_dumpToFile( DUMP_FILENAME );
+    
+    // Clear trees. Other threads may be recording, so each one empties its own
+    // tree the next time it starts an outermost profile.
+    gProfilerGeneration.fetch_add(1);
+    gProfilerAsyncDropped.store(0);
+    gProfilerAsyncDroppedOpen.store(0);
+    gProfilerAsyncUnmatched.store(0);
+    gProfilerAsyncOrphaned.store(0);
+    for(unsigned int queue=0;queue<LIB_PROFILER_MAX_QUEUES;queue++)
+    {
+        gProfilerQueueCounts[queue].nbPushed.store(0);
+        gProfilerQueueCounts[queue].maxDepth.store(0);
+        gProfilerQueueCounts[queue].nbPopped.store(0);
+    }
+    
+    ZprofilerResetIntervals();
+}
+
+//
+// Create a thread context and add it to the thread list
+//
+void ZprofilerInitThreadContext( tdstProfilerThreadContext *context, unsigned long threadId )
+{
+    context->threadId.store(threadId, std::memory_order_relaxed);
+    context->callStack.reserve(LIB_PROFILER_MAX_DEPTH);
+    context->events		= NULL;
+    context->eventMask	= 0;
+    context->eventPolicy	= PROFILER_TIMELINE_OVERWRITE;
+    context->eventGeneration	= 0;
+    context->captureChunk		= NULL;
+    context->captureLostChunks	= 0;
+    context->captureBusy.store(0);
+    context->records			= NULL;
+    context->recordMask			= 0;
+    context->recordPolicy		= PROFILER_AGGREGATION_DROP;
+    context->recordHeadCache	= 0;
+    context->nbRecordsDropped	= 0;
+    context->recordTail.store(0);
+    context->recordHead.store(0);
+    context->liveBytes			= 0;
+    context->perfMode			= PROFILER_PERF_NONE;
+    context->perfNbEvents		= 0;
+    context->perfRdpmc			= false;
+    context->exited				= false;
+    context->calibration		= false;
+    context->next				= NULL;
+    context->resets.store(0);
+    ZprofilerResetThreadContext(context);
+}
+
+tdstProfilerThreadContext *ZprofilerNewThreadContext( unsigned long threadId )
+{
+    // Take the context of a thread that exited, if any
+    LockCriticalSection(ZprofilerThreadsCriticalSection());
+    tdstProfilerThreadContext *context = gProfilerThreadContexts;
+    while( context && !context->exited )
+    {
+        context = context->next;
+    }
+    if( context )
+    {
+        context->exited = false;
+    }
+    UnLockCriticalSection(ZprofilerThreadsCriticalSection());
+    if( context )
+    {
+        context->threadId.store(threadId, std::memory_order_relaxed);
+        ZprofilerResetThreadContext(context);
+        return context;
+    }
+    
+    context = new tdstProfilerThreadContext;
+    ZprofilerInitThreadContext(context, threadId);
+    
+    LockCriticalSection(ZprofilerThreadsCriticalSection());
+    context->next				= gProfilerThreadContexts;
+    gProfilerThreadContexts	= context;
+    UnLockCriticalSection(ZprofilerThreadsCriticalSection());
+    
+    return context;
+}
+
+//
+// Thread exit hook: a TLS key whose destructor gets the context of the thread
+//
+void ZprofilerThreadExit( tdstProfilerThreadContext *context );
+
+std::once_flag	gProfilerThreadKeyOnce;
+#if IS_OS_WINDOWS
+DWORD			gProfilerThreadKey = FLS_OUT_OF_INDEXES;
+
+void WINAPI ZprofilerThreadKeyDestructor( void *context )
+{
+    if( context )
+    {
+        ZprofilerThreadExit((tdstProfilerThreadContext*)context);
+    }
+}
+
+void ZprofilerCreateThreadKey()
+{
+    gProfilerThreadKey = FlsAlloc(ZprofilerThreadKeyDestructor);
+}
+
+void ZprofilerSetThreadKey( tdstProfilerThreadContext *context )
+{
+    if( gProfilerThreadKey!=FLS_OUT_OF_INDEXES )
+    {
+        FlsSetValue(gProfilerThreadKey, context);
+    }
+}
+#else
+pthread_key_t	gProfilerThreadKey;
+bool			gProfilerThreadKeyCreated = false;
+
+void ZprofilerThreadKeyDestructor( void *context )
+{
+    ZprofilerThreadExit((tdstProfilerThreadContext*)context);
+}
+
+void ZprofilerCreateThreadKey()
+{
+    gProfilerThreadKeyCreated = (pthread_key_create(&gProfilerThreadKey, ZprofilerThreadKeyDestructor)==0);
+}
+
+void ZprofilerSetThreadKey( tdstProfilerThreadContext *context )
+{
+    if( gProfilerThreadKeyCreated )
+    {
+        pthread_setspecific(gProfilerThreadKey, context);
+    }
+}
+#endif
+
+//
+// Create the context of the calling thread.
+// This is the only place the recording path takes the lock.
+//
+tdstProfilerThreadContext *ZprofilerRegisterThread()
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    std::call_once(gProfilerThreadKeyOnce, ZprofilerCreateThreadKey);
+    tdstProfilerThreadContext *context = ZprofilerNewThreadContext(GetCurrentThreadId());
+    ZprofilerSetThreadKey(context);
+    gProfilerThreadContext = context;
+    return context;
+}
+
+inline tdstProfilerThreadContext *ZprofilerGetThreadContext()
+{
+    tdstProfilerThreadContext *context = gProfilerThreadContext;
+    if( !context )
+    {
+        context = ZprofilerRegisterThread();
+    }
+    return context;
+}
+
+//
+// Allocate the timeline ring of a thread with the current settings, replacing
+// the ring of earlier ones. Readers copy rings under the threads lock, so the
+// old one is swapped under it and freed after.
+//
+void ZprofilerAllocateEvents( tdstProfilerThreadContext *context )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    unsigned int size = 1;
+    while( size<gProfilerTimelineEvents )
+    {
+        size <<= 1;
+    }
+    tdstProfilerEvent *events = new tdstProfilerEvent[size];
+    
+    LockCriticalSection(ZprofilerThreadsCriticalSection());
+    tdstProfilerEvent *oldEvents = context->events;
+    context->events				= events;
+    context->eventMask			= size-1;
+    context->eventPolicy		= gProfilerTimelinePolicy;
+    context->eventGeneration	= gProfilerTimelineGeneration.load(std::memory_order_relaxed);
+    context->nbEventsDropped	= 0;
+    context->nbEvents.store(0, std::memory_order_release);
+    UnLockCriticalSection(ZprofilerThreadsCriticalSection());
+    
+    delete[] oldEvents;
+}
+
+//
+// Append an event to the timeline of a thread
+//
+inline void ZprofilerRecordEvent( tdstProfilerThreadContext *context, unsigned int type, unsigned int siteId, uint64_t time )
+{
+    if( !context->events || context->eventGeneration!=gProfilerTimelineGeneration.load(std::memory_order_relaxed) )
+    {
+        ZprofilerAllocateEvents(context);
+    }
+    uint64_t nbEvents = context->nbEvents.load(std::memory_order_relaxed);
+    if( nbEvents>context->eventMask && context->eventPolicy==PROFILER_TIMELINE_STOP )
+    {
+        context->nbEventsDropped++;
+        return;
+    }
+    tdstProfilerEvent &event = context->events[nbEvents & context->eventMask];
+    event.time		= time;
+    event.siteId	= siteId;
+    event.type		= type;
+    context->nbEvents.store(nbEvents+1, std::memory_order_release);
+}
+
+//
+// Copy the timeline ring of a thread, oldest event first, while the thread
+// keeps recording. With PROFILER_TIMELINE_OVERWRITE, the events overwritten
+// during the copy, and the one being overwritten when it ends, are left out.
+//
+void ZprofilerCopyEvents( tdstProfilerThreadContext *context, vector<tdstProfilerEvent> &events )
+{
+    events.clear();
+    LockCriticalSection(ZprofilerThreadsCriticalSection());
+    if( context->events )
+    {
+        uint64_t size	= (uint64_t)context->eventMask+1;
+        uint64_t last	= context->nbEvents.load(std::memory_order_acquire);
+        uint64_t first	= (last>size) ? last-size : 0;
+        for(uint64_t index=first;index<last;index++)
+        {
+            events.push_back(context->events[index & context->eventMask]);
+        }
+        
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t newLast = context->nbEvents.load(std::memory_order_relaxed);
+        if( newLast<last )
+        {
+            // Reset while copying
+            events.clear();
+        }
+        else if( context->eventPolicy==PROFILER_TIMELINE_OVERWRITE && newLast+1>first+size )
+        {
+            uint64_t overwritten = newLast+1-size-first;
+            events.erase(events.begin(), events.begin()+(size_t)std::min<uint64_t>(overwritten, events.size()));
+        }
+    }
+    UnLockCriticalSection(ZprofilerThreadsCriticalSection());
+}
+
+//
+// Allocate the aggregation queue of a thread
+//
+void ZprofilerAllocateRecords( tdstProfilerThreadContext *context )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    unsigned int size = 1;
+    while( size<gProfilerAggregationRecords )
+    {
+        size <<= 1;
+    }
+    context->records		= new tdstProfilerRecord[size];
+    context->recordMask		= size-1;
+    context->recordPolicy	= gProfilerAggregationPolicy;
+}
+
+//
+// Queue the time of a call for the aggregation thread
+//
+inline void ZprofilerQueueRecord( tdstProfilerThreadContext *context, unsigned int node, uint64_t time )
+{
+    if( !context->records )
+    {
+        ZprofilerAllocateRecords(context);
+    }
+    uint64_t tail = context->recordTail.load(std::memory_order_relaxed);
+    if( tail-context->recordHeadCache>context->recordMask )
+    {
+        context->recordHeadCache = context->recordHead.load(std::memory_order_acquire);
+        while( tail-context->recordHeadCache>context->recordMask )
+        {
+            if( context->recordPolicy==PROFILER_AGGREGATION_DROP || !gProfilerAggregatorRunning.load() )
+            {
+                context->nbRecordsDropped++;
+                return;
+            }
+            std::this_thread::yield();
+            context->recordHeadCache = context->recordHead.load(std::memory_order_acquire);
+        }
+    }
+    tdstProfilerRecord &record = context->records[tail & context->recordMask];
+    record.time	= time;
+    record.node	= node;
+    context->recordTail.store(tail+1, std::memory_order_release);
+}
+
+////
+////	Performance counters
+////
+
+#if IS_OS_LINUX
+void ZprofilerClosePerfGroup( unsigned int nbEvents, int *fds, void **pages )
+{
+    for(unsigned int i=0;i<nbEvents;i++)
+    {
+        if( pages[i] )
+        {
+            munmap(pages[i], sysconf(_SC_PAGESIZE));
+        }
+        close(fds[i]);
+    }
+}
+
+//
+// Open the group of the calling thread. Events count in user space only, which
+// is all a process may count with the default perf_event_paranoid. Context
+// switches only happen in the kernel, so they are counted there when allowed.
+//
+unsigned int ZprofilerOpenPerfGroup( int mode, int *fds, void **pages )
+{
+    static const uint64_t hardwareEvents[] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    static const uint64_t softwareEvents[] = { PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_PAGE_FAULTS, PERF_COUNT_SW_CONTEXT_SWITCHES };
+    
+    const uint64_t *events		= (mode==PROFILER_PERF_HARDWARE) ? hardwareEvents : softwareEvents;
+    unsigned int nbEvents		= (mode==PROFILER_PERF_HARDWARE) ? 4 : 3;
+    for(unsigned int i=0;i<nbEvents;i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size			= sizeof(attr);
+        attr.type			= (mode==PROFILER_PERF_HARDWARE) ? PERF_TYPE_HARDWARE : PERF_TYPE_SOFTWARE;
+        attr.config			= events[i];
+        attr.read_format	= PERF_FORMAT_GROUP;
+        attr.exclude_kernel	= (attr.type==PERF_TYPE_SOFTWARE && attr.config==PERF_COUNT_SW_CONTEXT_SWITCHES) ? 0 : 1;
+        attr.exclude_hv		= 1;
+        fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, i ? fds[0] : -1, 0);
+        if( fds[i]<0 && !attr.exclude_kernel )
+        {
+            attr.exclude_kernel = 1;
+            fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, i ? fds[0] : -1, 0);
+        }
+        if( fds[i]<0 )
+        {
+            ZprofilerClosePerfGroup(i, fds, pages);
+            return 0;
+        }
+        pages[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fds[i], 0);
+        if( pages[i]==MAP_FAILED )
+        {
+            pages[i] = NULL;
+        }
+    }
+    return nbEvents;
+}
+
+//
+// Read an event without a system call. Fails when the event isn't on a counter
+// right now or the kernel doesn't allow rdpmc.
+//
+inline bool ZprofilerReadPerfPage( const void *mappedPage, uint64_t &value )
+{
+#if defined(__x86_64__) || defined(__i386__)
+    const volatile struct perf_event_mmap_page *page = (const volatile struct perf_event_mmap_page *)mappedPage;
+    uint32_t sequence;
+    do
+    {
+        sequence = page->lock;
+        std::atomic_signal_fence(std::memory_order_acquire);
+        uint32_t index = page->index;
+        if( !page->cap_user_rdpmc || !index )
+        {
+            return false;
+        }
+        uint32_t low, high;
+        __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(index-1));
+        unsigned int shift = 64-page->pmc_width;
+        int64_t counter = (int64_t)((((uint64_t)high<<32)|low)<<shift)>>shift;
+        value = (uint64_t)(page->offset+counter);
+        std::atomic_signal_fence(std::memory_order_acquire);
+    } while( page->lock!=sequence );
+    return true;
+#else
+    (void)mappedPage;
+    (void)value;
+    return false;
+#endif
+}
+#endif
+
+//
+// Open or close the group of the calling thread to match gProfilerPerfMode
+//
+void ZprofilerOpenThreadPerf( tdstProfilerThreadContext *context )
+{
+#if IS_OS_LINUX
+    ZprofilerClosePerfGroup(context->perfNbEvents, context->perfFds, context->perfPages);
+    context->perfMode		= gProfilerPerfMode.load(std::memory_order_relaxed);
+    context->perfNbEvents	= 0;
+    context->perfRdpmc		= false;
+    if( context->perfMode!=PROFILER_PERF_NONE )
+    {
+        memset(context->perfPages, 0, sizeof(context->perfPages));
+        context->perfNbEvents = ZprofilerOpenPerfGroup(context->perfMode, context->perfFds, context->perfPages);
+        
+        uint64_t value;
+        context->perfRdpmc = (context->perfNbEvents!=0);
+        for(unsigned int i=0;i<context->perfNbEvents;i++)
+        {
+            context->perfRdpmc = context->perfRdpmc && context->perfPages[i] && ZprofilerReadPerfPage(context->perfPages[i], value);
+        }
+    }
+#else
+    context->perfMode = gProfilerPerfMode.load(std::memory_order_relaxed);
+#endif
+}
+
+//
+// Close the group of the calling thread when it exits. The next thread that
+// takes the context opens its own.
+//
+void ZprofilerCloseThreadPerf( tdstProfilerThreadContext *context )
+{
+#if IS_OS_LINUX
+    ZprofilerClosePerfGroup(context->perfNbEvents, context->perfFds, context->perfPages);
+#endif
+    context->perfMode		= PROFILER_PERF_NONE;
+    context->perfNbEvents	= 0;
+    context->perfRdpmc		= false;
+}
+
+//
+// Read the events of the thread, with rdpmc when possible
+//
+inline bool ZprofilerReadPerf( tdstProfilerThreadContext *context, uint64_t *values )
+{
+    if( context->perfMode!=gProfilerPerfMode.load(std::memory_order_relaxed) )
+    {
+        ZprofilerOpenThreadPerf(context);
+    }
+#if IS_OS_LINUX
+    if( !context->perfNbEvents )
+    {
+        return false;
+    }
+    if( context->perfRdpmc )
+    {
+        unsigned int i = 0;
+        while( i<context->perfNbEvents && ZprofilerReadPerfPage(context->perfPages[i], values[i]) )
+        {
+            i++;
+        }
+        if( i==context->perfNbEvents )
+        {
+            return true;
+        }
+    }
+    
+    uint64_t group[1+PROFILER_PERF_COUNTERS];
+    if( read(context->perfFds[0], group, sizeof(uint64_t)*(1+context->perfNbEvents))<=0 )
+    {
+        return false;
+    }
+    for(unsigned int i=0;i<context->perfNbEvents;i++)
+    {
+        values[i] = group[1+i];
+    }
+    return true;
+#else
+    (void)values;
+    return false;
+#endif
+}
+
+inline void ZprofilerStartPerf( tdstProfilerThreadContext *context, tdstProfilerFrame &frame )
+{
+    if( frame.counted )
+    {
+        frame.perfRead = ZprofilerReadPerf(context, frame.perfStart);
+    }
+}
+
+inline void ZprofilerEndPerf( tdstProfilerThreadContext *context, const tdstProfilerFrame &frame )
+{
+    uint64_t perfEnd[PROFILER_PERF_COUNTERS];
+    if( context->perfMode==gProfilerPerfMode.load(std::memory_order_relaxed) && ZprofilerReadPerf(context, perfEnd) )
+    {
+        uint64_t *perfCounts = context->nodes[frame.node].perfCounts;
+        for(unsigned int i=0;i<context->perfNbEvents;i++)
+        {
+            perfCounts[i] += perfEnd[i]-frame.perfStart[i];
+        }
+    }
+}
+
+//
+// Pick the events every thread will count: hardware ones if a group of them can
+// be opened here, software ones otherwise. Reading them costs the sections around,
+// so the overhead is measured again.
+//
+int Zprofiler_enable_perf_counters()
+{
+    int mode = PROFILER_PERF_NONE;
+#if IS_OS_LINUX
+    int fds[PROFILER_PERF_COUNTERS];
+    void *pages[PROFILER_PERF_COUNTERS];
+    memset(pages, 0, sizeof(pages));
+    unsigned int nbEvents = ZprofilerOpenPerfGroup(PROFILER_PERF_HARDWARE, fds, pages);
+    mode = PROFILER_PERF_HARDWARE;
+    if( !nbEvents )
+    {
+        nbEvents = ZprofilerOpenPerfGroup(PROFILER_PERF_SOFTWARE, fds, pages);
+        mode = nbEvents ? PROFILER_PERF_SOFTWARE : PROFILER_PERF_NONE;
+    }
+    ZprofilerClosePerfGroup(nbEvents, fds, pages);
+#endif
+    if( mode!=PROFILER_PERF_NONE )
+    {
+        gProfilerPerfMode.store(mode);
+        gProfilerPerfEnabled.store(true);
+        ZprofilerCalibrate();
+    }
+    return mode;
+}
+
+void Zprofiler_disable_perf_counters()
+{
+    if( gProfilerPerfEnabled.load() )
+    {
+        gProfilerPerfEnabled.store(false);
+        ZprofilerCalibrate();
+    }
+}
+
+//
+// Add a time to stats and their histogram
+//
+inline void ZprofilerAddSample( tdstGenProfilerData &GenProfilerData, tdstProfilerHistogram &histogram, uint64_t elapsedTime )
+{
+    if( !GenProfilerData.nbCalls || elapsedTime<GenProfilerData.minTime )
+    {
+        GenProfilerData.minTime	= elapsedTime;
+    }
+    if( elapsedTime>GenProfilerData.maxTime )
+    {
+        GenProfilerData.maxTime	= elapsedTime;
+    }
+    GenProfilerData.totalTime	+= elapsedTime;
+    GenProfilerData.sumSquares	+= double(elapsedTime)*double(elapsedTime);
+    GenProfilerData.nbCalls++;
+    
+    histogram.buckets[ZprofilerHistogramBucket(elapsedTime)]++;
+}
+
+//
+// Add the time of a call to its node
+//
+inline void ZprofilerAddTime( tdstProfilerThreadContext *context, unsigned int node, uint64_t elapsedTime )
+{
+    ZprofilerAddSample(context->nodes[node].data, context->histograms[node], elapsedTime);
+}
+
+//
+// Find the child of parent for siteId, adding it when it's the first call
+//
+inline unsigned int ZprofilerGetChildNode( tdstProfilerThreadContext *context, unsigned int parent, unsigned int siteId )
+{
+    tdstProfilerNode &parentNode = context->nodes[parent];
+    unsigned int node = parentNode.lastChild;
+    if( node!=PROFILER_NO_NODE && context->nodes[node].siteId==siteId )
+    {
+        return node;
+    }
+    
+    node = context->children.find(parent, siteId);
+    if( node==PROFILER_NO_NODE )
+    {
+        ZPROFILER_INTERNAL_SCOPE;
+        if( context->nodes.full() )
+        {
+            return parent;
+        }
+        
+        node = context->nodes.size();
+        tdstProfilerNode &childNode = context->nodes.push_back();
+        context->histograms.push_back();
+        childNode.parent		= parent;
+        childNode.siteId		= siteId;
+        childNode.nextSibling.store(parentNode.firstChild.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        
+        // Reports walk the tree while it grows
+        parentNode.firstChild.store(node, std::memory_order_release);
+        context->children.insert(parent, siteId, node);
+    }
+    parentNode.lastChild = node;
+    return node;
+}
+
+//
+// Push the frame of a site on the call stack of a thread. The caller sets its
+// start time, as late as possible.
+//
+inline tdstProfilerFrame &ZprofilerPushFrame( tdstProfilerThreadContext *context, unsigned int siteId )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    tdCallStackType &callStack = context->callStack;
+    
+    tdstProfilerFrame frame;
+    if( callStack.empty() )
+    {
+        if( !ZprofilerIsContextCurrent(context) && !context->nbSkipped )
+        {
+            ZprofilerResetThreadContext(context);
+        }
+        frame.node		= ZprofilerGetChildNode(context, PROFILER_ROOT_NODE, siteId);
+        frame.counted	= (frame.node!=PROFILER_ROOT_NODE);
+    }
+    else
+    {
+        const tdstProfilerFrame &top = callStack.back();
+        
+        // Collapse direct recursion into the outermost call, and stop adding
+        // nodes past the maximum depth
+        if( context->nodes[top.node].siteId==siteId || callStack.size()>=LIB_PROFILER_MAX_DEPTH )
+        {
+            frame.node		= top.node;
+            frame.counted	= false;
+        }
+        else
+        {
+            frame.node		= ZprofilerGetChildNode(context, top.node, siteId);
+            frame.counted	= (frame.node!=top.node);
+        }
+    }
+    
+    frame.perfRead	= false;
+    
+#if LIB_PROFILER_TRACK_ALLOCATIONS
+    frame.startLiveBytes	= context->liveBytes;
+    frame.peakLiveBytes		= context->liveBytes;
+#endif
+    
+    // Push it
+    callStack.push_back(frame);
+    return callStack.back();
+}
+
+//
+// Record the begin event of the frame just pushed
+//
+inline void ZprofilerBeginFrame( tdstProfilerThreadContext *context, const tdstProfilerFrame &frame, unsigned int siteId )
+{
+    if( !frame.counted )
+    {
+        return;
+    }
+    if( gProfilerTimelineEnabled.load(std::memory_order_acquire) && !context->calibration )
+    {
+        ZprofilerRecordEvent(context, PROFILER_EVENT_BEGIN, siteId, frame.startTime);
+    }
+    if( gProfilerCapturing.load(std::memory_order_relaxed) && !context->calibration )
+    {
+        ZprofilerCaptureEvent(context, PROFILER_EVENT_BEGIN, siteId, frame.startTime);
+    }
+}
+
+//
+// Pop the frame on top of the call stack and add its time to its node
+//
+inline void ZprofilerPopFrame( tdstProfilerThreadContext *context, uint64_t endTime )
+{
+    tdCallStackType &callStack = context->callStack;
+    
+    // Check if vector is empty
+    if( callStack.empty() )
+    {
+        LOG( "Il y a une erreur dans le vecteur CallStack !!!\n\n");
+        return;
+    }
+    
+    // Retrieve the last element from the callstack vector
+    const tdstProfilerFrame &frame = callStack.back();
+    if( frame.counted )
+    {
+        if( gProfilerTimelineEnabled.load(std::memory_order_acquire) && !context->calibration )
+        {
+            ZprofilerRecordEvent(context, PROFILER_EVENT_END, context->nodes[frame.node].siteId, endTime);
+        }
+        if( gProfilerCapturing.load(std::memory_order_relaxed) && !context->calibration )
+        {
+            ZprofilerCaptureEvent(context, PROFILER_EVENT_END, context->nodes[frame.node].siteId, endTime);
+        }
+        
+        if( frame.perfRead )
+        {
+            ZprofilerEndPerf(context, frame);
+        }
+        
+        // Compute elapsed time
+        uint64_t elapsedTime = endTime-frame.startTime;
+        
+        if( gProfilerAggregating.load(std::memory_order_relaxed) && !context->calibration )
+        {
+            ZprofilerQueueRecord(context, frame.node, elapsedTime);
+        }
+        else
+        {
+            ZprofilerAddTime(context, frame.node, elapsedTime);
+        }
+    }
+    
+#if LIB_PROFILER_TRACK_ALLOCATIONS
+    // The peak of a call is also one of its caller
+    tdstProfilerAllocations &allocations = context->nodes[frame.node].allocations;
+    if( uint64_t(frame.peakLiveBytes-frame.startLiveBytes)>allocations.peakBytes )
+    {
+        allocations.peakBytes = uint64_t(frame.peakLiveBytes-frame.startLiveBytes);
+    }
+    if( callStack.size()>1 && frame.peakLiveBytes>callStack[callStack.size()-2].peakLiveBytes )
+    {
+        callStack[callStack.size()-2].peakLiveBytes = frame.peakLiveBytes;
+    }
+#endif
+    
+    // Now, pop back the frame from the vector callstack
+    callStack.pop_back();
+}
+
+//
+// Start the profiling of a bunch of code
+//
+void Zprofiler_start( unsigned int siteId )
+{
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    tdstProfilerFrame &frame = ZprofilerPushFrame(context, siteId);
+    if( gProfilerPerfEnabled.load(std::memory_order_relaxed) )
+    {
+        ZprofilerStartPerf(context, frame);
+    }
+    frame.startTime = ZprofilerGetTicks();
+    ZprofilerBeginFrame(context, frame, siteId);
+}
+
+//
+// Start the profiling of a bunch of code, finding the site by its name.
+// Slower than PROFILER_START, kept for code calling it directly.
+//
+void Zprofiler_start( const char *profile_name )
+{
+    Zprofiler_start(ZprofilerGetSiteByName(profile_name)->id);
+}
+
+//
+// Stop the profiling of a bunch of code
+//
+void Zprofiler_end( )
+{
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    
+    // End of a call that wasn't timed
+    if( context->nbSkipped && context->skipped[context->nbSkipped-1]==context->callStack.size() )
+    {
+        context->nbSkipped--;
+        return;
+    }
+    
+    uint64_t endTime = ZprofilerGetTicks();
+    ZprofilerPopFrame(context, endTime);
+}
+
+//
+// Add to a counter of a node
+//
+void ZprofilerAddNodeCounter( tdstProfilerThreadContext *context, unsigned int nodeIndex, unsigned int counterId, uint64_t value )
+{
+    tdstProfilerNode &node = context->nodes[nodeIndex];
+    unsigned int counter = node.firstCounter.load(std::memory_order_relaxed);
+    while( counter!=PROFILER_NO_COUNTER && context->counters[counter].counterId!=counterId )
+    {
+        counter = context->counters[counter].next;
+    }
+    if( counter==PROFILER_NO_COUNTER )
+    {
+        if( context->counters.full() )
+        {
+            return;
+        }
+        counter = context->counters.size();
+        tdstProfilerCounterValue &counterValue = context->counters.push_back();
+        counterValue.counterId	= counterId;
+        counterValue.next		= node.firstCounter.load(std::memory_order_relaxed);
+        
+        // Reports walk the counters while they are added
+        node.firstCounter.store(counter, std::memory_order_release);
+    }
+    context->counters[counter].value += value;
+}
+
+//
+// Add to a counter of the innermost open section
+//
+void Zprofiler_add( unsigned int counterId, uint64_t value )
+{
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    if( context->callStack.empty() )
+    {
+        return;
+    }
+    ZprofilerAddNodeCounter(context, context->callStack.back().node, counterId, value);
+}
+
+//
+// Pick when the next call of a sampled site is timed. An adaptive period is
+// doubled while timing a call costs more than the budget of the time since
+// the last timed call, and halved when it costs much less.
+//
+inline void ZprofilerUpdateSamplingPeriod( tdstProfilerSiteSampling &sampling, unsigned int samplePeriod, uint64_t now )
+{
+    if( samplePeriod!=PROFILER_SAMPLING_ADAPTIVE )
+    {
+        sampling.countdown = samplePeriod;
+        return;
+    }
+    
+    if( !sampling.period )
+    {
+        sampling.period = 1;
+    }
+    else
+    {
+        double budget = gProfilerSamplingBudget*double(now-sampling.lastSampleTime);
+        if( gProfilerOverheadTicks>budget && sampling.period<(1u<<30) )
+        {
+            sampling.period <<= 1;
+        }
+        else if( gProfilerOverheadTicks*4.0<budget && sampling.period>1 )
+        {
+            sampling.period >>= 1;
+        }
+    }
+    sampling.lastSampleTime	= now;
+    sampling.countdown		= sampling.period;
+}
+
+//
+// Start the profiling of a sampled site: time the call, or only count it
+//
+void Zprofiler_start_sampled( ZProfilerSite *site )
+{
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    unsigned int siteId = site->id;
+    if( context->callStack.empty() && !context->nbSkipped && !ZprofilerIsContextCurrent(context) )
+    {
+        ZprofilerResetThreadContext(context);
+    }
+    
+    while( context->sampling.size()<=siteId && !context->sampling.full() )
+    {
+        context->sampling.push_back();
+    }
+    if( context->sampling.size()<=siteId )
+    {
+        Zprofiler_start(siteId);
+        return;
+    }
+    
+    tdstProfilerSiteSampling &sampling = context->sampling[siteId];
+    sampling.nbCalls++;
+    if( sampling.countdown>1 && context->nbSkipped<LIB_PROFILER_MAX_DEPTH )
+    {
+        sampling.countdown--;
+        context->skipped[context->nbSkipped++] = (unsigned int)context->callStack.size();
+        return;
+    }
+    sampling.nbSampled++;
+    
+    tdstProfilerFrame &frame = ZprofilerPushFrame(context, siteId);
+    if( gProfilerPerfEnabled.load(std::memory_order_relaxed) )
+    {
+        ZprofilerStartPerf(context, frame);
+    }
+    frame.startTime = ZprofilerGetTicks();
+    ZprofilerUpdateSamplingPeriod(sampling, site->samplePeriod, frame.startTime);
+    ZprofilerBeginFrame(context, frame, siteId);
+}
+
+//
+// Change the period of the sampled sites with that name
+//
+void Zprofiler_set_sampling( const char *profile_name, unsigned int period )
+{
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    for(size_t site=1;site<gProfilerSites.size();site++)
+    {
+        if( !strcmp(gProfilerSites[site]->name, profile_name) )
+        {
+            gProfilerSites[site]->samplePeriod = period;
+        }
+    }
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+}
+
+void Zprofiler_set_sampling_budget( double budget )
+{
+    gProfilerSamplingBudget = budget;
+}
+
+//
+// First slot of the async span table to look at for an id
+//
+inline unsigned int ZprofilerAsyncSlot( uint64_t id )
+{
+    id *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(id>>32)&(LIB_PROFILER_ASYNC_SPANS-1);
+}
+
+//
+// Begin an async span
+//
+void Zprofiler_async_begin( unsigned int siteId, uint64_t id )
+{
+    uint64_t startTime = ZprofilerGetTicks();
+    unsigned int generation = gProfilerGeneration.load(std::memory_order_relaxed);
+    unsigned int slot = ZprofilerAsyncSlot(id);
+    for(unsigned int probe=0;probe<LIB_PROFILER_ASYNC_PROBES;probe++, slot = (slot+1)&(LIB_PROFILER_ASYNC_SPANS-1))
+    {
+        tdstProfilerAsyncSpan &span = gProfilerAsyncSpans[slot];
+        unsigned int state = span.state.load(std::memory_order_relaxed);
+        
+        // Free, or open since before Zprofiler_disable: its end never came
+        bool orphan = (state==PROFILER_ASYNC_OPEN && span.generation.load(std::memory_order_relaxed)!=generation);
+        if( (state!=PROFILER_ASYNC_FREE && !orphan)
+            || !span.state.compare_exchange_strong(state, PROFILER_ASYNC_BUSY, std::memory_order_acquire) )
+        {
+            continue;
+        }
+        if( orphan )
+        {
+            gProfilerAsyncOrphaned.fetch_add(1, std::memory_order_relaxed);
+        }
+        span.id.store(id, std::memory_order_relaxed);
+        span.siteId		= siteId;
+        span.generation.store(generation, std::memory_order_relaxed);
+        span.startTime.store(startTime, std::memory_order_relaxed);
+        span.state.store(PROFILER_ASYNC_OPEN, std::memory_order_release);
+        return;
+    }
+    gProfilerAsyncDropped.fetch_add(1, std::memory_order_relaxed);
+    gProfilerAsyncDroppedOpen.fetch_add(1, std::memory_order_relaxed);
+}
+
+//
+// Add the time of an async span to the stats of the current thread
+//
+void ZprofilerAddAsyncTime( unsigned int siteId, uint64_t elapsedTime )
+{
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    if( context->callStack.empty() && !context->nbSkipped && !ZprofilerIsContextCurrent(context) )
+    {
+        ZprofilerResetThreadContext(context);
+    }
+    
+    tdstProfilerIdStats *stats = context->asyncStats.get(siteId);
+    if( stats )
+    {
+        ZprofilerAddSample(stats->data, stats->histogram, elapsedTime);
+    }
+}
+
+//
+// End an async span, on any thread
+//
+void Zprofiler_async_end( uint64_t id )
+{
+    uint64_t endTime = ZprofilerGetTicks();
+    unsigned int slot = ZprofilerAsyncSlot(id);
+    for(unsigned int probe=0;probe<LIB_PROFILER_ASYNC_PROBES;probe++, slot = (slot+1)&(LIB_PROFILER_ASYNC_SPANS-1))
+    {
+        tdstProfilerAsyncSpan &span = gProfilerAsyncSpans[slot];
+        unsigned int state = PROFILER_ASYNC_OPEN;
+        if( span.state.load(std::memory_order_relaxed)!=PROFILER_ASYNC_OPEN || span.id.load(std::memory_order_relaxed)!=id
+            || !span.state.compare_exchange_strong(state, PROFILER_ASYNC_BUSY, std::memory_order_acquire) )
+        {
+            continue;
+        }
+        
+        // Ended and begun again with another id since it was checked
+        if( span.id.load(std::memory_order_relaxed)!=id )
+        {
+            span.state.store(PROFILER_ASYNC_OPEN, std::memory_order_release);
+            continue;
+        }
+        unsigned int siteId		= span.siteId;
+        unsigned int generation	= span.generation.load(std::memory_order_relaxed);
+        uint64_t startTime		= span.startTime.load(std::memory_order_relaxed);
+        span.state.store(PROFILER_ASYNC_FREE, std::memory_order_release);
+        
+        // Spans begun before Zprofiler_disable are left out
+        if( generation==gProfilerGeneration.load(std::memory_order_relaxed) )
+        {
+            ZprofilerAddAsyncTime(siteId, (endTime>startTime) ? endTime-startTime : 0);
+        }
+        return;
+    }
+    
+    // The end of a dropped span isn't unmatched
+    uint64_t droppedOpen = gProfilerAsyncDroppedOpen.load(std::memory_order_relaxed);
+    while( droppedOpen && !gProfilerAsyncDroppedOpen.compare_exchange_weak(droppedOpen, droppedOpen-1, std::memory_order_relaxed) )
+    {
+    }
+    if( !droppedOpen )
+    {
+        gProfilerAsyncUnmatched.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//
+// Counts of the async span table for reports. Open spans from an older
+// generation are orphans not taken back yet.
+//
+void ZprofilerGetAsyncInfo( tdstProfilerAsyncInfo &info )
+{
+    info.nbDropped		= gProfilerAsyncDropped.load();
+    info.nbUnmatched	= gProfilerAsyncUnmatched.load();
+    info.nbOrphaned		= gProfilerAsyncOrphaned.load();
+    info.nbOpen			= 0;
+    info.oldestOpen		= 0.0;
+    
+    uint64_t now = ZprofilerGetTicks();
+    uint64_t oldest = now;
+    unsigned int generation = gProfilerGeneration.load(std::memory_order_relaxed);
+    for(unsigned int slot=0;slot<LIB_PROFILER_ASYNC_SPANS;slot++)
+    {
+        const tdstProfilerAsyncSpan &span = gProfilerAsyncSpans[slot];
+        if( span.state.load(std::memory_order_acquire)!=PROFILER_ASYNC_OPEN )
+        {
+            continue;
+        }
+        if( span.generation.load(std::memory_order_relaxed)!=generation )
+        {
+            info.nbOrphaned++;
+            continue;
+        }
+        uint64_t startTime = span.startTime.load(std::memory_order_relaxed);
+        oldest = (startTime<oldest) ? startTime : oldest;
+        info.nbOpen++;
+    }
+    info.oldestOpen = info.nbOpen ? ZprofilerTicksToMs(now-oldest) : 0.0;
+}
+
+//
+// An item goes in a queue: count it and return its stamp
+//
+uint64_t Zprofiler_queue_push( unsigned int queueId )
+{
+    if( queueId )
+    {
+        tdstProfilerQueueCounts &counts = gProfilerQueueCounts[queueId];
+        uint64_t nbPushed = counts.nbPushed.fetch_add(1, std::memory_order_relaxed)+1;
+        uint64_t nbPopped = counts.nbPopped.load(std::memory_order_relaxed);
+        uint64_t maxDepth = counts.maxDepth.load(std::memory_order_relaxed);
+        while( nbPushed>nbPopped && nbPushed-nbPopped>maxDepth
+               && !counts.maxDepth.compare_exchange_weak(maxDepth, nbPushed-nbPopped, std::memory_order_relaxed) )
+        {
+        }
+    }
+    return ZprofilerGetTicks();
+}
+
+//
+// An item comes out of a queue: add its wait to the stats of the current thread
+//
+void Zprofiler_queue_pop( unsigned int queueId, uint64_t stamp )
+{
+    uint64_t endTime = ZprofilerGetTicks();
+    if( !queueId )
+    {
+        return;
+    }
+    gProfilerQueueCounts[queueId].nbPopped.fetch_add(1, std::memory_order_relaxed);
+    
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    if( context->callStack.empty() && !context->nbSkipped && !ZprofilerIsContextCurrent(context) )
+    {
+        ZprofilerResetThreadContext(context);
+    }
+    tdstProfilerIdStats *stats = context->queueWaits.get(queueId);
+    if( stats )
+    {
+        ZprofilerAddSample(stats->data, stats->histogram, (endTime>stamp) ? endTime-stamp : 0);
+    }
+}
+
+//
+// Ticks for code outside the implementation
+//
+uint64_t Zprofiler_get_ticks()
+{
+    return ZprofilerGetTicks();
+}
+
+//
+// Stats of a lock in a section of a thread, added the first time. NULL when the
+// thread has too many.
+//
+tdstProfilerLockStats *ZprofilerGetLockStats( tdstProfilerThreadContext *context, unsigned int lockId, unsigned int siteId )
+{
+    unsigned int index = context->lockTable.find(lockId, siteId);
+    if( index==PROFILER_NO_NODE )
+    {
+        if( context->lockStats.full() )
+        {
+            return NULL;
+        }
+        tdstProfilerLockStats &stats = context->lockStats.push_back();
+        stats.lockId	= lockId;
+        stats.siteId	= siteId;
+        index = context->lockStats.size();
+        context->lockTable.insert(lockId, siteId, index);
+        
+        // Reports read the stats while they are added
+        context->lockCount.store(index, std::memory_order_release);
+    }
+    return &context->lockStats[index-1];
+}
+
+//
+// A ZProfilerMutex is about to be taken: the stats of the lock in the innermost
+// section, found before the lock is held
+//
+tdstProfilerLockStats *Zprofiler_lock_stats( unsigned int lockId )
+{
+    tdstProfilerThreadContext *context = ZprofilerGetThreadContext();
+    unsigned int siteId = 0;
+    if( !context->callStack.empty() )
+    {
+        siteId = context->nodes[context->callStack.back().node].siteId;
+    }
+    else if( !context->nbSkipped && !ZprofilerIsContextCurrent(context) )
+    {
+        ZprofilerResetThreadContext(context);
+    }
+    
+    tdstProfilerLockCacheEntry &entry = context->lockCache[lockId%PROFILER_LOCK_CACHE];
+    if( !entry.stats || entry.lockId!=lockId || entry.siteId!=siteId )
+    {
+        entry.lockId	= lockId;
+        entry.siteId	= siteId;
+        entry.stats		= ZprofilerGetLockStats(context, lockId, siteId);
+    }
+    return entry.stats;
+}
+
+//
+// A ZProfilerMutex was released by the thread that took it: add the hold time up
+// to now, and the wait when there was one. Uncontended acquisitions are only in
+// the hold stats, ZprofilerGetLockWaits counts them as waits of 0.
+//
+void Zprofiler_lock_released( tdstProfilerLockStats *stats, uint64_t waitStart, uint64_t lockTime )
+{
+    uint64_t unlockTime = ZprofilerGetTicks();
+    if( !stats )
+    {
+        return;
+    }
+    if( waitStart )
+    {
+        stats->nbContended++;
+        ZprofilerAddSample(stats->wait, stats->waitHistogram, (lockTime>waitStart) ? lockTime-waitStart : 0);
+    }
+    ZprofilerAddSample(stats->hold, stats->holdHistogram, (unlockTime>lockTime) ? unlockTime-lockTime : 0);
+}
+
+//
+// Waits of all the acquisitions of a lock, the uncontended ones as waits of 0
+//
+void ZprofilerGetLockWaits( const tdstProfilerLockStats &stats, tdstGenProfilerData &wait, tdstProfilerHistogram &histogram )
+{
+    wait		= stats.wait;
+    histogram	= stats.waitHistogram;
+    if( stats.hold.nbCalls>wait.nbCalls )
+    {
+        histogram.buckets[0]	+= (unsigned int)(stats.hold.nbCalls-wait.nbCalls);
+        wait.nbCalls			= stats.hold.nbCalls;
+        wait.minTime			= 0;
+    }
+}
+
+//
+// Scale the stats of the timed calls of a sampled site up to all its calls.
+// Returns the number of timed calls, 0 when nothing was scaled.
+//
+uint64_t ZprofilerScaleData( tdstGenProfilerData &data, uint64_t siteCalls, uint64_t siteSampled )
+{
+    if( !siteSampled || siteCalls<=siteSampled || !data.nbCalls )
+    {
+        return 0;
+    }
+    double scale		= double(siteCalls)/double(siteSampled);
+    uint64_t nbSampled	= data.nbCalls;
+    data.nbCalls		= (unsigned long)(double(data.nbCalls)*scale+0.5);
+    data.totalTime		= (uint64_t)(double(data.totalTime)*scale);
+    data.sumSquares		*= scale;
+    return nbSampled;
+}
+
+uint64_t ZprofilerScaleNodeData( tdstProfilerThreadContext *context, unsigned int siteId, tdstGenProfilerData &data )
+{
+    if( siteId>=context->sampling.size() )
+    {
+        return 0;
+    }
+    const tdstProfilerSiteSampling &sampling = context->sampling[siteId];
+    return ZprofilerScaleData(data, sampling.nbCalls, sampling.nbSampled);
+}
+
+//
+// Relative standard error of the total time estimated from nbSampled calls
+//
+double ZprofilerSamplingError( const tdstGenProfilerData &data, uint64_t nbSampled )
+{
+    if( !nbSampled || !data.nbCalls || !data.totalTime )
+    {
+        return 0.0;
+    }
+    double average	= double(data.totalTime)/double(data.nbCalls);
+    double variance	= data.sumSquares/double(data.nbCalls) - average*average;
+    double fraction	= double(nbSampled)/double(data.nbCalls);
+    return sqrt(variance>0.0 ? variance : 0.0)/average/sqrt(double(nbSampled))*sqrt(fraction<1.0 ? 1.0-fraction : 0.0);
+}
+
+//
+// Mark appended to the name of a sampled section
+//
+void ZprofilerFormatSampling( char *text, unsigned long nbCalls, uint64_t nbSampled, double error )
+{
+    text[0] = 0;
+    if( nbSampled )
+    {
+        sprintf(text, " (sampled 1/%.0f, +-%.1f%%)", double(nbCalls)/double(nbSampled), error*100.0);
+    }
+}
+
+//
+// The context ZprofilerCalibrate runs on, made once, and the critical section
+// that keeps two threads from calibrating on it at the same time
+//
+std::once_flag				gProfilerCalibrationOnce;
+tdstProfilerThreadContext	*gProfilerCalibrationContext = NULL;
+ZCriticalSection_t			*gProfilerCalibrationCriticalSection = NULL;
+
+// File of the sites ZprofilerCalibrate times, which tells them from the others:
+// they are left out of the site names and the sites written to files
+const char gProfilerCalibrationFile[] = __FILE__;
+
+inline bool ZprofilerIsCalibrationSite( const ZProfilerSite *site )
+{
+    return site->file==gProfilerCalibrationFile;
+}
+
+void ZprofilerCreateCalibrationContext()
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    gProfilerCalibrationContext = new tdstProfilerThreadContext;
+    ZprofilerInitThreadContext(gProfilerCalibrationContext, 0);
+    gProfilerCalibrationContext->calibration = true;
+    gProfilerCalibrationCriticalSection = NewCriticalSection();
+}
+
+//
+// Measure what a section pays for each PROFILER_START/PROFILER_END pair it
+// contains, on a context of its own. The fastest of a few runs is kept, so
+// being preempted while measuring doesn't matter.
+//
+void ZprofilerCalibrate()
+{
+    static ZProfilerSite outerSite("ZprofilerCalibrationOuter", gProfilerCalibrationFile, __LINE__);
+    static ZProfilerSite innerSite("ZprofilerCalibrationInner", gProfilerCalibrationFile, __LINE__);
+    static ZProfilerSite emptySite("ZprofilerCalibrationEmpty", gProfilerCalibrationFile, __LINE__);
+    std::call_once(gProfilerCalibrationOnce, ZprofilerCreateCalibrationContext);
+    tdstProfilerThreadContext *calibrationContext = gProfilerCalibrationContext;
+    
+    const unsigned int nbPairs = 1000;
+    double overhead = -1.0, selfOverhead = -1.0;
+    
+    LockCriticalSection(gProfilerCalibrationCriticalSection);
+    tdstProfilerThreadContext *threadContext = gProfilerThreadContext;
+    gProfilerThreadContext = calibrationContext;
+    for(int run=0;run<8;run++)
+    {
+        ZprofilerResetThreadContext(calibrationContext);
+        
+        Zprofiler_start(outerSite.id);
+        for(unsigned int pair=0;pair<nbPairs;pair++)
+        {
+            Zprofiler_start(innerSite.id);
+            Zprofiler_end();
+        }
+        Zprofiler_end();
+        
+        Zprofiler_start(emptySite.id);
+        Zprofiler_end();
+        
+        const tdstProfilerNode &root = calibrationContext->nodes[PROFILER_ROOT_NODE];
+        uint64_t outerTime = 0, emptyTime = 0, innerTime = 0;
+        for(unsigned int node = root.firstChild; node!=PROFILER_NO_NODE; node = calibrationContext->nodes[node].nextSibling)
+        {
+            if( calibrationContext->nodes[node].siteId==outerSite.id )
+            {
+                outerTime = calibrationContext->nodes[node].data.totalTime;
+                if( calibrationContext->nodes[node].firstChild!=PROFILER_NO_NODE )
+                {
+                    innerTime = calibrationContext->nodes[calibrationContext->nodes[node].firstChild].data.totalTime;
+                }
+            }
+            else
+            {
+                emptyTime = calibrationContext->nodes[node].data.totalTime;
+            }
+        }
+        
+        double pairTime = (outerTime>emptyTime) ? double(outerTime-emptyTime)/nbPairs : 0.0;
+        if( overhead<0.0 || pairTime<overhead )
+        {
+            overhead = pairTime;
+        }
+        double innerPairTime = double(innerTime)/nbPairs;
+        if( selfOverhead<0.0 || innerPairTime<selfOverhead )
+        {
+            selfOverhead = innerPairTime;
+        }
+    }
+    gProfilerThreadContext = threadContext;
+    
+    gProfilerOverheadTicks		= overhead;
+    gProfilerSelfOverheadTicks	= (selfOverhead<overhead) ? selfOverhead : overhead;
+    UnLockCriticalSection(gProfilerCalibrationCriticalSection);
+}
+
+//
+// Calls made inside each node of a context: the calls of all its descendants.
+// Children always come after their parent in the node array.
+//
+void ZprofilerGetDescendantCalls( tdstProfilerThreadContext *context, unsigned int nbNodes, vector<uint64_t> &descendantCalls )
+{
+    descendantCalls.assign(nbNodes, 0);
+    for(unsigned int node=nbNodes-1;node>0;node--)
+    {
+        const tdstProfilerNode &child = context->nodes[node];
+        if( child.parent<node )
+        {
+            descendantCalls[child.parent] += descendantCalls[node]+child.data.nbCalls;
+        }
+    }
+}
+
+inline uint64_t ZprofilerGetOverheadTime( uint64_t nbCalls, uint64_t descendantCalls )
+{
+#if defined(LIB_PROFILER_NO_COMPENSATION)
+    return 0;
+#else
+    return (uint64_t)(gProfilerSelfOverheadTicks*double(nbCalls) + gProfilerOverheadTicks*double(descendantCalls));
+#endif
+}
+
+//
+// Take the overhead of the section and its descendant calls out of its times, spread
+// evenly on its calls. The sum of squares is shifted so the standard deviation
+// doesn't change. Returns the overhead taken out.
+//
+uint64_t ZprofilerCompensateData( tdstGenProfilerData &data, uint64_t overheadTime )
+{
+    if( !data.nbCalls || !overheadTime )
+    {
+        return 0;
+    }
+    if( overheadTime>data.totalTime )
+    {
+        overheadTime = data.totalTime;
+    }
+    uint64_t shift	= overheadTime/data.nbCalls;
+    double shiftd	= double(overheadTime)/double(data.nbCalls);
+    data.sumSquares	+= double(data.nbCalls)*shiftd*shiftd - 2.0*shiftd*double(data.totalTime);
+    data.totalTime	-= overheadTime;
+    data.minTime	= (data.minTime>shift) ? data.minTime-shift : 0;
+    data.maxTime	= (data.maxTime>shift) ? data.maxTime-shift : 0;
+    return overheadTime;
+}
+
+//
+// Inclusive time of each node of a context, compensated and scaled as reported,
+// and the part of it spent outside of its children
+//
+void ZprofilerGetSelfTimes( tdstProfilerThreadContext *context, unsigned int nbNodes, const vector<uint64_t> &descendantCalls, vector<uint64_t> &inclusiveTimes, vector<uint64_t> &selfTimes )
+{
+    inclusiveTimes.assign(nbNodes, 0);
+    for(unsigned int node=1;node<nbNodes;node++)
+    {
+        tdstGenProfilerData data = context->nodes[node].data;
+        ZprofilerCompensateData(data, ZprofilerGetOverheadTime(data.nbCalls, descendantCalls[node]));
+        ZprofilerScaleNodeData(context, context->nodes[node].siteId, data);
+        inclusiveTimes[node] = data.totalTime;
+    }
+    
+    vector<int64_t> times(inclusiveTimes.begin(), inclusiveTimes.end());
+    for(unsigned int node=nbNodes-1;node>0;node--)
+    {
+        unsigned int parent = context->nodes[node].parent;
+        if( parent<node )
+        {
+            times[parent] -= (int64_t)inclusiveTimes[node];
+        }
+    }
+    selfTimes.resize(nbNodes);
+    for(unsigned int node=0;node<nbNodes;node++)
+    {
+        selfTimes[node] = (times[node]>0) ? (uint64_t)times[node] : 0;
+    }
+}
+
+//
+// Whether a node is called, directly or not, by a node of the same site. Its
+// time is then already in the time of that node.
+//
+bool ZprofilerIsNestedInSite( const tdstProfilerThreadContext *context, unsigned int node )
+{
+    unsigned int siteId = context->nodes[node].siteId;
+    for(unsigned int parent = context->nodes[node].parent; parent!=PROFILER_ROOT_NODE && parent<node; node = parent, parent = context->nodes[node].parent)
+    {
+        if( context->nodes[parent].siteId==siteId )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// Merge stats of a context into the stats of its section
+//
+void ZprofilerMergeData( tdstGenProfilerData &dst, const tdstGenProfilerData &src )
+{
+    if( src.nbCalls && (!dst.nbCalls || src.minTime<dst.minTime) )
+    {
+        dst.minTime	= src.minTime;
+    }
+    if( src.maxTime>dst.maxTime )
+    {
+        dst.maxTime	= src.maxTime;
+    }
+    dst.totalTime	+= src.totalTime;
+    dst.sumSquares	+= src.sumSquares;
+    dst.nbCalls		+= src.nbCalls;
+}
+
+void ZprofilerMergeHistogram( tdstProfilerHistogram &dst, const tdstProfilerHistogram &src, unsigned int firstBucket = 0, unsigned int lastBucket = PROFILER_HISTOGRAM_BUCKETS-1 )
+{
+    for(unsigned int bucket=firstBucket;bucket<=lastBucket;bucket++)
+    {
+        dst.buckets[bucket] += src.buckets[bucket];
+    }
+}
+
+//
+// Buckets a node can have calls in, from its times as recorded
+//
+inline void ZprofilerHistogramRange( const tdstGenProfilerData &data, unsigned int &firstBucket, unsigned int &lastBucket )
+{
+    firstBucket	= data.nbCalls ? ZprofilerHistogramBucket(data.minTime) : 0;
+    lastBucket	= data.nbCalls ? ZprofilerHistogramBucket(data.maxTime) : 0;
+}
+
+//
+// Time under which percentile (0..1) of the calls are, from the middle of the
+// bucket holding that rank minus the overhead shift, and kept within the min
+// and max times
+//
+void ZprofilerHistogramPercentiles( const tdstProfilerHistogram &histogram, const tdstGenProfilerData &data, const double *percentiles, unsigned int nbPercentiles, uint64_t shift, uint64_t *values,
+                                    unsigned int firstBucket = 0, unsigned int lastBucket = PROFILER_HISTOGRAM_BUCKETS-1 )
+{
+    uint64_t total = 0;
+    for(unsigned int bucket=firstBucket;bucket<=lastBucket;bucket++)
+    {
+        total += histogram.buckets[bucket];
+    }
+    
+    // Percentiles are in increasing order, so one pass finds them all
+    uint64_t count = 0;
+    unsigned int bucket = firstBucket;
+    for(unsigned int i=0;i<nbPercentiles;i++)
+    {
+        if( !total )
+        {
+            values[i] = 0;
+            continue;
+        }
+        uint64_t rank = (uint64_t)ceil(percentiles[i]*double(total));
+        rank = rank ? rank : 1;
+        while( bucket<=lastBucket && count+histogram.buckets[bucket]<rank )
+        {
+            count += histogram.buckets[bucket++];
+        }
+        if( bucket>lastBucket )
+        {
+            values[i] = data.maxTime;
+            continue;
+        }
+        uint64_t low	= ZprofilerHistogramBucketValue(bucket);
+        uint64_t high	= (bucket+1<PROFILER_HISTOGRAM_BUCKETS) ? ZprofilerHistogramBucketValue(bucket+1) : data.maxTime+1;
+        uint64_t value	= low+(high-low-1)/2;
+        value			= (value>shift) ? value-shift : 0;
+        values[i]		= (value<data.minTime) ? data.minTime : (value>data.maxTime) ? data.maxTime : value;
+    }
+}
+
+uint64_t ZprofilerHistogramPercentile( const tdstProfilerHistogram &histogram, const tdstGenProfilerData &data, double percentile, uint64_t shift = 0 )
+{
+    uint64_t value;
+    ZprofilerHistogramPercentiles(histogram, data, &percentile, 1, shift, &value);
+    return value;
+}
+
+inline double ZprofilerStdDevMs( const tdstGenProfilerData &data )
+{
+    if( !data.nbCalls )
+    {
+        return 0.0;
+    }
+    double average	= double(data.totalTime)/double(data.nbCalls);
+    double variance	= data.sumSquares/double(data.nbCalls) - average*average;
+    return ZprofilerTicksToMs(1)*sqrt(variance>0.0 ? variance : 0.0);
+}
+
+#define PROFILER_TABLE_LINE		"_________________________________________________________________________________________________________________________________________________________________________________\n"
+#define PROFILER_TABLE_HEADER	"| Total time   | Self time    | Avg Time     |  Min time    |  Max time    |  p50 time    |  p90 time    |  p99 time    | p99.9 time   |  Std dev     | Calls   | Section\n"
+
+#define PROFILER_TABLE_COLUMNS	10
+
+//
+// Like "%*.4f" and "%*lu", without the cost of printf on every column of
+// every row of a big report. Digits are written two at a time from the end.
+//
+static const char gProfilerDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+inline char *ZprofilerFormatDigits( char *end, uint64_t value )
+{
+    while( value>=100 )
+    {
+        unsigned int pair = (unsigned int)(value%100);
+        value /= 100;
+        end -= 2;
+        memcpy(end, gProfilerDigitPairs+2*pair, 2);
+    }
+    if( value>=10 )
+    {
+        end -= 2;
+        memcpy(end, gProfilerDigitPairs+2*value, 2);
+    }
+    else
+    {
+        *--end = (char)('0'+value);
+    }
+    return end;
+}
+
+inline char *ZprofilerFormatPadded( char *text, const char *start, const char *end, unsigned int width )
+{
+    unsigned int length = (unsigned int)(end-start);
+    if( length<width )
+    {
+        memset(text, ' ', width-length);
+        text += width-length;
+    }
+    memcpy(text, start, length);
+    return text+length;
+}
+
+char *ZprofilerFormatFixed( char *text, double value, unsigned int width )
+{
+    // Halfway cases are rounded by printf, from the exact value
+    double scaled = value*10000.0;
+    if( !(scaled>=0.0 && scaled<1e18) || scaled-floor(scaled)==0.5 )
+    {
+        return text+sprintf(text, "%*.4f", (int)width, value);
+    }
+    uint64_t fixed = (uint64_t)(scaled+0.5);
+    unsigned int fraction = (unsigned int)(fixed%10000);
+    
+    char digits[24];
+    char *end = digits+sizeof(digits);
+    char *start = end-5;
+    start[0] = '.';
+    memcpy(start+1, gProfilerDigitPairs+2*(fraction/100), 2);
+    memcpy(start+3, gProfilerDigitPairs+2*(fraction%100), 2);
+    start = ZprofilerFormatDigits(start, fixed/10000);
+    return ZprofilerFormatPadded(text, start, end, width);
+}
+
+char *ZprofilerFormatUnsigned( char *text, uint64_t value, unsigned int width )
+{
+    char digits[24];
+    char *end = digits+sizeof(digits);
+    return ZprofilerFormatPadded(text, ZprofilerFormatDigits(end, value), end, width);
+}
+
+//
+// "| total | self | ... | calls | " in the layout of PROFILER_TABLE_HEADER, times in ms
+//
+char *ZprofilerFormatColumns( char *text, const double *columns, uint64_t nbCalls )
+{
+    for(unsigned int column=0;column<PROFILER_TABLE_COLUMNS;column++)
+    {
+        *text++ = '|';
+        *text++ = ' ';
+        text = ZprofilerFormatFixed(text, columns[column], 12);
+        *text++ = ' ';
+    }
+    *text++ = '|';
+    *text++ = ' ';
+    text = ZprofilerFormatUnsigned(text, nbCalls, 7);
+    memcpy(text, " | ", 4);
+    return text+3;
+}
+
+//
+// Times of the columns of a table row, in ms. nestedTime is taken out of the
+// total only: it's in there twice.
+//
+void ZprofilerGetRowColumns( double *columns, const tdstGenProfilerData &data, const tdstProfilerHistogram &histogram, uint64_t overheadTime, uint64_t selfTime, uint64_t nestedTime,
+                             unsigned int firstBucket = 0, unsigned int lastBucket = PROFILER_HISTOGRAM_BUCKETS-1 )
+{
+    static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t percentileTimes[4];
+    uint64_t shift = data.nbCalls ? overheadTime/data.nbCalls : 0;
+    ZprofilerHistogramPercentiles(histogram, data, percentiles, 4, shift, percentileTimes, firstBucket, lastBucket);
+    
+    double msPerTick = ZprofilerTicksToMs(1);
+    columns[0] = msPerTick*double(data.totalTime>nestedTime ? data.totalTime-nestedTime : 0);
+    columns[1] = msPerTick*double(selfTime);
+    columns[2] = data.nbCalls ? msPerTick*double(data.totalTime)/data.nbCalls : 0.0;
+    columns[3] = msPerTick*double(data.minTime);
+    columns[4] = msPerTick*double(data.maxTime);
+    columns[5] = msPerTick*double(percentileTimes[0]);
+    columns[6] = msPerTick*double(percentileTimes[1]);
+    columns[7] = msPerTick*double(percentileTimes[2]);
+    columns[8] = msPerTick*double(percentileTimes[3]);
+    columns[9] = ZprofilerStdDevMs(data);
+}
+
+//
+// Fill the columns of a table row, up to the section name. Returns the end of
+// the text.
+//
+char *ZprofilerFormatRow( char *textLine, const tdstGenProfilerData &data, const tdstProfilerHistogram &histogram, uint64_t overheadTime, uint64_t selfTime, uint64_t nestedTime,
+                          unsigned int firstBucket = 0, unsigned int lastBucket = PROFILER_HISTOGRAM_BUCKETS-1 )
+{
+    double columns[PROFILER_TABLE_COLUMNS];
+    ZprofilerGetRowColumns(columns, data, histogram, overheadTime, selfTime, nestedTime, firstBucket, lastBucket);
+    char *end = ZprofilerFormatColumns(textLine, columns, data.nbCalls);
+    *end = 0;
+    return end;
+}
+
+//
+// Text of a report. Messages are appended, each ended by a 0, and given one by
+// one to LIB_PROFILER_PRINTF at the end, so nothing is shared between reports
+// and a line is never cut. The text is kept in chunks that are never moved:
+// a big report costs no copy when it grows.
+//
+#define PROFILER_REPORT_CHUNK	(1<<20)
+
+struct ZProfilerReport
+{
+    ZProfilerReport() : messageStart(0) {}
+    
+    // Room for length more bytes of the current message
+    char *reserve( size_t length )
+    {
+        if( chunks.empty() || chunks.back().size()+length>chunks.back().capacity() )
+        {
+            // The message being written moves to the new chunk
+            std::string chunk;
+            size_t messageLength = chunks.empty() ? 0 : chunks.back().size()-messageStart;
+            chunk.reserve(std::max((size_t)PROFILER_REPORT_CHUNK, messageLength+length));
+            if( messageLength )
+            {
+                chunk.append(chunks.back(), messageStart, messageLength);
+                chunks.back().resize(messageStart);
+            }
+            chunks.push_back(std::string());
+            chunks.back().swap(chunk);
+            messageStart = 0;
+        }
+        std::string &chunk = chunks.back();
+        size_t size = chunk.size();
+        chunk.resize(size+length);
+        return &chunk[size];
+    }
+    // Give back what reserve didn't use
+    void commit( char *end )
+    {
+        std::string &chunk = chunks.back();
+        chunk.resize(end-&chunk[0]);
+    }
+    void append( const char *message, size_t length )
+    {
+        memcpy(reserve(length), message, length);
+    }
+    void append( const char *message )
+    {
+        append(message, strlen(message));
+    }
+    void print( const char *format, ... )
+    {
+        va_list args;
+        for(size_t room = 256;;)
+        {
+            char *text = reserve(room);
+            va_start(args, format);
+            int length = vsnprintf(text, room, format, args);
+            va_end(args);
+            length = (length>0) ? length : 0;
+            if( (size_t)length<room )
+            {
+                commit(text+length);
+                break;
+            }
+            commit(text);
+            room = (size_t)length+1;
+        }
+    }
+    // Ends the message, printed by one LIB_PROFILER_PRINTF
+    void end()
+    {
+        *reserve(1) = 0;
+        messageStart = chunks.back().size();
+    }
+    // Move the messages of another report after the ones of this one
+    void append( ZProfilerReport &report )
+    {
+        for(size_t i=0;i<report.chunks.size();i++)
+        {
+            chunks.push_back(std::string());
+            chunks.back().swap(report.chunks[i]);
+        }
+        messageStart = report.messageStart;
+        report.chunks.clear();
+        report.messageStart = 0;
+    }
+    void flush() const
+    {
+        for(size_t i=0;i<chunks.size();i++)
+        {
+            const std::string &chunk = chunks[i];
+            for(size_t start=0;start<chunk.size();start += strlen(&chunk[start])+1)
+            {
+                LIB_PROFILER_PRINTF(&chunk[start]);
+            }
+        }
+    }
+    
+    std::deque<std::string>	chunks;
+    size_t					messageStart;			// Start of the current message in the last chunk
+};
+
+//
+// Registered thread contexts. They are pushed in front of the list, so the
+// list is reversed to get threads in the order they started profiling.
+//
+void ZprofilerGetThreadContexts( vector<tdstProfilerThreadContext*> &contexts )
+{
+    contexts.clear();
+    LockCriticalSection(ZprofilerThreadsCriticalSection());
+    for(tdstProfilerThreadContext *context = gProfilerThreadContexts; context; context = context->next)
+    {
+        contexts.push_back(context);
+    }
+    UnLockCriticalSection(ZprofilerThreadsCriticalSection());
+    std::reverse(contexts.begin(), contexts.end());
+}
+
+//
+// Names of the registered sites, by id, "" for the calibration ones
+//
+void ZprofilerGetSiteNames( vector<const char*> &siteNames )
+{
+    siteNames.clear();
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    for(size_t site=0;site<gProfilerSites.size();site++)
+    {
+        ZProfilerSite *registered = gProfilerSites[site];
+        siteNames.push_back((registered && !ZprofilerIsCalibrationSite(registered)) ? registered->name : "");
+    }
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+}
+
+//
+// Names of the registered counters, by id
+//
+void ZprofilerGetCounterNames( vector<const char*> &counterNames )
+{
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    counterNames = gProfilerCounterNames;
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+}
+
+//
+// Counters added in a context, by counter id
+//
+void ZprofilerGetNodeCounters( const tdstProfilerThreadContext *context, unsigned int node, std::map<unsigned int, uint64_t> &counters )
+{
+    counters.clear();
+    for(unsigned int counter = context->nodes[node].firstCounter.load(std::memory_order_acquire); counter!=PROFILER_NO_COUNTER; counter = context->counters[counter].next)
+    {
+        counters[context->counters[counter].counterId] += context->counters[counter].value;
+    }
+}
+
+//
+// Counter totals appended to the name of a section, each with its rate per
+// second of the section time
+//
+void ZprofilerFormatCounters( char *text, size_t size, const std::map<unsigned int, uint64_t> &counters, const vector<const char*> &counterNames, uint64_t totalTime )
+{
+    static const char *units[] = { "", "k", "M", "G", "T", "P" };
+    
+    text[0] = 0;
+    size_t length = 0;
+    double seconds = ZprofilerTicksToMs(totalTime)*0.001;
+    for(std::map<unsigned int, uint64_t>::const_iterator iter = counters.begin(); iter!=counters.end() && length<size; ++iter)
+    {
+        const char *name = (iter->first<counterNames.size()) ? counterNames[iter->first] : "?";
+        double rate = (seconds>0.0) ? double(iter->second)/seconds : 0.0;
+        unsigned int unit = 0;
+        while( rate>=1000.0 && unit<sizeof(units)/sizeof(units[0])-1 )
+        {
+            rate /= 1000.0;
+            unit++;
+        }
+        int written = snprintf(text+length, size-length, "%s%s %llu (%.2f%s/s)",
+                               length ? ", " : " [", name, (unsigned long long)iter->second, rate, units[unit]);
+        if( written<0 )
+        {
+            break;
+        }
+        length += (size_t)written;
+    }
+    if( length && length+1<size )
+    {
+        strcat(text, "]");
+    }
+}
+
+//
+// Heap use appended to the name of a section
+//
+void ZprofilerMergeAllocations( tdstProfilerAllocations &dst, const tdstProfilerAllocations &src )
+{
+    dst.nbAllocs	+= src.nbAllocs;
+    dst.allocBytes	+= src.allocBytes;
+    dst.nbFrees		+= src.nbFrees;
+    dst.freeBytes	+= src.freeBytes;
+    if( src.peakBytes>dst.peakBytes )
+    {
+        dst.peakBytes = src.peakBytes;
+    }
+}
+
+const char *ZprofilerFormatBytes( char *text, uint64_t bytes )
+{
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = double(bytes);
+    unsigned int unit = 0;
+    while( value>=1024.0 && unit<sizeof(units)/sizeof(units[0])-1 )
+    {
+        value /= 1024.0;
+        unit++;
+    }
+    sprintf(text, unit ? "%.2f%s" : "%.0f%s", value, units[unit]);
+    return text;
+}
+
+void ZprofilerFormatAllocations( char *text, const tdstProfilerAllocations &allocations )
+{
+    char allocBytes[32], freeBytes[32], peakBytes[32];
+    
+    text[0] = 0;
+    if( allocations.nbAllocs || allocations.nbFrees )
+    {
+        sprintf(text, " {allocs %llu (%s), frees %llu (%s), peak %s}",
+                (unsigned long long)allocations.nbAllocs, ZprofilerFormatBytes(allocBytes, allocations.allocBytes),
+                (unsigned long long)allocations.nbFrees, ZprofilerFormatBytes(freeBytes, allocations.freeBytes),
+                ZprofilerFormatBytes(peakBytes, allocations.peakBytes));
+    }
+}
+
+//
+// Depth and throughput of a queue
+//
+void ZprofilerFormatQueue( char *text, const tdstProfilerQueueInfo &queue )
+{
+    sprintf(text, " (depth max %llu, now %llu, %llu pushed, %.1f popped/s)",
+            (unsigned long long)queue.maxDepth, (unsigned long long)queue.depth,
+            (unsigned long long)queue.nbPushed, queue.popsPerSecond);
+}
+
+//
+// Hold times of a lock in ms, as the columns of its hold histogram
+//
+inline void ZprofilerGetHoldColumns( double *columns, const tdstProfilerLockInfo &lock )
+{
+    ZprofilerGetRowColumns(columns, lock.hold, lock.holdHistogram, 0, lock.hold.totalTime, 0, 0, PROFILER_HISTOGRAM_BUCKETS-1);
+}
+
+//
+// Section, contention and hold times of a lock
+//
+void ZprofilerFormatLock( char *text, size_t size, const tdstProfilerLockInfo &lock, const tdstGenProfilerData &wait )
+{
+    double columns[PROFILER_TABLE_COLUMNS];
+    ZprofilerGetHoldColumns(columns, lock);
+    snprintf(text, size, " (in %s, contended %llu = %.1f%%, hold avg %.4f, p99 %.4f, max %.4f, total %.4f)",
+             lock.section ? lock.section : "no section",
+             (unsigned long long)lock.nbContended, wait.nbCalls ? double(lock.nbContended)*100.0/double(wait.nbCalls) : 0.0,
+             columns[2], columns[7], columns[4], columns[0]);
+}
+
+//
+// What the perf events say of a section: IPC and misses per call from hardware
+// events, CPU use, page faults and context switches per call from software ones
+//
+void ZprofilerFormatPerf( char *text, const uint64_t *perfCounts, const tdstGenProfilerData &data )
+{
+    text[0] = 0;
+    if( !data.nbCalls || !perfCounts[0] )
+    {
+        return;
+    }
+    int mode = gProfilerPerfMode.load();
+    if( mode==PROFILER_PERF_HARDWARE )
+    {
+        sprintf(text, " <IPC %.2f, LLC misses/call %.1f, branch misses/call %.1f>",
+                double(perfCounts[1])/double(perfCounts[0]),
+                double(perfCounts[2])/double(data.nbCalls),
+                double(perfCounts[3])/double(data.nbCalls));
+    }
+    else if( mode==PROFILER_PERF_SOFTWARE )
+    {
+        double wallTime = ZprofilerTicksToMs(data.totalTime);
+        sprintf(text, " <CPU %.0f%%, page faults/call %.2f, context switches/call %.2f>",
+                wallTime>0.0 ? double(perfCounts[0])*1e-6/wallTime*100.0 : 0.0,
+                double(perfCounts[1])/double(data.nbCalls),
+                double(perfCounts[2])/double(data.nbCalls));
+    }
+}
+
+//
+// Value of the sort key of a section
+//
+double ZprofilerSortValue( const tdstProfilerSectionStats &stats, int sortKey )
+{
+    const tdstGenProfilerData &data = stats.data;
+    switch( sortKey )
+    {
+        case PROFILER_SORT_TOTAL:
+            return double(data.totalTime>stats.nestedTime ? data.totalTime-stats.nestedTime : 0);
+        case PROFILER_SORT_AVG:
+            return data.nbCalls ? double(data.totalTime)/double(data.nbCalls) : 0.0;
+        case PROFILER_SORT_CALLS:
+            return double(data.nbCalls);
+        case PROFILER_SORT_P99:
+            return double(ZprofilerHistogramPercentile(stats.histogram, data, 0.99, data.nbCalls ? stats.overheadTime/data.nbCalls : 0));
+        default:
+            return double(stats.selfTime);
+    }
+}
+
+const char *ZprofilerSortName( int sortKey )
+{
+    switch( sortKey )
+    {
+        case PROFILER_SORT_TOTAL:	return "total time";
+        case PROFILER_SORT_AVG:		return "average time";
+        case PROFILER_SORT_CALLS:	return "calls";
+        case PROFILER_SORT_P99:		return "p99 time";
+        default:					return "self time";
+    }
+}
+
+//
+// Biggest key first, then by name
+//
+struct ZprofilerSortKeyLess
+{
+    ZprofilerSortKeyLess( const vector<const char*> &sectionNames ) : names(sectionNames) {}
+    bool operator()( const std::pair<double, size_t> &a, const std::pair<double, size_t> &b ) const
+    {
+        if( a.first!=b.first )
+        {
+            return a.first<b.first;
+        }
+        return strcmp(names[a.second], names[b.second])<0;
+    }
+    const vector<const char*> &names;
+};
+
+//
+// Indices of sections, biggest sort key first, then by name
+//
+void ZprofilerSortSections( const vector<tdstProfilerSectionStats> &sections, const vector<const char*> &names, int sortKey, vector<size_t> &sorted )
+{
+    vector< std::pair<double, size_t> > keys(sections.size());
+    for(size_t i=0;i<sections.size();i++)
+    {
+        keys[i] = std::make_pair(-ZprofilerSortValue(sections[i], sortKey), i);
+    }
+    std::sort(keys.begin(), keys.end(), ZprofilerSortKeyLess(names));
+    sorted.resize(keys.size());
+    for(size_t i=0;i<keys.size();i++)
+    {
+        sorted[i] = keys[i].second;
+    }
+}
+
+//
+// Add the stats of a section to the ones of the same section on another thread
+//
+void ZprofilerMergeStats( tdstProfilerSectionStats &dst, const tdstProfilerSectionStats &src )
+{
+    ZprofilerMergeData(dst.data, src.data);
+    ZprofilerMergeHistogram(dst.histogram, src.histogram);
+    dst.overheadTime	+= src.overheadTime;
+    dst.selfTime		+= src.selfTime;
+    dst.nestedTime		+= src.nestedTime;
+    dst.nbSampled		+= src.nbSampled;
+    dst.nbSiteCalls		+= src.nbSiteCalls;
+    for(std::map<unsigned int, uint64_t>::const_iterator iter = src.counters.begin(); iter!=src.counters.end(); ++iter)
+    {
+        dst.counters[iter->first] += iter->second;
+    }
+    ZprofilerMergeAllocations(dst.allocations, src.allocations);
+    for(unsigned int i=0;i<PROFILER_PERF_COUNTERS;i++)
+    {
+        dst.perfCounts[i] += src.perfCounts[i];
+    }
+}
+
+//
+// Change the order of reports
+//
+void Zprofiler_set_report_order( int sortKey, unsigned int topSections )
+{
+    gProfilerSortKey		= sortKey;
+    gProfilerTopSections	= topSections;
+}
+
+//
+// Stats of the sections of a table, by name. Sites of the same name share a
+// slot, looked up by site id instead of by name for every context.
+//
+typedef struct stProfilerReportTable
+{
+    vector<tdstProfilerSectionStats>	sections;
+    vector<unsigned int>				slots;			// Slot of each section
+    vector<int>							index;			// Section of each slot, -1 if none
+} tdstProfilerReportTable;
+
+tdstProfilerSectionStats &ZprofilerGetReportSection( tdstProfilerReportTable &table, unsigned int slot )
+{
+    if( table.index[slot]<0 )
+    {
+        table.index[slot] = (int)table.sections.size();
+        table.sections.push_back(tdstProfilerSectionStats());
+        table.slots.push_back(slot);
+    }
+    return table.sections[table.index[slot]];
+}
+
+void ZprofilerClearReportTable( tdstProfilerReportTable &table )
+{
+    for(size_t i=0;i<table.slots.size();i++)
+    {
+        table.index[table.slots[i]] = -1;
+    }
+    table.sections.clear();
+    table.slots.clear();
+}
+
+//
+// A row of a report: a node of a calling context tree, or a section of a flat
+// table. Times are in ticks, compensated and scaled.
+//
+typedef struct stProfilerReportRow
+{
+    const char								*name;
+    unsigned int							depth;			// In the calling context tree, 0 in flat tables
+    tdstGenProfilerData						data;
+    const tdstProfilerHistogram				*histogram;
+    unsigned int							firstBucket;	// Buckets the calls can be in
+    unsigned int							lastBucket;
+    uint64_t								overheadTime;
+    uint64_t								selfTime;
+    uint64_t								nestedTime;		// Already counted by a call of the same section
+    uint64_t								nbSampled;
+    const std::map<unsigned int, uint64_t>	*counters;
+    const tdstProfilerAllocations			*allocations;
+    const uint64_t							*perfCounts;
+    const tdstProfilerQueueInfo				*queue;			// Only for rows of the QUEUES table
+    const tdstProfilerLockInfo				*lock;			// Only for rows of the LOCKS table
+} tdstProfilerReportRow;
+
+//
+// Where a report goes. The trees are walked once and every sink gets the same
+// calls: each thread's tree in depth first order, then its flat table, then the
+// flat table of all threads, the async spans, the queues and the locks. Text,
+// JSON, CSV and folded stacks are sinks.
+//
+struct ZProfilerSink
+{
+    virtual ~ZProfilerSink() {}
+    
+    virtual void begin( const vector<const char*> &counterNames ) { (void)counterNames; }
+    virtual void beginTree( unsigned long threadId, uint64_t nbRecordsDropped ) { (void)threadId; (void)nbRecordsDropped; }
+    virtual void node( const tdstProfilerReportRow &row ) { (void)row; }
+    virtual void endTree() {}
+    // threadId is 0 for the table of all threads
+    virtual void beginTable( unsigned long threadId, bool allThreads ) { (void)threadId; (void)allThreads; }
+    virtual void row( const tdstProfilerReportRow &row ) { (void)row; }
+    virtual void endTable() {}
+    // Tables of the async spans, queues and locks of all threads, after the flat tables
+    virtual void beginAsyncTable( const tdstProfilerAsyncInfo &info ) { (void)info; }
+    virtual void beginQueueTable() {}
+    virtual void beginLockTable() {}
+    virtual void end() {}
+};
+
+//
+// Add times kept by id, of an async span, a queue or a lock, to a section of a
+// flat table. They are all self time.
+//
+void ZprofilerMergeIdTimes( tdstProfilerSectionStats &stats, const tdstGenProfilerData &data, const tdstProfilerHistogram &histogram )
+{
+    ZprofilerMergeData(stats.data, data);
+    ZprofilerMergeHistogram(stats.histogram, histogram);
+    stats.selfTime += data.totalTime;
+}
+
+//
+// Send the sections of a flat table sorted by the report key, at most
+// maxSections, and end the table. queues and locks are the infos of the rows
+// of the QUEUES and LOCKS tables, in the order of the sections, NULL for the
+// other tables.
+//
+void ZprofilerWriteSortedRows( ZProfilerSink &sink, const vector<tdstProfilerSectionStats> &sections, const vector<const char*> &names, unsigned int maxSections,
+                               const tdstProfilerQueueInfo *queues, const tdstProfilerLockInfo *locks, vector<size_t> &sorted )
+{
+    ZprofilerSortSections(sections, names, gProfilerSortKey, sorted);
+    for(size_t section=0;section<sorted.size() && section<maxSections;section++)
+    {
+        const tdstProfilerSectionStats &stats = sections[sorted[section]];
+        tdstProfilerReportRow row;
+        row.name			= names[sorted[section]];
+        row.depth			= 0;
+        row.data			= stats.data;
+        row.histogram		= &stats.histogram;
+        row.firstBucket		= 0;
+        row.lastBucket		= PROFILER_HISTOGRAM_BUCKETS-1;
+        row.overheadTime	= stats.overheadTime;
+        row.selfTime		= stats.selfTime;
+        row.nestedTime		= stats.nestedTime;
+        row.nbSampled		= stats.nbSampled;
+        row.counters		= &stats.counters;
+        row.allocations		= &stats.allocations;
+        row.perfCounts		= stats.perfCounts;
+        row.queue			= queues ? &queues[sorted[section]] : NULL;
+        row.lock			= locks ? &locks[sorted[section]] : NULL;
+        sink.row(row);
+    }
+    sink.endTable();
+}
+
+//
+// Send a flat table, sorted by the report key, and merge it into the table of
+// all threads
+//
+void ZprofilerWriteReportTable( ZProfilerSink &sink, tdstProfilerReportTable &table, const vector<const char*> &slotNames, unsigned int maxSections, tdstProfilerReportTable *allThreads )
+{
+    vector<const char*> names(table.sections.size());
+    for(size_t i=0;i<names.size();i++)
+    {
+        names[i] = slotNames[table.slots[i]];
+    }
+    vector<size_t> sorted;
+    ZprofilerWriteSortedRows(sink, table.sections, names, maxSections, NULL, NULL, sorted);
+    
+    for(size_t section=0;section<sorted.size() && section<maxSections && allThreads;section++)
+    {
+        ZprofilerMergeStats(ZprofilerGetReportSection(*allThreads, table.slots[sorted[section]]), table.sections[sorted[section]]);
+    }
+}
+
+//
+// Merge the async spans ended by every thread, by span name
+//
+void ZprofilerGetAsyncTable( const vector<tdstProfilerThreadContext*> &contexts, const vector<unsigned int> &siteSlots, tdstProfilerReportTable &table )
+{
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        tdstProfilerThreadContext *context = contexts[nbThread];
+        if( !ZprofilerIsContextCurrent(context) )
+        {
+            continue;
+        }
+        unsigned int nbStats = context->asyncStats.count.load(std::memory_order_acquire);
+        for(unsigned int index=0;index<nbStats;index++)
+        {
+            const tdstProfilerIdStats &asyncStats = context->asyncStats.stats[index];
+            if( asyncStats.id>=siteSlots.size() || !asyncStats.data.nbCalls )
+            {
+                continue;
+            }
+            ZprofilerMergeIdTimes(ZprofilerGetReportSection(table, siteSlots[asyncStats.id]), asyncStats.data, asyncStats.histogram);
+        }
+    }
+}
+
+//
+// Send the queues that had items, with the waits of all threads
+//
+void ZprofilerWriteQueueTable( ZProfilerSink &sink, const vector<tdstProfilerThreadContext*> &contexts )
+{
+    vector<const char*> queueNames;
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    queueNames = gProfilerQueueNames;
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+    
+    vector<tdstProfilerSectionStats> waits(queueNames.size());
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        tdstProfilerThreadContext *context = contexts[nbThread];
+        if( !ZprofilerIsContextCurrent(context) )
+        {
+            continue;
+        }
+        unsigned int nbStats = context->queueWaits.count.load(std::memory_order_acquire);
+        for(unsigned int index=0;index<nbStats;index++)
+        {
+            const tdstProfilerIdStats &queueWaits = context->queueWaits.stats[index];
+            if( queueWaits.id<waits.size() )
+            {
+                ZprofilerMergeIdTimes(waits[queueWaits.id], queueWaits.data, queueWaits.histogram);
+            }
+        }
+    }
+    
+    double seconds = ZprofilerTicksToMs(ZprofilerGetTicks()-gProfilerStartTicks)*0.001;
+    vector<tdstProfilerSectionStats> sections;
+    vector<const char*> names;
+    vector<tdstProfilerQueueInfo> infos;
+    for(size_t queue=1;queue<queueNames.size();queue++)
+    {
+        const tdstProfilerQueueCounts &counts = gProfilerQueueCounts[queue];
+        tdstProfilerQueueInfo info;
+        info.nbPushed		= counts.nbPushed.load(std::memory_order_relaxed);
+        info.nbPopped		= counts.nbPopped.load(std::memory_order_relaxed);
+        info.maxDepth		= counts.maxDepth.load(std::memory_order_relaxed);
+        info.depth			= (info.nbPushed>info.nbPopped) ? info.nbPushed-info.nbPopped : 0;
+        info.popsPerSecond	= (seconds>0.0) ? double(info.nbPopped)/seconds : 0.0;
+        if( info.nbPushed || info.nbPopped )
+        {
+            sections.push_back(waits[queue]);
+            names.push_back(queueNames[queue]);
+            infos.push_back(info);
+        }
+    }
+    if( sections.empty() )
+    {
+        return;
+    }
+    
+    sink.beginQueueTable();
+    vector<size_t> sorted;
+    ZprofilerWriteSortedRows(sink, sections, names, (unsigned int)-1, &infos[0], NULL, sorted);
+}
+
+//
+// Send the locks of all threads, one row for each lock and section it was
+// taken in
+//
+void ZprofilerWriteLockTable( ZProfilerSink &sink, const vector<tdstProfilerThreadContext*> &contexts, const vector<const char*> &siteNames, const vector<unsigned int> &siteSlots )
+{
+    vector<const char*> lockNames;
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    lockNames = gProfilerLockNames;
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+    
+    // Rows by lock id and site slot
+    std::map< std::pair<unsigned int, unsigned int>, size_t > rows;
+    vector<tdstProfilerSectionStats> sections;
+    vector<const char*> names;
+    vector<tdstProfilerLockInfo> infos;
+    tdstGenProfilerData wait;
+    tdstProfilerHistogram waitHistogram;
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        tdstProfilerThreadContext *context = contexts[nbThread];
+        if( !ZprofilerIsContextCurrent(context) )
+        {
+            continue;
+        }
+        unsigned int nbStats = context->lockCount.load(std::memory_order_acquire);
+        for(unsigned int index=0;index<nbStats;index++)
+        {
+            const tdstProfilerLockStats &lockStats = context->lockStats[index];
+            if( lockStats.lockId>=lockNames.size() || lockStats.siteId>=siteSlots.size() || !lockStats.hold.nbCalls )
+            {
+                continue;
+            }
+            std::pair<unsigned int, unsigned int> key(lockStats.lockId, lockStats.siteId ? siteSlots[lockStats.siteId] : (unsigned int)-1);
+            std::map< std::pair<unsigned int, unsigned int>, size_t >::iterator iter = rows.find(key);
+            if( iter==rows.end() )
+            {
+                iter = rows.insert(std::make_pair(key, sections.size())).first;
+                sections.push_back(tdstProfilerSectionStats());
+                names.push_back(lockNames[lockStats.lockId]);
+                tdstProfilerLockInfo info;
+                memset(&info, 0, sizeof(info));
+                info.section = lockStats.siteId ? siteNames[lockStats.siteId] : NULL;
+                infos.push_back(info);
+            }
+            ZprofilerGetLockWaits(lockStats, wait, waitHistogram);
+            ZprofilerMergeIdTimes(sections[iter->second], wait, waitHistogram);
+            
+            tdstProfilerLockInfo &info = infos[iter->second];
+            info.nbContended += lockStats.nbContended;
+            ZprofilerMergeData(info.hold, lockStats.hold);
+            ZprofilerMergeHistogram(info.holdHistogram, lockStats.holdHistogram);
+        }
+    }
+    if( sections.empty() )
+    {
+        return;
+    }
+    
+    sink.beginLockTable();
+    vector<size_t> sorted;
+    ZprofilerWriteSortedRows(sink, sections, names, (unsigned int)-1, NULL, &infos[0], sorted);
+}
+
+//
+// A node of a thread tree as it is reported: compensated and scaled, with its
+// depth in the tree
+//
+typedef struct stProfilerNodeCopy
+{
+    unsigned int						siteId;			// 0 for sites registered after the report started
+    unsigned int						depth;
+    tdstGenProfilerData					data;
+    unsigned int						firstBucket;	// Buckets the calls can be in, copied to the bucket pool
+    unsigned int						lastBucket;
+    size_t								buckets;		// Index of firstBucket in the bucket pool
+    uint64_t							overheadTime;
+    uint64_t							selfTime;
+    uint64_t							nbSampled;
+    size_t								counters;		// Index of the first counter in the counter pool
+    unsigned int						nbCounters;
+    tdstProfilerAllocations				allocations;
+    uint64_t							perfCounts[PROFILER_PERF_COUNTERS];
+} tdstProfilerNodeCopy;
+
+// Counters of the copied nodes, (counter id, value)
+typedef vector< std::pair<unsigned int, uint64_t> > tdProfilerCounterPool;
+
+//
+// Copy the tree of another thread in depth first order to tree, the histogram
+// buckets its calls are in to buckets and its counters to counters, up to the
+// nodes it has when the copy starts, so the thread can keep recording
+// meanwhile. Copies only hold plain data, so the vectors are filled without
+// constructing anything. False when the tree is from an older generation or
+// was emptied while it was copied.
+//
+bool ZprofilerCopyTree( tdstProfilerThreadContext *context, unsigned int nbSites, vector<tdstProfilerNodeCopy> &tree, vector<unsigned int> &buckets, tdProfilerCounterPool &counters,
+                        vector<uint64_t> &descendantCalls, vector<uint64_t> &inclusiveTimes, vector<uint64_t> &selfTimes )
+{
+    tree.clear();
+    buckets.clear();
+    counters.clear();
+    unsigned int resets;
+    if( !ZprofilerBeginTreeRead(context, resets) )
+    {
+        return false;
+    }
+    
+    // Nodes added while copying are left for the next report
+    const ZProfilerChunkArray<tdstProfilerNode, 10, 1024> &nodes = context->nodes;
+    unsigned int nbNodes = nodes.size();
+    tree.reserve(nbNodes);
+    ZprofilerGetDescendantCalls(context, nbNodes, descendantCalls);
+    ZprofilerGetSelfTimes(context, nbNodes, descendantCalls, inclusiveTimes, selfTimes);
+    
+    // Nodes left to visit with their depth. Children are linked newest first,
+    // and visited from the back of the stack.
+    vector< std::pair<unsigned int, unsigned int> > stack;
+    for(unsigned int child = nodes[PROFILER_ROOT_NODE].firstChild.load(std::memory_order_acquire); child!=PROFILER_NO_NODE; child = nodes[child].nextSibling.load(std::memory_order_relaxed))
+    {
+        if( child<nbNodes )
+        {
+            stack.push_back(std::make_pair(child, 0u));
+        }
+    }
+    // A tree emptied and grown again meanwhile can link a node twice
+    while( !stack.empty() && tree.size()<nbNodes )
+    {
+        unsigned int node	= stack.back().first;
+        unsigned int depth	= stack.back().second;
+        stack.pop_back();
+        
+        const tdstProfilerNode &source = nodes[node];
+        tdstProfilerNodeCopy copy;
+        copy.siteId			= (source.siteId<nbSites) ? source.siteId : 0;
+        copy.depth			= depth;
+        copy.data			= source.data;
+        ZprofilerHistogramRange(copy.data, copy.firstBucket, copy.lastBucket);
+        copy.buckets		= buckets.size();
+        const tdstProfilerHistogram &histogram = context->histograms[node];
+        buckets.insert(buckets.end(), histogram.buckets+copy.firstBucket, histogram.buckets+copy.lastBucket+1);
+        copy.overheadTime	= ZprofilerCompensateData(copy.data, ZprofilerGetOverheadTime(copy.data.nbCalls, descendantCalls[node]));
+        copy.selfTime		= selfTimes[node];
+        copy.nbSampled		= ZprofilerScaleNodeData(context, source.siteId, copy.data);
+        copy.counters		= counters.size();
+        for(unsigned int counter = source.firstCounter.load(std::memory_order_acquire); counter!=PROFILER_NO_COUNTER; counter = context->counters[counter].next)
+        {
+            counters.push_back(std::make_pair(context->counters[counter].counterId, context->counters[counter].value));
+        }
+        copy.nbCounters		= (unsigned int)(counters.size()-copy.counters);
+        copy.allocations	= source.allocations;
+        for(unsigned int i=0;i<PROFILER_PERF_COUNTERS;i++)
+        {
+            // Counted on the timed calls only, like the time
+            copy.perfCounts[i] = copy.nbSampled ? (uint64_t)(double(source.perfCounts[i])*double(copy.data.nbCalls)/double(copy.nbSampled)) : source.perfCounts[i];
+        }
+        tree.push_back(copy);
+        
+        for(unsigned int child = source.firstChild.load(std::memory_order_acquire); child!=PROFILER_NO_NODE; child = nodes[child].nextSibling.load(std::memory_order_relaxed))
+        {
+            if( child<nbNodes )
+            {
+                stack.push_back(std::make_pair(child, depth+1));
+            }
+        }
+    }
+    return ZprofilerEndTreeRead(context, resets);
+}
+
+//
+// Walk the trees of all threads into a sink, with the topSections first
+// sections of all threads at the end. Each tree is copied once, and left out
+// when the thread empties it meanwhile.
+//
+void ZprofilerWriteReport( ZProfilerSink &sink, unsigned int topSections )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    ZprofilerAggregationSync();
+    
+    vector<tdstProfilerThreadContext*> contexts;
+    ZprofilerGetThreadContexts(contexts);
+    
+    // Site names, and the slot of each site
+    vector<const char*> siteNames;
+    ZprofilerGetSiteNames(siteNames);
+    vector<const char*> counterNames;
+    ZprofilerGetCounterNames(counterNames);
+    
+    vector<unsigned int> siteSlots(siteNames.size());
+    vector<const char*> slotNames;
+    {
+        std::map<std::string, unsigned int> slotsByName;
+        for(size_t site=0;site<siteNames.size();site++)
+        {
+            std::map<std::string, unsigned int>::iterator iter = slotsByName.find(siteNames[site]);
+            if( iter==slotsByName.end() )
+            {
+                iter = slotsByName.insert(std::make_pair(std::string(siteNames[site]), (unsigned int)slotNames.size())).first;
+                slotNames.push_back(siteNames[site]);
+            }
+            siteSlots[site] = iter->second;
+        }
+    }
+    
+    tdstProfilerReportTable threadTable, allThreadsTable;
+    threadTable.index.assign(slotNames.size(), -1);
+    allThreadsTable.index.assign(slotNames.size(), -1);
+    
+    // Copy of the tree being written, and the sections above the current node
+    vector<tdstProfilerNodeCopy> tree;
+    vector<unsigned int> buckets;
+    tdProfilerCounterPool counterPool;
+    std::map<unsigned int, uint64_t> counters;
+    tdstProfilerHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    vector<uint64_t> descendantCalls;
+    vector<uint64_t> inclusiveTimes, selfTimes;
+    vector<unsigned int> path;
+    vector<unsigned int> sitesOnPath(siteNames.size(), 0);
+    
+    sink.begin(counterNames);
+    
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        tdstProfilerThreadContext *context = contexts[nbThread];
+        if( !ZprofilerCopyTree(context, (unsigned int)siteNames.size(), tree, buckets, counterPool, descendantCalls, inclusiveTimes, selfTimes) || tree.empty() )
+        {
+            continue;
+        }
+        
+        sink.beginTree(context->threadId.load(std::memory_order_relaxed), context->nbRecordsDropped);
+        
+        for(size_t index=0;index<tree.size();index++)
+        {
+            const tdstProfilerNodeCopy &copy = tree[index];
+            while( path.size()>copy.depth )
+            {
+                sitesOnPath[path.back()]--;
+                path.pop_back();
+            }
+            
+            unsigned int siteId = copy.siteId;
+            std::copy(buckets.begin()+copy.buckets, buckets.begin()+copy.buckets+(copy.lastBucket-copy.firstBucket+1), histogram.buckets+copy.firstBucket);
+            counters.clear();
+            for(size_t counter=copy.counters;counter<copy.counters+copy.nbCounters;counter++)
+            {
+                counters[counterPool[counter].first] += counterPool[counter].second;
+            }
+            
+            tdstProfilerReportRow row;
+            row.name			= siteNames[siteId];
+            row.depth			= copy.depth;
+            row.data			= copy.data;
+            row.histogram		= &histogram;
+            row.firstBucket		= copy.firstBucket;
+            row.lastBucket		= copy.lastBucket;
+            row.overheadTime	= copy.overheadTime;
+            row.selfTime		= copy.selfTime;
+            row.nestedTime		= 0;
+            row.nbSampled		= copy.nbSampled;
+            row.counters		= &counters;
+            row.allocations		= &copy.allocations;
+            row.perfCounts		= copy.perfCounts;
+            row.queue			= NULL;
+            row.lock			= NULL;
+            sink.node(row);
+            
+            tdstProfilerSectionStats &stats = ZprofilerGetReportSection(threadTable, siteSlots[siteId]);
+            ZprofilerMergeData(stats.data, row.data);
+            ZprofilerMergeHistogram(stats.histogram, *row.histogram, row.firstBucket, row.lastBucket);
+            stats.overheadTime += row.overheadTime;
+            stats.selfTime += row.selfTime;
+            if( sitesOnPath[siteId] )
+            {
+                stats.nestedTime += row.data.totalTime;
+            }
+            stats.nbSampled += row.nbSampled;
+            ZprofilerMergeAllocations(stats.allocations, copy.allocations);
+            for(std::map<unsigned int, uint64_t>::const_iterator iter = counters.begin(); iter!=counters.end(); ++iter)
+            {
+                stats.counters[iter->first] += iter->second;
+            }
+            for(unsigned int i=0;i<PROFILER_PERF_COUNTERS;i++)
+            {
+                stats.perfCounts[i] += copy.perfCounts[i];
+            }
+            
+            path.push_back(siteId);
+            sitesOnPath[siteId]++;
+            std::fill(histogram.buckets+copy.firstBucket, histogram.buckets+copy.lastBucket+1, 0u);
+        }
+        while( !path.empty() )
+        {
+            sitesOnPath[path.back()]--;
+            path.pop_back();
+        }
+        sink.endTree();
+        
+        //
+        //	DUMP CALLS
+        //
+        sink.beginTable(context->threadId.load(std::memory_order_relaxed), false);
+        ZprofilerWriteReportTable(sink, threadTable, slotNames, (unsigned int)-1, &allThreadsTable);
+        ZprofilerClearReportTable(threadTable);
+    }
+    
+    if( !allThreadsTable.sections.empty() && topSections )
+    {
+        sink.beginTable(0, true);
+        ZprofilerWriteReportTable(sink, allThreadsTable, slotNames, topSections, NULL);
+    }
+    
+    //
+    //	ASYNC SPANS
+    //
+    tdstProfilerAsyncInfo asyncInfo;
+    ZprofilerGetAsyncInfo(asyncInfo);
+    ZprofilerGetAsyncTable(contexts, siteSlots, threadTable);
+    if( !threadTable.sections.empty() || asyncInfo.nbDropped || asyncInfo.nbUnmatched || asyncInfo.nbOrphaned || asyncInfo.nbOpen )
+    {
+        sink.beginAsyncTable(asyncInfo);
+        ZprofilerWriteReportTable(sink, threadTable, slotNames, (unsigned int)-1, NULL);
+        ZprofilerClearReportTable(threadTable);
+    }
+    
+    //
+    //	QUEUES
+    //
+    ZprofilerWriteQueueTable(sink, contexts);
+    
+    //
+    //	LOCKS
+    //
+    ZprofilerWriteLockTable(sink, contexts, siteNames, siteSlots);
+    sink.end();
+}
+
+//
+// The tables of LogProfiler. Flat tables come after all the trees, so they
+// are kept aside until then.
+//
+struct ZProfilerTextSink : public ZProfilerSink
+{
+    ZProfilerTextSink( ZProfilerReport &textReport ) : report(textReport), table(&textReport), counterNames(NULL), dumpAppended(false) {}
+    
+    void begin( const vector<const char*> &names )
+    {
+        counterNames = &names;
+        report.print("Profiler overhead: %.1f ns per section, %.1f ns of it measured by the section itself. Both are taken out of the times.\n\n",
+                     ZprofilerTicksToMs(1)*gProfilerOverheadTicks*1000000.0,
+                     ZprofilerTicksToMs(1)*gProfilerSelfOverheadTicks*1000000.0);
+        report.end();
+    }
+    void beginTree( unsigned long threadId, uint64_t nbRecordsDropped )
+    {
+        report.print("CALLSTACK of Thread %lu\n", threadId);
+        report.end();
+        if( nbRecordsDropped )
+        {
+            report.print("%llu calls dropped, the aggregation queue was full\n", (unsigned long long)nbRecordsDropped);
+            report.end();
+        }
+        writeHeader(report);
+    }
+    void node( const tdstProfilerReportRow &row )
+    {
+        writeRow(report, row);
+    }
+    void endTree()
+    {
+        report.append(PROFILER_TABLE_LINE "\n");
+        report.end();
+    }
+    void beginTable( unsigned long threadId, bool allThreads )
+    {
+        if( allThreads )
+        {
+            appendDump();
+            report.print("TOP %u sections by %s, all threads\n", gProfilerTopSections, ZprofilerSortName(gProfilerSortKey));
+            report.end();
+            writeHeader(report);
+            table = &report;
+        }
+        else
+        {
+            dump.print("DUMP of Thread %lu, by %s\n", threadId, ZprofilerSortName(gProfilerSortKey));
+            dump.end();
+            writeHeader(dump);
+            table = &dump;
+        }
+    }
+    void beginAsyncTable( const tdstProfilerAsyncInfo &info )
+    {
+        appendDump();
+        report.print("ASYNC spans, all threads, by %s\n", ZprofilerSortName(gProfilerSortKey));
+        report.end();
+        if( info.nbDropped )
+        {
+            report.print("%llu spans dropped, the table was full\n", (unsigned long long)info.nbDropped);
+            report.end();
+        }
+        if( info.nbUnmatched )
+        {
+            report.print("%llu ends without an open span\n", (unsigned long long)info.nbUnmatched);
+            report.end();
+        }
+        if( info.nbOrphaned )
+        {
+            report.print("%llu spans never ended, begun before Zprofiler_disable\n", (unsigned long long)info.nbOrphaned);
+            report.end();
+        }
+        if( info.nbOpen )
+        {
+            report.print("%llu spans open, the oldest for %.3f ms\n", (unsigned long long)info.nbOpen, info.oldestOpen);
+            report.end();
+        }
+        writeHeader(report);
+        table = &report;
+    }
+    void beginQueueTable()
+    {
+        appendDump();
+        report.print("QUEUES, all threads, waits by %s\n", ZprofilerSortName(gProfilerSortKey));
+        report.end();
+        writeHeader(report);
+        table = &report;
+    }
+    void beginLockTable()
+    {
+        appendDump();
+        report.print("LOCKS, all threads, waits by %s\n", ZprofilerSortName(gProfilerSortKey));
+        report.end();
+        writeHeader(report);
+        table = &report;
+    }
+    void row( const tdstProfilerReportRow &row )
+    {
+        writeRow(*table, row);
+    }
+    void endTable()
+    {
+        table->append(PROFILER_TABLE_LINE "\n");
+        table->end();
+    }
+    void end()
+    {
+        appendDump();
+    }
+    
+    void appendDump()
+    {
+        if( !dumpAppended )
+        {
+            report.append("\n\n");
+            report.end();
+            report.append(dump);
+            dumpAppended = true;
+        }
+    }
+    void writeHeader( ZProfilerReport &text )
+    {
+        text.append(PROFILER_TABLE_LINE);
+        text.end();
+        text.append(PROFILER_TABLE_HEADER);
+        text.end();
+        text.append(PROFILER_TABLE_LINE);
+        text.end();
+    }
+    
+    //
+    // Columns, indent, name and the details only some sections have
+    //
+    void writeRow( ZProfilerReport &text, const tdstProfilerReportRow &row )
+    {
+        char detailText[256];
+        const tdstGenProfilerData &data = row.data;
+        
+        // Room for the columns, even the ones left to printf, and the indent
+        size_t nameLength = strlen(row.name);
+        char *line = text.reserve(PROFILER_TABLE_COLUMNS*48+32+2*row.depth+nameLength);
+        line = ZprofilerFormatRow(line, data, *row.histogram, row.overheadTime, row.selfTime, row.nestedTime, row.firstBucket, row.lastBucket);
+        memset(line, ' ', 2*row.depth);
+        line += 2*row.depth;
+        memcpy(line, row.name, nameLength);
+        text.commit(line+nameLength);
+        
+        if( row.nbSampled )
+        {
+            ZprofilerFormatSampling(detailText, data.nbCalls, row.nbSampled, ZprofilerSamplingError(data, row.nbSampled));
+            text.append(detailText);
+        }
+        if( !row.counters->empty() )
+        {
+            ZprofilerFormatCounters(detailText, sizeof(detailText), *row.counters, *counterNames, data.totalTime>row.nestedTime ? data.totalTime-row.nestedTime : 0);
+            text.append(detailText);
+        }
+        if( row.allocations->nbAllocs || row.allocations->nbFrees )
+        {
+            ZprofilerFormatAllocations(detailText, *row.allocations);
+            text.append(detailText);
+        }
+        if( row.perfCounts[0] )
+        {
+            ZprofilerFormatPerf(detailText, row.perfCounts, data);
+            text.append(detailText);
+        }
+        if( row.queue )
+        {
+            ZprofilerFormatQueue(detailText, *row.queue);
+            text.append(detailText);
+        }
+        if( row.lock )
+        {
+            ZprofilerFormatLock(detailText, sizeof(detailText), *row.lock, data);
+            text.append(detailText);
+        }
+        text.append("\n", 1);
+        text.end();
+    }
+    
+    ZProfilerReport					&report;
+    ZProfilerReport					dump;
+    ZProfilerReport					*table;
+    const vector<const char*>		*counterNames;
+    bool							dumpAppended;
+};
+
+//
+// Dump all data in a file
+//
+
+void LogProfiler()
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    ZProfilerReport report;
+    ZProfilerTextSink sink(report);
+    ZprofilerWriteReport(sink, gProfilerTopSections);
+    report.flush();
+}
+
+////
+////	Intervals
+////
+
+//
+// Interval state. Threads only add to their trees, so the stats of an interval
+// are the totals of every section at its end minus the totals at its start.
+//
+typedef struct stProfilerIntervals
+{
+    vector<tdstProfilerSectionStats>		previous;		// Totals by site id at the end of the last interval
+    vector<tdstProfilerSectionStats>		current;
+    uint64_t								startTicks;
+    uint64_t								nbIntervals;
+    std::deque<tdstProfilerInterval>		history;		// Last intervals, oldest first
+    unsigned int							historySize;
+} tdstProfilerIntervals;
+
+tdstProfilerIntervals gProfilerIntervals = { vector<tdstProfilerSectionStats>(), vector<tdstProfilerSectionStats>(), 0, 0, std::deque<tdstProfilerInterval>(), LIB_PROFILER_INTERVAL_HISTORY };
+
+ZCriticalSection_t *ZprofilerIntervalsCriticalSection()
+{
+    static ZCriticalSection_t *cs = NewCriticalSection();
+    return cs;
+}
+
+//
+// Forget the intervals, when the trees are cleared
+//
+void ZprofilerResetIntervals()
+{
+    LockCriticalSection(ZprofilerIntervalsCriticalSection());
+    gProfilerIntervals.previous.clear();
+    gProfilerIntervals.history.clear();
+    gProfilerIntervals.nbIntervals	= 0;
+    gProfilerIntervals.startTicks	= ZprofilerGetTicks();
+    UnLockCriticalSection(ZprofilerIntervalsCriticalSection());
+}
+
+//
+// Close the current interval
+//
+void Zprofiler_frame()
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    uint64_t endTicks = ZprofilerGetTicks();
+    
+    ZprofilerAggregationSync();
+    
+    vector<tdstProfilerThreadContext*> contexts;
+    ZprofilerGetThreadContexts(contexts);
+    
+    vector<const char*> siteNames;
+    ZprofilerGetSiteNames(siteNames);
+    
+    LockCriticalSection(ZprofilerIntervalsCriticalSection());
+    
+    // Totals of every section, all threads and contexts merged
+    vector<tdstProfilerSectionStats> &current = gProfilerIntervals.current;
+    current.assign(siteNames.size(), tdstProfilerSectionStats());
+    vector<uint64_t> descendantCalls;
+    vector<uint64_t> inclusiveTimes, selfTimes;
+    vector<tdstProfilerSectionStats> threadSections;
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        tdstProfilerThreadContext *context = contexts[nbThread];
+        unsigned int resets;
+        if( !ZprofilerBeginTreeRead(context, resets) )
+        {
+            continue;
+        }
+        
+        // Nodes added while walking may not be filled in yet: their site is 0
+        threadSections.assign(current.size(), tdstProfilerSectionStats());
+        unsigned int nbNodes = context->nodes.size();
+        ZprofilerGetDescendantCalls(context, nbNodes, descendantCalls);
+        ZprofilerGetSelfTimes(context, nbNodes, descendantCalls, inclusiveTimes, selfTimes);
+        for(unsigned int node=1;node<nbNodes;node++)
+        {
+            unsigned int siteId = context->nodes[node].siteId;
+            if( siteId==0 || siteId>=threadSections.size() )
+            {
+                continue;
+            }
+            ZprofilerMergeData(threadSections[siteId].data, context->nodes[node].data);
+            ZprofilerMergeHistogram(threadSections[siteId].histogram, context->histograms[node]);
+            threadSections[siteId].overheadTime += ZprofilerGetOverheadTime(context->nodes[node].data.nbCalls, descendantCalls[node]);
+            threadSections[siteId].selfTime += selfTimes[node];
+            if( ZprofilerIsNestedInSite(context, node) )
+            {
+                threadSections[siteId].nestedTime += inclusiveTimes[node];
+            }
+        }
+        
+        unsigned int nbSampling = context->sampling.size();
+        for(unsigned int siteId=1;siteId<nbSampling && siteId<threadSections.size();siteId++)
+        {
+            threadSections[siteId].nbSiteCalls	+= context->sampling[siteId].nbCalls;
+            threadSections[siteId].nbSampled	+= context->sampling[siteId].nbSampled;
+        }
+        
+        // A tree emptied meanwhile is left out
+        if( !ZprofilerEndTreeRead(context, resets) )
+        {
+            continue;
+        }
+        for(size_t siteId=1;siteId<current.size();siteId++)
+        {
+            if( threadSections[siteId].data.nbCalls || threadSections[siteId].nbSiteCalls )
+            {
+                ZprofilerMergeStats(current[siteId], threadSections[siteId]);
+            }
+        }
+    }
+    
+    vector<tdstProfilerSectionStats> &previous = gProfilerIntervals.previous;
+    previous.resize(current.size());
+    
+    tdstProfilerInterval interval;
+    interval.index		= gProfilerIntervals.nbIntervals++;
+    interval.startTime	= ZprofilerTicksToMs(gProfilerIntervals.startTicks-gProfilerStartTicks);
+    interval.duration	= ZprofilerTicksToMs(endTicks-gProfilerIntervals.startTicks);
+    
+    for(size_t siteId=1;siteId<current.size();siteId++)
+    {
+        const tdstGenProfilerData &end = current[siteId].data;
+        const tdstGenProfilerData &start = previous[siteId].data;
+        if( end.nbCalls<=start.nbCalls )
+        {
+            continue;
+        }
+        
+        // Min and max of the whole run bound the ones of the interval
+        tdstGenProfilerData delta = end;
+        delta.nbCalls		= end.nbCalls-start.nbCalls;
+        delta.totalTime		= end.totalTime-start.totalTime;
+        delta.sumSquares	= end.sumSquares-start.sumSquares;
+        uint64_t shift		= ZprofilerCompensateData(delta, current[siteId].overheadTime-previous[siteId].overheadTime)/delta.nbCalls;
+        uint64_t nbSampled	= ZprofilerScaleData(delta, current[siteId].nbSiteCalls-previous[siteId].nbSiteCalls, current[siteId].nbSampled-previous[siteId].nbSampled);
+        
+        tdstProfilerHistogram histogram;
+        for(unsigned int bucket=0;bucket<PROFILER_HISTOGRAM_BUCKETS;bucket++)
+        {
+            histogram.buckets[bucket] = current[siteId].histogram.buckets[bucket]-previous[siteId].histogram.buckets[bucket];
+        }
+        
+        tdstProfilerIntervalSection section;
+        section.siteId		= (unsigned int)siteId;
+        section.name		= siteNames[siteId];
+        section.nbCalls		= delta.nbCalls;
+        section.avgTime		= ZprofilerTicksToMs(delta.totalTime)/delta.nbCalls;
+        uint64_t nestedTime	= current[siteId].nestedTime-previous[siteId].nestedTime;
+        section.totalTime	= ZprofilerTicksToMs(delta.totalTime>nestedTime ? delta.totalTime-nestedTime : 0);
+        section.selfTime	= ZprofilerTicksToMs(current[siteId].selfTime-previous[siteId].selfTime);
+        static const double percentiles[] = { 0.0, 0.5, 0.9, 0.99, 0.999, 1.0 };
+        uint64_t percentileTimes[6];
+        ZprofilerHistogramPercentiles(histogram, delta, percentiles, 6, shift, percentileTimes);
+        section.minTime		= ZprofilerTicksToMs(percentileTimes[0]);
+        section.maxTime		= ZprofilerTicksToMs(percentileTimes[5]);
+        section.p50Time		= ZprofilerTicksToMs(percentileTimes[1]);
+        section.p90Time		= ZprofilerTicksToMs(percentileTimes[2]);
+        section.p99Time		= ZprofilerTicksToMs(percentileTimes[3]);
+        section.p999Time	= ZprofilerTicksToMs(percentileTimes[4]);
+        section.stdDev		= ZprofilerStdDevMs(delta);
+        section.nbSampled	= (unsigned long)nbSampled;
+        section.sampleError	= ZprofilerSamplingError(delta, nbSampled);
+        
+        // Bucket estimates can't pass the average, and a single call is known exactly
+        section.minTime		= (section.minTime<section.avgTime) ? section.minTime : section.avgTime;
+        section.maxTime		= (section.maxTime>section.avgTime) ? section.maxTime : section.avgTime;
+        if( delta.nbCalls==1 )
+        {
+            section.minTime = section.maxTime = section.p50Time = section.p90Time = section.p99Time = section.p999Time = section.avgTime;
+        }
+        interval.sections.push_back(section);
+    }
+    previous.swap(current);
+    gProfilerIntervals.startTicks = endTicks;
+    
+    std::deque<tdstProfilerInterval> &history = gProfilerIntervals.history;
+    if( gProfilerIntervals.historySize )
+    {
+        if( history.size()==gProfilerIntervals.historySize )
+        {
+            history.pop_front();
+        }
+        history.push_back(tdstProfilerInterval());
+        history.back().index		= interval.index;
+        history.back().startTime	= interval.startTime;
+        history.back().duration		= interval.duration;
+        history.back().sections.swap(interval.sections);
+    }
+    
+    UnLockCriticalSection(ZprofilerIntervalsCriticalSection());
+}
+
+//
+// Number of intervals kept. Changing it forgets the ones already kept.
+//
+void Zprofiler_set_interval_history( unsigned int count )
+{
+    LockCriticalSection(ZprofilerIntervalsCriticalSection());
+    gProfilerIntervals.history.clear();
+    gProfilerIntervals.historySize = count;
+    UnLockCriticalSection(ZprofilerIntervalsCriticalSection());
+}
+
+//
+// Copy a closed interval, 0 being the last one
+//
+bool Zprofiler_get_interval( unsigned int age, tdstProfilerInterval &interval )
+{
+    bool found = false;
+    LockCriticalSection(ZprofilerIntervalsCriticalSection());
+    std::deque<tdstProfilerInterval> &history = gProfilerIntervals.history;
+    if( age<history.size() )
+    {
+        interval = history[history.size()-1-age];
+        found = true;
+    }
+    UnLockCriticalSection(ZprofilerIntervalsCriticalSection());
+    return found;
+}
+
+//
+// Dump a closed interval, 0 being the last one
+//
+void LogProfilerInterval( unsigned int age )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    tdstProfilerInterval interval;
+    if( !Zprofiler_get_interval(age, interval) )
+    {
+        return;
+    }
+    
+    ZProfilerReport report;
+    report.print("INTERVAL %llu at %.4f ms, %.4f ms long\n", (unsigned long long)interval.index, interval.startTime, interval.duration);
+    report.end();
+    report.append(PROFILER_TABLE_LINE);
+    report.end();
+    report.append(PROFILER_TABLE_HEADER);
+    report.end();
+    report.append(PROFILER_TABLE_LINE);
+    report.end();
+    char textLine[512];
+    char sampledText[64];
+    
+    vector< std::pair<double, size_t> > sorted;
+    for(size_t i=0;i<interval.sections.size();i++)
+    {
+        const tdstProfilerIntervalSection &section = interval.sections[i];
+        double key;
+        switch( gProfilerSortKey )
+        {
+            case PROFILER_SORT_TOTAL:	key = section.totalTime; break;
+            case PROFILER_SORT_AVG:		key = section.avgTime; break;
+            case PROFILER_SORT_CALLS:	key = double(section.nbCalls); break;
+            case PROFILER_SORT_P99:		key = section.p99Time; break;
+            default:					key = section.selfTime; break;
+        }
+        sorted.push_back(std::make_pair(-key, i));
+    }
+    std::stable_sort(sorted.begin(), sorted.end());
+    
+    for(size_t i=0;i<sorted.size();i++)
+    {
+        const tdstProfilerIntervalSection &section = interval.sections[sorted[i].second];
+        double columns[PROFILER_TABLE_COLUMNS] = { section.totalTime, section.selfTime, section.avgTime, section.minTime, section.maxTime,
+                                                   section.p50Time, section.p90Time, section.p99Time, section.p999Time, section.stdDev };
+        char *end = ZprofilerFormatColumns(textLine, columns, section.nbCalls);
+        report.append(textLine, end-textLine);
+        report.append(section.name);
+        ZprofilerFormatSampling(sampledText, section.nbCalls, section.nbSampled, section.sampleError);
+        report.append(sampledText);
+        report.append("\n", 1);
+        report.end();
+    }
+    report.append(PROFILER_TABLE_LINE "\n");
+    report.end();
+    report.flush();
+}
+
+////
+////	Timeline
+////
+
+void Zprofiler_enable_timeline( unsigned int eventsPerThread, int policy )
+{
+    gProfilerTimelineEvents		= eventsPerThread ? eventsPerThread : 1;
+    gProfilerTimelinePolicy		= policy;
+    
+    // Threads replace their ring with one of the new settings on their next event
+    gProfilerTimelineGeneration.fetch_add(1, std::memory_order_relaxed);
+    gProfilerTimelineEnabled.store(true, std::memory_order_release);
+}
+
+void Zprofiler_disable_timeline()
+{
+    gProfilerTimelineEnabled.store(false, std::memory_order_release);
+}
+
+//
+// Write a string as a JSON string, with its quotes
+//
+void ZprofilerWriteJsonString( FILE *file, const char *text )
+{
+    fputc('"', file);
+    for(; *text; text++)
+    {
+        unsigned char c = (unsigned char)*text;
+        if( c=='"' || c=='\\' )
+        {
+            fputc('\\', file);
+            fputc(c, file);
+        }
+        else if( c<0x20 )
+        {
+            fprintf(file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+//
+// Write the timelines of all threads as Chrome Trace Event JSON.
+// Begin/end pairs are written as complete ("X") events; events that lost their
+// pair when the ring wrapped or stopped are skipped.
+//
+bool Zprofiler_export_chrome_trace( const char *filename )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    FILE *file = fopen(filename, "wt");
+    if( !file )
+    {
+        return false;
+    }
+    
+    vector<tdstProfilerThreadContext*> contexts;
+    ZprofilerGetThreadContexts(contexts);
+    
+    vector<const char*> siteNames;
+    ZprofilerGetSiteNames(siteNames);
+    
+    unsigned long processId = gProfilerProcessId;
+    const char *separator = "";
+    
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    
+    vector<tdstProfilerEvent> events;
+    vector<const tdstProfilerEvent*> stack;
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        tdstProfilerThreadContext *context = contexts[nbThread];
+        ZprofilerCopyEvents(context, events);
+        if( events.empty() || !ZprofilerIsContextCurrent(context) )
+        {
+            continue;
+        }
+        
+        unsigned long threadId = context->threadId.load(std::memory_order_relaxed);
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"Thread %lu\"}}",
+                separator, processId, threadId, threadId);
+        separator = ",";
+        
+        stack.clear();
+        for(size_t index=0;index<events.size();index++)
+        {
+            const tdstProfilerEvent *event = &events[index];
+            if( event->type==PROFILER_EVENT_BEGIN )
+            {
+                stack.push_back(event);
+                continue;
+            }
+            if( stack.empty() || stack.back()->siteId!=event->siteId )
+            {
+                continue;
+            }
+            
+            const tdstProfilerEvent *begin = stack.back();
+            stack.pop_back();
+            
+            fprintf(file, ",\n{\"name\":");
+            ZprofilerWriteJsonString(file, event->siteId<siteNames.size() ? siteNames[event->siteId] : "");
+            fprintf(file, ",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                    processId,
+                    threadId,
+                    ZprofilerTicksToMs(begin->time-gProfilerStartTicks)*1000.0,
+                    ZprofilerTicksToMs(event->time-begin->time)*1000.0);
+        }
+    }
+    
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
+
+////
+////	Exports
+////
+
+//
+// Stats of a report row as JSON members
+//
+void ZprofilerWriteJsonRow( FILE *file, const tdstProfilerReportRow &row, const vector<const char*> &counterNames )
+{
+    static const char *hardwareNames[] = { "cycles", "instructions", "llcMisses", "branchMisses" };
+    static const char *softwareNames[] = { "taskClockNs", "pageFaults", "contextSwitches" };
+    
+    double columns[PROFILER_TABLE_COLUMNS];
+    ZprofilerGetRowColumns(columns, row.data, *row.histogram, row.overheadTime, row.selfTime, row.nestedTime, row.firstBucket, row.lastBucket);
+    
+    fprintf(file, "\"name\":");
+    ZprofilerWriteJsonString(file, row.name);
+    fprintf(file, ",\"calls\":%lu,\"totalMs\":%.6f,\"selfMs\":%.6f,\"avgMs\":%.6f,\"minMs\":%.6f,\"maxMs\":%.6f,\"p50Ms\":%.6f,\"p90Ms\":%.6f,\"p99Ms\":%.6f,\"p999Ms\":%.6f,\"stdDevMs\":%.6f",
+            row.data.nbCalls, columns[0], columns[1], columns[2], columns[3], columns[4], columns[5], columns[6], columns[7], columns[8], columns[9]);
+    if( row.nbSampled )
+    {
+        fprintf(file, ",\"sampledCalls\":%llu,\"sampleError\":%.6f", (unsigned long long)row.nbSampled, ZprofilerSamplingError(row.data, row.nbSampled));
+    }
+    if( !row.counters->empty() )
+    {
+        const char *separator = "";
+        fprintf(file, ",\"counters\":{");
+        for(std::map<unsigned int, uint64_t>::const_iterator iter = row.counters->begin(); iter!=row.counters->end(); ++iter)
+        {
+            fprintf(file, "%s", separator);
+            ZprofilerWriteJsonString(file, (iter->first<counterNames.size()) ? counterNames[iter->first] : "?");
+            fprintf(file, ":%llu", (unsigned long long)iter->second);
+            separator = ",";
+        }
+        fprintf(file, "}");
+    }
+    const tdstProfilerAllocations &allocations = *row.allocations;
+    if( allocations.nbAllocs || allocations.nbFrees )
+    {
+        fprintf(file, ",\"allocations\":{\"allocs\":%llu,\"allocBytes\":%llu,\"frees\":%llu,\"freeBytes\":%llu,\"peakBytes\":%llu}",
+                (unsigned long long)allocations.nbAllocs, (unsigned long long)allocations.allocBytes,
+                (unsigned long long)allocations.nbFrees, (unsigned long long)allocations.freeBytes,
+                (unsigned long long)allocations.peakBytes);
+    }
+    int mode = gProfilerPerfMode.load();
+    if( row.perfCounts[0] && mode!=PROFILER_PERF_NONE )
+    {
+        const char **names = (mode==PROFILER_PERF_HARDWARE) ? hardwareNames : softwareNames;
+        unsigned int nbNames = (mode==PROFILER_PERF_HARDWARE) ? 4 : 3;
+        fprintf(file, ",\"perf\":{");
+        for(unsigned int i=0;i<nbNames;i++)
+        {
+            fprintf(file, "%s\"%s\":%llu", i ? "," : "", names[i], (unsigned long long)row.perfCounts[i]);
+        }
+        fprintf(file, "}");
+    }
+    if( row.queue )
+    {
+        fprintf(file, ",\"queue\":{\"pushed\":%llu,\"popped\":%llu,\"maxDepth\":%llu,\"depth\":%llu,\"poppedPerSecond\":%.3f}",
+                (unsigned long long)row.queue->nbPushed, (unsigned long long)row.queue->nbPopped,
+                (unsigned long long)row.queue->maxDepth, (unsigned long long)row.queue->depth, row.queue->popsPerSecond);
+    }
+    if( row.lock )
+    {
+        double holdColumns[PROFILER_TABLE_COLUMNS];
+        ZprofilerGetHoldColumns(holdColumns, *row.lock);
+        fprintf(file, ",\"lock\":{\"section\":");
+        if( row.lock->section )
+        {
+            ZprofilerWriteJsonString(file, row.lock->section);
+        }
+        else
+        {
+            fprintf(file, "null");
+        }
+        fprintf(file, ",\"contended\":%llu,\"holdTotalMs\":%.6f,\"holdAvgMs\":%.6f,\"holdP50Ms\":%.6f,\"holdP90Ms\":%.6f,\"holdP99Ms\":%.6f,\"holdMaxMs\":%.6f}",
+                (unsigned long long)row.lock->nbContended, holdColumns[0], holdColumns[2], holdColumns[5], holdColumns[6], holdColumns[7], holdColumns[4]);
+    }
+}
+
+//
+// The tree of every thread with its flat table, then the flat table of all
+// threads. Nodes are written as they come, depth first, and closed when the
+// walk goes back up.
+//
+struct ZProfilerJsonSink : public ZProfilerSink
+{
+    ZProfilerJsonSink( FILE *jsonFile ) : file(jsonFile), counterNames(NULL), nbThreads(0), nbRows(0), allThreadsTable(false), tableEnd("]}") {}
+    
+    void begin( const vector<const char*> &names )
+    {
+        counterNames = &names;
+        fprintf(file, "{\"timeUnit\":\"ms\",\"processId\":%lu,\"overheadNs\":%.1f,\"selfOverheadNs\":%.1f,\"sortKey\":\"%s\",\"threads\":[",
+                gProfilerProcessId,
+                ZprofilerTicksToMs(1)*gProfilerOverheadTicks*1000000.0,
+                ZprofilerTicksToMs(1)*gProfilerSelfOverheadTicks*1000000.0,
+                ZprofilerSortName(gProfilerSortKey));
+    }
+    void beginTree( unsigned long threadId, uint64_t nbRecordsDropped )
+    {
+        fprintf(file, "%s\n{\"threadId\":%lu,\"callsDropped\":%llu,\"tree\":[", nbThreads++ ? "," : "", threadId, (unsigned long long)nbRecordsDropped);
+        nbChildren.assign(1, 0);
+    }
+    void node( const tdstProfilerReportRow &row )
+    {
+        while( nbChildren.size()>row.depth+1 )
+        {
+            fprintf(file, "]}");
+            nbChildren.pop_back();
+        }
+        fprintf(file, "%s\n{", nbChildren.back()++ ? "," : "");
+        ZprofilerWriteJsonRow(file, row, *counterNames);
+        fprintf(file, ",\"children\":[");
+        nbChildren.push_back(0);
+    }
+    void endTree()
+    {
+        while( nbChildren.size()>1 )
+        {
+            fprintf(file, "]}");
+            nbChildren.pop_back();
+        }
+        fprintf(file, "]");
+    }
+    void beginTable( unsigned long threadId, bool allThreads )
+    {
+        (void)threadId;
+        allThreadsTable = allThreads;
+        tableEnd = allThreads ? "]" : "]}";
+        fprintf(file, allThreads ? "\n],\"sections\":[" : ",\"sections\":[");
+        nbRows = 0;
+    }
+    void row( const tdstProfilerReportRow &row )
+    {
+        fprintf(file, "%s\n{", nbRows++ ? "," : "");
+        ZprofilerWriteJsonRow(file, row, *counterNames);
+        fprintf(file, "}");
+    }
+    void endTable()
+    {
+        fprintf(file, "%s", tableEnd);
+    }
+    void beginAsyncTable( const tdstProfilerAsyncInfo &info )
+    {
+        closeThreads();
+        tableEnd = "]}";
+        fprintf(file, ",\"async\":{\"spansDropped\":%llu,\"unmatchedEnds\":%llu,\"orphanedSpans\":%llu,\"openSpans\":%llu,\"oldestOpenMs\":%.6f,\"sections\":[",
+                (unsigned long long)info.nbDropped, (unsigned long long)info.nbUnmatched, (unsigned long long)info.nbOrphaned,
+                (unsigned long long)info.nbOpen, info.oldestOpen);
+        nbRows = 0;
+    }
+    void beginQueueTable()
+    {
+        closeThreads();
+        tableEnd = "]";
+        fprintf(file, ",\"queues\":[");
+        nbRows = 0;
+    }
+    void beginLockTable()
+    {
+        closeThreads();
+        tableEnd = "]";
+        fprintf(file, ",\"locks\":[");
+        nbRows = 0;
+    }
+    void end()
+    {
+        closeThreads();
+        fprintf(file, "}\n");
+    }
+    
+    // The list of threads is closed by the table of all threads, even empty
+    void closeThreads()
+    {
+        if( !allThreadsTable )
+        {
+            fprintf(file, "\n],\"sections\":[]");
+            allThreadsTable = true;
+        }
+    }
+    
+    FILE							*file;
+    const vector<const char*>		*counterNames;
+    vector<unsigned int>			nbChildren;		// Nodes written in each open list
+    unsigned int					nbThreads;
+    unsigned int					nbRows;
+    bool							allThreadsTable;
+    const char						*tableEnd;		// Closes the table being written
+};
+
+//
+// Write a CSV field, quoted when it has to be
+//
+void ZprofilerWriteCsvString( FILE *file, const char *text )
+{
+    if( !strpbrk(text, ",\"\r\n") )
+    {
+        fputs(text, file);
+        return;
+    }
+    fputc('"', file);
+    for(; *text; text++)
+    {
+        if( *text=='"' )
+        {
+            fputc('"', file);
+        }
+        fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+//
+// The flat tables, one line per section and thread. The thread is "all" for
+// the sections of all threads, "async" for the async spans, "queue" for the
+// queues and "lock" for the locks. Queues and locks also fill the last columns.
+//
+struct ZProfilerCsvSink : public ZProfilerSink
+{
+    ZProfilerCsvSink( FILE *csvFile ) : file(csvFile), counterNames(NULL), threadId(0), tableName(NULL) {}
+    
+    void begin( const vector<const char*> &names )
+    {
+        counterNames = &names;
+        fprintf(file, "thread,section,calls,total_ms,self_ms,avg_ms,min_ms,max_ms,p50_ms,p90_ms,p99_ms,p999_ms,stddev_ms,"
+                      "sampled_calls,sample_error,allocs,alloc_bytes,frees,free_bytes,peak_bytes,counters,"
+                      "pushed,popped,max_depth,popped_per_second,"
+                      "lock_section,contended,hold_total_ms,hold_avg_ms,hold_p99_ms,hold_max_ms\n");
+    }
+    void beginTable( unsigned long tableThreadId, bool tableAllThreads )
+    {
+        threadId	= tableThreadId;
+        tableName	= tableAllThreads ? "all" : NULL;
+    }
+    void beginAsyncTable( const tdstProfilerAsyncInfo &info )
+    {
+        (void)info;
+        tableName	= "async";
+    }
+    void beginQueueTable()
+    {
+        tableName	= "queue";
+    }
+    void beginLockTable()
+    {
+        tableName	= "lock";
+    }
+    void row( const tdstProfilerReportRow &row )
+    {
+        double columns[PROFILER_TABLE_COLUMNS];
+        ZprofilerGetRowColumns(columns, row.data, *row.histogram, row.overheadTime, row.selfTime, row.nestedTime, row.firstBucket, row.lastBucket);
+        
+        if( tableName )
+        {
+            fprintf(file, "%s,", tableName);
+        }
+        else
+        {
+            fprintf(file, "%lu,", threadId);
+        }
+        ZprofilerWriteCsvString(file, row.name);
+        fprintf(file, ",%lu", row.data.nbCalls);
+        for(unsigned int column=0;column<PROFILER_TABLE_COLUMNS;column++)
+        {
+            fprintf(file, ",%.6f", columns[column]);
+        }
+        const tdstProfilerAllocations &allocations = *row.allocations;
+        fprintf(file, ",%llu,%.6f,%llu,%llu,%llu,%llu,%llu,",
+                (unsigned long long)row.nbSampled, ZprofilerSamplingError(row.data, row.nbSampled),
+                (unsigned long long)allocations.nbAllocs, (unsigned long long)allocations.allocBytes,
+                (unsigned long long)allocations.nbFrees, (unsigned long long)allocations.freeBytes,
+                (unsigned long long)allocations.peakBytes);
+        
+        // Counters as name=value pairs in one field
+        std::string counters;
+        char value[32];
+        for(std::map<unsigned int, uint64_t>::const_iterator iter = row.counters->begin(); iter!=row.counters->end(); ++iter)
+        {
+            snprintf(value, sizeof(value), "=%llu", (unsigned long long)iter->second);
+            counters += counters.empty() ? "" : ";";
+            counters += (iter->first<counterNames->size()) ? (*counterNames)[iter->first] : "?";
+            counters += value;
+        }
+        ZprofilerWriteCsvString(file, counters.c_str());
+        if( row.queue )
+        {
+            fprintf(file, ",%llu,%llu,%llu,%.3f", (unsigned long long)row.queue->nbPushed, (unsigned long long)row.queue->nbPopped,
+                    (unsigned long long)row.queue->maxDepth, row.queue->popsPerSecond);
+        }
+        else
+        {
+            fprintf(file, ",,,,");
+        }
+        if( row.lock )
+        {
+            double holdColumns[PROFILER_TABLE_COLUMNS];
+            ZprofilerGetHoldColumns(holdColumns, *row.lock);
+            fputc(',', file);
+            ZprofilerWriteCsvString(file, row.lock->section ? row.lock->section : "");
+            fprintf(file, ",%llu,%.6f,%.6f,%.6f,%.6f", (unsigned long long)row.lock->nbContended, holdColumns[0], holdColumns[2], holdColumns[7], holdColumns[4]);
+        }
+        else
+        {
+            fprintf(file, ",,,,,,");
+        }
+        fputc('\n', file);
+    }
+    
+    FILE							*file;
+    const vector<const char*>		*counterNames;
+    unsigned long					threadId;
+    const char						*tableName;		// Written instead of the thread id
+};
+
+//
+// Folded stacks, "Main;myFunction 70070800": one line per call path with its
+// self time in ns, as flamegraph.pl and speedscope read them. Threads are
+// merged by the tools.
+//
+struct ZProfilerFoldedSink : public ZProfilerSink
+{
+    ZProfilerFoldedSink( FILE *foldedFile ) : file(foldedFile) {}
+    
+    void node( const tdstProfilerReportRow &row )
+    {
+        path.resize(row.depth);
+        
+        // ';' separates frames and the last space the value
+        std::string name(row.name);
+        for(size_t i=0;i<name.size();i++)
+        {
+            if( name[i]==';' || name[i]=='\n' || name[i]=='\r' )
+            {
+                name[i] = '_';
+            }
+        }
+        path.push_back(name);
+        
+        uint64_t selfNs = (uint64_t)(ZprofilerTicksToMs(row.selfTime)*1000000.0+0.5);
+        if( !selfNs )
+        {
+            return;
+        }
+        for(size_t i=0;i<path.size();i++)
+        {
+            if( i )
+            {
+                fputc(';', file);
+            }
+            fputs(path[i].c_str(), file);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)selfNs);
+    }
+    
+    FILE							*file;
+    vector<std::string>				path;
+};
+
+//
+// Write the report through a sink of type Sink, with every section of all threads
+//
+template<typename Sink>
+bool ZprofilerExportReport( const char *filename )
+{
+    FILE *file = fopen(filename, "wt");
+    if( !file )
+    {
+        return false;
+    }
+    Sink sink(file);
+    ZprofilerWriteReport(sink, (unsigned int)-1);
+    bool written = !ferror(file);
+    return (fclose(file)==0) && written;
+}
+
+bool Zprofiler_export_json( const char *filename )
+{
+    return ZprofilerExportReport<ZProfilerJsonSink>(filename);
+}
+
+bool Zprofiler_export_csv( const char *filename )
+{
+    return ZprofilerExportReport<ZProfilerCsvSink>(filename);
+}
+
+bool Zprofiler_export_folded( const char *filename )
+{
+    return ZprofilerExportReport<ZProfilerFoldedSink>(filename);
+}
+
+////
+////	Live stats
+////
+
+typedef struct stProfilerPublisher
+{
+    tdstProfilerSharedStats		*shared;
+    size_t						size;
+    std::string					name;
+    unsigned int				periodMs;
+    std::atomic<bool>			stop;
+    std::thread					thread;
+} tdstProfilerPublisher;
+
+tdstProfilerPublisher gProfilerPublisher;
+
+inline tdstProfilerSharedSection *ZprofilerSharedSections( tdstProfilerSharedStats *shared )
+{
+    return (tdstProfilerSharedSection*)(shared+1);
+}
+
+//
+// Keeps the flat table of all threads, as the shared memory holds it
+//
+struct ZProfilerSharedSink : public ZProfilerSink
+{
+    ZProfilerSharedSink( unsigned int maxRows ) : maxSections(maxRows), nbThreads(0), nbSections(0), allThreads(false) {}
+    
+    void begin( const vector<const char*> &counterNames )
+    {
+        (void)counterNames;
+        sections.clear();
+        nbThreads	= 0;
+        nbSections	= 0;
+        allThreads	= false;
+    }
+    void beginTree( unsigned long threadId, uint64_t nbRecordsDropped )
+    {
+        (void)threadId;
+        (void)nbRecordsDropped;
+        nbThreads++;
+    }
+    void beginTable( unsigned long threadId, bool tableAllThreads )
+    {
+        (void)threadId;
+        allThreads = tableAllThreads;
+    }
+    void beginAsyncTable( const tdstProfilerAsyncInfo &info )
+    {
+        (void)info;
+        allThreads = false;
+    }
+    void beginQueueTable()
+    {
+        allThreads = false;
+    }
+    void beginLockTable()
+    {
+        allThreads = false;
+    }
+    void row( const tdstProfilerReportRow &row )
+    {
+        if( !allThreads )
+        {
+            return;
+        }
+        nbSections++;
+        if( sections.size()>=maxSections )
+        {
+            return;
+        }
+        double columns[PROFILER_TABLE_COLUMNS];
+        ZprofilerGetRowColumns(columns, row.data, *row.histogram, row.overheadTime, row.selfTime, row.nestedTime, row.firstBucket, row.lastBucket);
+        
+        tdstProfilerSharedSection section;
+        memset(&section, 0, sizeof(section));
+        strncpy(section.name, row.name, sizeof(section.name)-1);
+        section.nbCalls		= row.data.nbCalls;
+        section.totalTime	= columns[0];
+        section.selfTime	= columns[1];
+        section.avgTime		= columns[2];
+        section.minTime		= columns[3];
+        section.maxTime		= columns[4];
+        section.p50Time		= columns[5];
+        section.p90Time		= columns[6];
+        section.p99Time		= columns[7];
+        section.p999Time	= columns[8];
+        section.stdDev		= columns[9];
+        sections.push_back(section);
+    }
+    
+    unsigned int							maxSections;
+    unsigned int							nbThreads;
+    unsigned int							nbSections;
+    bool									allThreads;
+    vector<tdstProfilerSharedSection>		sections;
+};
+
+//
+// Write the stats under the sequence lock. The report is made before, so the
+// sequence is odd only for the copy.
+//
+void ZprofilerPublish( ZProfilerSharedSink &sink )
+{
+    ZprofilerWriteReport(sink, (unsigned int)-1);
+    
+    tdstProfilerSharedStats *shared = gProfilerPublisher.shared;
+    uint64_t sequence = shared->sequence.load(std::memory_order_relaxed);
+    shared->sequence.store(sequence+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    
+    shared->nbUpdates++;
+    shared->time		= ZprofilerTicksToMs(ZprofilerGetTicks()-gProfilerStartTicks);
+    shared->nbThreads	= sink.nbThreads;
+    shared->nbSections	= sink.nbSections;
+    if( !sink.sections.empty() )
+    {
+        memcpy(ZprofilerSharedSections(shared), &sink.sections[0], sink.sections.size()*sizeof(tdstProfilerSharedSection));
+    }
+    
+    shared->sequence.store(sequence+2, std::memory_order_release);
+}
+
+//
+// Publisher thread: a report every period, until stopped
+//
+void ZprofilerPublisherThread()
+{
+    ZProfilerSharedSink sink(gProfilerPublisher.shared->maxSections);
+    while( !gProfilerPublisher.stop.load(std::memory_order_acquire) )
+    {
+        ZprofilerPublish(sink);
+        for(unsigned int waited=0;waited<gProfilerPublisher.periodMs && !gProfilerPublisher.stop.load(std::memory_order_acquire);waited += 10)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+//
+// Name of the shared memory object of a process
+//
+std::string ZprofilerSharedName( const char *name )
+{
+    if( name )
+    {
+        return name;
+    }
+    char text[64];
+    snprintf(text, sizeof(text), "/libprofiler.%lu", gProfilerProcessId);
+    return text;
+}
+
+#if IS_OS_LINUX || IS_OS_MACOSX
+//
+// Whether a shared memory object of this user was left by a process that is
+// gone, or that died with the pid of this one. False when it can't be read or
+// was never fully written, which may be a publisher still creating it.
+//
+bool ZprofilerIsSharedStale( const char *name )
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if( fd<0 )
+    {
+        return false;
+    }
+    struct stat status;
+    void *memory = MAP_FAILED;
+    if( fstat(fd, &status)==0 && status.st_uid==geteuid() && (size_t)status.st_size>=sizeof(tdstProfilerSharedStats) )
+    {
+        memory = mmap(NULL, sizeof(tdstProfilerSharedStats), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if( memory==MAP_FAILED )
+    {
+        return false;
+    }
+    
+    const tdstProfilerSharedStats *shared = (const tdstProfilerSharedStats*)memory;
+    bool stale = false;
+    if( !memcmp(shared->magic, PROFILER_SHARED_MAGIC, 8) )
+    {
+        pid_t processId = (pid_t)shared->processId;
+        stale = (processId==(pid_t)gProfilerProcessId) || (kill(processId, 0)<0 && errno==ESRCH);
+    }
+    munmap(memory, sizeof(tdstProfilerSharedStats));
+    return stale;
+}
+#endif
+
+//
+// Create the shared memory object and start publishing to it
+//
+bool Zprofiler_start_publishing( const char *name, unsigned int periodMs )
+{
+#if IS_OS_LINUX || IS_OS_MACOSX
+    if( gProfilerPublisher.shared )
+    {
+        return false;
+    }
+    
+    std::string sharedName = ZprofilerSharedName(name);
+    size_t size = sizeof(tdstProfilerSharedStats)+LIB_PROFILER_SHARED_SECTIONS*sizeof(tdstProfilerSharedSection);
+    // The new object must not exist: another user can't hand over an object it
+    // made under the predictable name, and a live publisher keeps its own. Only
+    // an object left by a dead process is removed. Only the owner can read it.
+    int fd = shm_open(sharedName.c_str(), O_CREAT|O_EXCL|O_RDWR, 0600);
+    if( fd<0 && errno==EEXIST && ZprofilerIsSharedStale(sharedName.c_str()) )
+    {
+        shm_unlink(sharedName.c_str());
+        fd = shm_open(sharedName.c_str(), O_CREAT|O_EXCL|O_RDWR, 0600);
+    }
+    if( fd<0 )
+    {
+        return false;
+    }
+    void *memory = (ftruncate(fd, (off_t)size)==0) ? mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if( memory==MAP_FAILED )
+    {
+        shm_unlink(sharedName.c_str());
+        return false;
+    }
+    
+    // Readers check the magic last
+    tdstProfilerSharedStats *shared = (tdstProfilerSharedStats*)memory;
+    memset(memory, 0, size);
+    shared->version		= PROFILER_SHARED_VERSION;
+    shared->maxSections	= LIB_PROFILER_SHARED_SECTIONS;
+    shared->processId	= gProfilerProcessId;
+    shared->sequence.store(0);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(shared->magic, PROFILER_SHARED_MAGIC, 8);
+    
+    gProfilerPublisher.shared	= shared;
+    gProfilerPublisher.size		= size;
+    gProfilerPublisher.name		= sharedName;
+    gProfilerPublisher.periodMs	= periodMs;
+    gProfilerPublisher.stop.store(false);
+    gProfilerPublisher.thread	= std::thread(ZprofilerPublisherThread);
+    return true;
+#else
+    (void)name;
+    (void)periodMs;
+    return false;
+#endif
+}
+
+//
+// Stop publishing and remove the shared memory object
+//
+void Zprofiler_stop_publishing()
+{
+#if IS_OS_LINUX || IS_OS_MACOSX
+    if( !gProfilerPublisher.shared )
+    {
+        return;
+    }
+    gProfilerPublisher.stop.store(true, std::memory_order_release);
+    gProfilerPublisher.thread.join();
+    
+    munmap(gProfilerPublisher.shared, gProfilerPublisher.size);
+    shm_unlink(gProfilerPublisher.name.c_str());
+    gProfilerPublisher.shared = NULL;
+#endif
+}
+
+//
+// Copy the stats published by another process. Retries while they are being
+// written.
+//
+bool Zprofiler_read_published( const char *name, tdstProfilerPublishedStats &stats )
+{
+#if IS_OS_LINUX || IS_OS_MACOSX
+    int fd = shm_open(name, O_RDONLY, 0);
+    if( fd<0 )
+    {
+        return false;
+    }
+    struct stat status;
+    void *memory = MAP_FAILED;
+    size_t size = 0;
+    if( fstat(fd, &status)==0 && (size_t)status.st_size>=sizeof(tdstProfilerSharedStats) )
+    {
+        size = (size_t)status.st_size;
+        memory = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if( memory==MAP_FAILED )
+    {
+        return false;
+    }
+    
+    tdstProfilerSharedStats *shared = (tdstProfilerSharedStats*)memory;
+    bool read = false;
+    if( !memcmp(shared->magic, PROFILER_SHARED_MAGIC, 8) && shared->version==PROFILER_SHARED_VERSION
+        && shared->maxSections<=(size-sizeof(tdstProfilerSharedStats))/sizeof(tdstProfilerSharedSection) )
+    {
+        for(unsigned int attempt=0;attempt<1000 && !read;attempt++)
+        {
+            uint64_t sequence = shared->sequence.load(std::memory_order_acquire);
+            if( sequence&1 )
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            stats.processId		= (unsigned long)shared->processId;
+            stats.nbUpdates		= shared->nbUpdates;
+            stats.time			= shared->time;
+            stats.nbThreads		= shared->nbThreads;
+            stats.nbSections	= shared->nbSections;
+            stats.sections.resize(std::min(stats.nbSections, shared->maxSections));
+            if( !stats.sections.empty() )
+            {
+                memcpy(&stats.sections[0], ZprofilerSharedSections(shared), stats.sections.size()*sizeof(tdstProfilerSharedSection));
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            read = (shared->sequence.load(std::memory_order_relaxed)==sequence);
+        }
+    }
+    munmap(memory, size);
+    return read;
+#else
+    (void)name;
+    (void)stats;
+    return false;
+#endif
+}
+
+////
+////	Capture
+////
+
+typedef struct stProfilerCapture
+{
+    FILE									*file;
+    ZCriticalSection_t						*criticalSection;
+    std::vector<tdstProfilerCaptureChunk*>	fullChunks;			// Waiting for the writer
+    std::vector<tdstProfilerCaptureChunk*>	freeChunks;
+    unsigned int							nbChunks;			// Allocated chunks
+    uint64_t								nbLostChunks;
+    unsigned int							nbSitesWritten;
+    std::atomic<bool>						stop;
+    std::thread								writer;
+} tdstProfilerCapture;
+
+tdstProfilerCapture gProfilerCapture;
+
+inline unsigned char *ZprofilerWriteVarint( unsigned char *buffer, uint64_t value )
+{
+    while( value>=0x80 )
+    {
+        *buffer++ = (unsigned char)(value|0x80);
+        value >>= 7;
+    }
+    *buffer++ = (unsigned char)value;
+    return buffer;
+}
+
+inline const unsigned char *ZprofilerReadVarint( const unsigned char *buffer, const unsigned char *end, uint64_t &value )
+{
+    value = 0;
+    for(unsigned int shift = 0; buffer<end && shift<64; shift += 7)
+    {
+        unsigned char byte = *buffer++;
+        value |= (uint64_t)(byte&0x7F)<<shift;
+        if( !(byte&0x80) )
+        {
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+void ZprofilerFileWriteVarint( FILE *file, uint64_t value )
+{
+    unsigned char buffer[10];
+    fwrite(buffer, 1, ZprofilerWriteVarint(buffer, value)-buffer, file);
+}
+
+void ZprofilerFileWriteString( FILE *file, const char *text )
+{
+    size_t length = strlen(text);
+    ZprofilerFileWriteVarint(file, length);
+    fwrite(text, 1, length, file);
+}
+
+//
+// Get an empty chunk, NULL when LIB_PROFILER_CAPTURE_MAX_CHUNKS are in use
+//
+tdstProfilerCaptureChunk *ZprofilerCaptureGetChunk()
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    tdstProfilerCaptureChunk *chunk = NULL;
     
-    // Thread Id String
-    char szThreadId[16];
-    char textLine[1024];
-    char *tmpString;
-    
-    long i;
-    //long nbTreadIds	= 0;
-    long size		= 0;
+    LockCriticalSection(gProfilerCapture.criticalSection);
+    if( !gProfilerCapture.freeChunks.empty() )
+    {
+        chunk = gProfilerCapture.freeChunks.back();
+        gProfilerCapture.freeChunks.pop_back();
+    }
+    else if( gProfilerCapture.nbChunks<LIB_PROFILER_CAPTURE_MAX_CHUNKS )
+    {
+        chunk = new tdstProfilerCaptureChunk;
+        gProfilerCapture.nbChunks++;
+    }
+    else
+    {
+        gProfilerCapture.nbLostChunks++;
+    }
+    UnLockCriticalSection(gProfilerCapture.criticalSection);
+    
+    return chunk;
+}
+
+void ZprofilerCaptureSubmitChunk( tdstProfilerCaptureChunk *chunk )
+{
+    LockCriticalSection(gProfilerCapture.criticalSection);
+    gProfilerCapture.fullChunks.push_back(chunk);
+    UnLockCriticalSection(gProfilerCapture.criticalSection);
+}
+
+//
+// Append an event to the capture chunk of a thread. Only takes the lock to swap
+// a full chunk for an empty one.
+//
+void ZprofilerCaptureEvent( tdstProfilerThreadContext *context, unsigned int type, unsigned int siteId, uint64_t time )
+{
+    context->captureBusy.store(1);
+    if( !gProfilerCapturing.load() )
+    {
+        context->captureBusy.store(0, std::memory_order_release);
+        return;
+    }
+    
+    tdstProfilerCaptureChunk *chunk = context->captureChunk;
+    if( !chunk || chunk->size>LIB_PROFILER_CAPTURE_CHUNK_SIZE-PROFILER_CAPTURE_MAX_EVENT_SIZE )
+    {
+        tdstProfilerCaptureChunk *newChunk = ZprofilerCaptureGetChunk();
+        if( chunk && newChunk )
+        {
+            ZprofilerCaptureSubmitChunk(chunk);
+        }
+        else if( chunk )
+        {
+            // The writer is behind: drop what this chunk holds
+            newChunk = chunk;
+            context->captureLostChunks++;
+        }
+        else if( !newChunk )
+        {
+            context->captureLostChunks++;
+            context->captureBusy.store(0, std::memory_order_release);
+            return;
+        }
+        
+        chunk = newChunk;
+        chunk->threadId		= context->threadId.load(std::memory_order_relaxed);
+        chunk->baseTime		= time;
+        chunk->lastTime		= time;
+        chunk->lostChunks	= context->captureLostChunks;
+        chunk->size			= 0;
+        context->captureLostChunks	= 0;
+        context->captureChunk		= chunk;
+    }
+    
+    unsigned char *buffer = chunk->data+chunk->size;
+    buffer = ZprofilerWriteVarint(buffer, (time>chunk->lastTime) ? time-chunk->lastTime : 0);
+    buffer = ZprofilerWriteVarint(buffer, ((uint64_t)siteId<<1)|type);
+    chunk->size = (unsigned int)(buffer-chunk->data);
+    if( time>chunk->lastTime )
+    {
+        chunk->lastTime = time;
+    }
+    
+    context->captureBusy.store(0, std::memory_order_release);
+}
+
+//
+// Write the sites registered since the last call
+//
+void ZprofilerCaptureWriteSites()
+{
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    for(size_t id = gProfilerCapture.nbSitesWritten;id<gProfilerSites.size();id++)
+    {
+        ZProfilerSite *site = gProfilerSites[id];
+        if( !site || ZprofilerIsCalibrationSite(site) )
+        {
+            continue;
+        }
+        fputc(PROFILER_CAPTURE_SITE, gProfilerCapture.file);
+        ZprofilerFileWriteVarint(gProfilerCapture.file, id);
+        ZprofilerFileWriteVarint(gProfilerCapture.file, (uint64_t)site->line);
+        ZprofilerFileWriteString(gProfilerCapture.file, site->name);
+        ZprofilerFileWriteString(gProfilerCapture.file, site->file);
+    }
+    gProfilerCapture.nbSitesWritten = (unsigned int)gProfilerSites.size();
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+}
+
+//
+// Writer thread: appends full chunks to the file until the capture stops
+//
+void ZprofilerCaptureWriter()
+{
+    std::vector<tdstProfilerCaptureChunk*> chunks;
+    for(;;)
+    {
+        bool stop = gProfilerCapture.stop.load(std::memory_order_acquire);
+        
+        LockCriticalSection(gProfilerCapture.criticalSection);
+        chunks.swap(gProfilerCapture.fullChunks);
+        UnLockCriticalSection(gProfilerCapture.criticalSection);
+        
+        if( !chunks.empty() )
+        {
+            // Sites are registered before their first event, so writing them
+            // first is enough for every event of these chunks
+            ZprofilerCaptureWriteSites();
+            
+            for(size_t i=0;i<chunks.size();i++)
+            {
+                tdstProfilerCaptureChunk *chunk = chunks[i];
+                fputc(PROFILER_CAPTURE_CHUNK, gProfilerCapture.file);
+                ZprofilerFileWriteVarint(gProfilerCapture.file, chunk->threadId);
+                ZprofilerFileWriteVarint(gProfilerCapture.file, chunk->baseTime);
+                ZprofilerFileWriteVarint(gProfilerCapture.file, chunk->lostChunks);
+                ZprofilerFileWriteVarint(gProfilerCapture.file, chunk->size);
+                fwrite(chunk->data, 1, chunk->size, gProfilerCapture.file);
+            }
+            
+            LockCriticalSection(gProfilerCapture.criticalSection);
+            gProfilerCapture.freeChunks.insert(gProfilerCapture.freeChunks.end(), chunks.begin(), chunks.end());
+            UnLockCriticalSection(gProfilerCapture.criticalSection);
+            chunks.clear();
+        }
+        else if( !stop )
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        
+        if( stop )
+        {
+            break;
+        }
+    }
+}
+
+//
+// Start streaming events to filename
+//
+bool Zprofiler_start_capture( const char *filename )
+{
+    if( gProfilerCapturing.load() )
+    {
+        return false;
+    }
+    
+    gProfilerCapture.file = fopen(filename, "wb");
+    if( !gProfilerCapture.file )
+    {
+        return false;
+    }
+    setvbuf(gProfilerCapture.file, NULL, _IOFBF, 1<<20);
+    
+    fwrite(PROFILER_CAPTURE_MAGIC, 1, 8, gProfilerCapture.file);
+    ZprofilerFileWriteVarint(gProfilerCapture.file, PROFILER_CAPTURE_VERSION);
+    ZprofilerFileWriteVarint(gProfilerCapture.file, (uint64_t)(gProfilerTicksPerSecond+0.5));
+    ZprofilerFileWriteVarint(gProfilerCapture.file, gProfilerStartTicks);
+    ZprofilerFileWriteVarint(gProfilerCapture.file, gProfilerProcessId);
+    
+    if( !gProfilerCapture.criticalSection )
+    {
+        gProfilerCapture.criticalSection = NewCriticalSection();
+    }
+    gProfilerCapture.nbSitesWritten	= 0;
+    gProfilerCapture.nbLostChunks	= 0;
+    gProfilerCapture.stop.store(false);
+    gProfilerCapture.writer			= std::thread(ZprofilerCaptureWriter);
+    
+    gProfilerCapturing.store(true);
+    return true;
+}
+
+//
+// Flush the chunks being filled and close the capture
+//
+void Zprofiler_stop_capture()
+{
+    if( !gProfilerCapturing.load() )
+    {
+        return;
+    }
+    gProfilerCapturing.store(false);
+    
+    // Once no thread is writing an event, the chunks being filled can be taken
+    vector<tdstProfilerThreadContext*> contexts;
+    ZprofilerGetThreadContexts(contexts);
+    for(size_t i=0;i<contexts.size();i++)
+    {
+        while( contexts[i]->captureBusy.load() )
+        {
+            std::this_thread::yield();
+        }
+        if( contexts[i]->captureChunk )
+        {
+            ZprofilerCaptureSubmitChunk(contexts[i]->captureChunk);
+            contexts[i]->captureChunk = NULL;
+        }
+        contexts[i]->captureLostChunks = 0;
+    }
+    
+    gProfilerCapture.stop.store(true, std::memory_order_release);
+    gProfilerCapture.writer.join();
+    
+    ZprofilerCaptureWriteSites();
+    fputc(PROFILER_CAPTURE_END, gProfilerCapture.file);
+    fclose(gProfilerCapture.file);
+    gProfilerCapture.file = NULL;
+    
+    if( gProfilerCapture.nbLostChunks )
+    {
+        LOG("Capture lost %lu chunks of events, the writer couldn't keep up\n", (unsigned long)gProfilerCapture.nbLostChunks);
+    }
+    
+    for(size_t i=0;i<gProfilerCapture.freeChunks.size();i++)
+    {
+        delete gProfilerCapture.freeChunks[i];
+    }
+    gProfilerCapture.freeChunks.clear();
+    gProfilerCapture.nbChunks = 0;
+}
+
+////
+////	Saved profiles
+////
+
+void ZprofilerFileWriteDouble( FILE *file, double value )
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    ZprofilerFileWriteVarint(file, bits);
+}
+
+//
+// Move the calls of a histogram to the buckets of their times minus shift, times
+// scale. Each call is taken at the middle of its bucket, kept within the min and
+// max times of data, which already has the new times.
+//
+void ZprofilerShiftHistogram( tdstProfilerHistogram &histogram, const tdstGenProfilerData &data, uint64_t shift, double scale )
+{
+    if( !shift && scale==1.0 )
+    {
+        return;
+    }
+    tdstProfilerHistogram shifted;
+    memset(&shifted, 0, sizeof(shifted));
+    for(unsigned int bucket=0;bucket<PROFILER_HISTOGRAM_BUCKETS;bucket++)
+    {
+        if( !histogram.buckets[bucket] )
+        {
+            continue;
+        }
+        uint64_t low	= ZprofilerHistogramBucketValue(bucket);
+        uint64_t high	= (bucket+1<PROFILER_HISTOGRAM_BUCKETS) ? ZprofilerHistogramBucketValue(bucket+1) : low+1;
+        uint64_t value	= low+(high-low-1)/2;
+        value			= (uint64_t)(double((value>shift) ? value-shift : 0)*scale);
+        value			= (value<data.minTime) ? data.minTime : (value>data.maxTime) ? data.maxTime : value;
+        shifted.buckets[ZprofilerHistogramBucket(value)] += histogram.buckets[bucket];
+    }
+    histogram = shifted;
+}
+
+void ZprofilerSaveStats( FILE *file, const tdstGenProfilerData &data, const tdstProfilerHistogram &histogram )
+{
+    ZprofilerFileWriteVarint(file, data.nbCalls);
+    ZprofilerFileWriteVarint(file, data.totalTime);
+    ZprofilerFileWriteVarint(file, data.minTime);
+    ZprofilerFileWriteVarint(file, data.maxTime);
+    ZprofilerFileWriteDouble(file, data.sumSquares);
+    
+    unsigned int nbBuckets = 0;
+    for(unsigned int bucket=0;bucket<PROFILER_HISTOGRAM_BUCKETS;bucket++)
+    {
+        nbBuckets += histogram.buckets[bucket] ? 1 : 0;
+    }
+    ZprofilerFileWriteVarint(file, nbBuckets);
+    unsigned int previous = 0;
+    for(unsigned int bucket=0;bucket<PROFILER_HISTOGRAM_BUCKETS;bucket++)
+    {
+        if( histogram.buckets[bucket] )
+        {
+            ZprofilerFileWriteVarint(file, bucket-previous);
+            ZprofilerFileWriteVarint(file, histogram.buckets[bucket]);
+            previous = bucket;
+        }
+    }
+}
+
+//
+// Write the tree and the stats of a thread, with the overhead taken out of the times
+//
+void ZprofilerSaveThread( FILE *file, tdstProfilerThreadContext *context, vector<uint64_t> &descendantCalls )
+{
+    // Stats added while saving are left out
+    unsigned int nbNodes	= context->nodes.size();
+    unsigned int nbSampling	= context->sampling.size();
+    unsigned int nbAsync	= context->asyncStats.count.load(std::memory_order_acquire);
+    unsigned int nbWaits	= context->queueWaits.count.load(std::memory_order_acquire);
+    unsigned int nbLocks	= context->lockCount.load(std::memory_order_acquire);
+    if( nbNodes<=1 && !nbAsync && !nbWaits && !nbLocks )
+    {
+        return;
+    }
+    
+    fputc(PROFILER_PROFILE_THREAD, file);
+    ZprofilerFileWriteVarint(file, context->threadId.load(std::memory_order_relaxed));
+    ZprofilerFileWriteVarint(file, context->nbRecordsDropped);
+    
+    ZprofilerGetDescendantCalls(context, nbNodes, descendantCalls);
+    std::map<unsigned int, uint64_t> counters;
+    ZprofilerFileWriteVarint(file, nbNodes-1);
+    for(unsigned int node=1;node<nbNodes;node++)
+    {
+        const tdstProfilerNode &source = context->nodes[node];
+        tdstGenProfilerData data = source.data;
+        tdstProfilerHistogram histogram = context->histograms[node];
+        uint64_t overheadTime = ZprofilerCompensateData(data, ZprofilerGetOverheadTime(data.nbCalls, descendantCalls[node]));
+        ZprofilerShiftHistogram(histogram, data, data.nbCalls ? overheadTime/data.nbCalls : 0, 1.0);
+        
+        ZprofilerFileWriteVarint(file, source.parent);
+        ZprofilerFileWriteVarint(file, source.siteId);
+        ZprofilerSaveStats(file, data, histogram);
+        ZprofilerFileWriteVarint(file, source.allocations.nbAllocs);
+        ZprofilerFileWriteVarint(file, source.allocations.allocBytes);
+        ZprofilerFileWriteVarint(file, source.allocations.nbFrees);
+        ZprofilerFileWriteVarint(file, source.allocations.freeBytes);
+        ZprofilerFileWriteVarint(file, source.allocations.peakBytes);
+        for(unsigned int i=0;i<PROFILER_PERF_COUNTERS;i++)
+        {
+            ZprofilerFileWriteVarint(file, source.perfCounts[i]);
+        }
+        ZprofilerGetNodeCounters(context, node, counters);
+        ZprofilerFileWriteVarint(file, counters.size());
+        for(std::map<unsigned int, uint64_t>::iterator iter = counters.begin(); iter!=counters.end(); ++iter)
+        {
+            ZprofilerFileWriteVarint(file, iter->first);
+            ZprofilerFileWriteVarint(file, iter->second);
+        }
+    }
+    
+    unsigned int nbSampled = 0;
+    for(unsigned int siteId=0;siteId<nbSampling;siteId++)
+    {
+        nbSampled += context->sampling[siteId].nbCalls ? 1 : 0;
+    }
+    ZprofilerFileWriteVarint(file, nbSampled);
+    for(unsigned int siteId=0;siteId<nbSampling;siteId++)
+    {
+        const tdstProfilerSiteSampling &sampling = context->sampling[siteId];
+        if( sampling.nbCalls )
+        {
+            ZprofilerFileWriteVarint(file, siteId);
+            ZprofilerFileWriteVarint(file, sampling.nbCalls);
+            ZprofilerFileWriteVarint(file, sampling.nbSampled);
+        }
+    }
+    
+    ZprofilerFileWriteVarint(file, nbAsync);
+    for(unsigned int index=0;index<nbAsync;index++)
+    {
+        const tdstProfilerIdStats &stats = context->asyncStats.stats[index];
+        ZprofilerFileWriteVarint(file, stats.id);
+        ZprofilerSaveStats(file, stats.data, stats.histogram);
+    }
+    
+    ZprofilerFileWriteVarint(file, nbWaits);
+    for(unsigned int index=0;index<nbWaits;index++)
+    {
+        const tdstProfilerIdStats &stats = context->queueWaits.stats[index];
+        ZprofilerFileWriteVarint(file, stats.id);
+        ZprofilerSaveStats(file, stats.data, stats.histogram);
+    }
+    
+    ZprofilerFileWriteVarint(file, nbLocks);
+    tdstGenProfilerData wait;
+    tdstProfilerHistogram waitHistogram;
+    for(unsigned int index=0;index<nbLocks;index++)
+    {
+        const tdstProfilerLockStats &stats = context->lockStats[index];
+        ZprofilerFileWriteVarint(file, stats.lockId);
+        ZprofilerFileWriteVarint(file, stats.siteId);
+        ZprofilerFileWriteVarint(file, stats.nbContended);
+        ZprofilerGetLockWaits(stats, wait, waitHistogram);
+        ZprofilerSaveStats(file, wait, waitHistogram);
+        ZprofilerSaveStats(file, stats.hold, stats.holdHistogram);
+    }
+    
+    // Timeline ring, oldest event first
+    vector<tdstProfilerEvent> events;
+    ZprofilerCopyEvents(context, events);
+    uint64_t previous = gProfilerStartTicks;
+    ZprofilerFileWriteVarint(file, events.size());
+    for(size_t index=0;index<events.size();index++)
+    {
+        const tdstProfilerEvent &event = events[index];
+        ZprofilerFileWriteVarint(file, (event.time>previous) ? event.time-previous : 0);
+        ZprofilerFileWriteVarint(file, ((uint64_t)event.siteId<<1)|event.type);
+        previous = (event.time>previous) ? event.time : previous;
+    }
+}
+
+//
+// Save the stats of all threads, as LogProfiler would report them now
+//
+bool Zprofiler_save_profile( const char *filename )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    // "%p" is the process id
+    unsigned long processId = ZprofilerGetProcessId();
+    std::string name;
+    for(const char *c = filename; *c; c++)
+    {
+        if( c[0]=='%' && c[1]=='p' )
+        {
+            char text[32];
+            snprintf(text, sizeof(text), "%lu", processId);
+            name += text;
+            c++;
+        }
+        else
+        {
+            name += *c;
+        }
+    }
+    
+    FILE *file = fopen(name.c_str(), "wb");
+    if( !file )
+    {
+        return false;
+    }
+    
+    ZprofilerAggregationSync();
+    
+    // Both clocks at the same time, taken back to when the profiler was enabled,
+    // so tools can line up processes of the same host with the steady clock and
+    // hosts with the system clock
+    uint64_t ticks		= ZprofilerGetTicks()-gProfilerStartTicks;
+    uint64_t steadyNow	= (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t systemNow	= (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    uint64_t elapsed	= (uint64_t)(ZprofilerTicksToMs(ticks)*1000000.0);
+    
+    char hostName[256] = "";
+#if IS_OS_WINDOWS
+    DWORD hostNameSize = sizeof(hostName);
+    GetComputerNameA(hostName, &hostNameSize);
+#else
+    gethostname(hostName, sizeof(hostName)-1);
+#endif
+    
+    fwrite(PROFILER_PROFILE_MAGIC, 1, 8, file);
+    ZprofilerFileWriteVarint(file, PROFILER_PROFILE_VERSION);
+    ZprofilerFileWriteDouble(file, gProfilerTicksPerSecond);
+    ZprofilerFileWriteVarint(file, processId);
+    ZprofilerFileWriteString(file, hostName);
+    ZprofilerFileWriteVarint(file, (steadyNow>elapsed) ? steadyNow-elapsed : 0);
+    ZprofilerFileWriteVarint(file, (systemNow>elapsed) ? systemNow-elapsed : 0);
+    ZprofilerFileWriteVarint(file, ticks);
+    ZprofilerFileWriteVarint(file, (uint64_t)gProfilerPerfMode.load());
+    ZprofilerFileWriteVarint(file, gProfilerAsyncDropped.load());
+    ZprofilerFileWriteVarint(file, gProfilerAsyncUnmatched.load());
+    
+    LockCriticalSection(ZprofilerSitesCriticalSection());
+    for(size_t id=1;id<gProfilerSites.size();id++)
+    {
+        ZProfilerSite *site = gProfilerSites[id];
+        if( site && !ZprofilerIsCalibrationSite(site) )
+        {
+            fputc(PROFILER_PROFILE_SITE, file);
+            ZprofilerFileWriteVarint(file, id);
+            ZprofilerFileWriteVarint(file, (uint64_t)site->line);
+            ZprofilerFileWriteString(file, site->name);
+            ZprofilerFileWriteString(file, site->file);
+        }
+    }
+    for(size_t id=0;id<gProfilerCounterNames.size();id++)
+    {
+        fputc(PROFILER_PROFILE_COUNTER, file);
+        ZprofilerFileWriteVarint(file, id);
+        ZprofilerFileWriteString(file, gProfilerCounterNames[id]);
+    }
+    for(size_t id=1;id<gProfilerQueueNames.size();id++)
+    {
+        const tdstProfilerQueueCounts &counts = gProfilerQueueCounts[id];
+        fputc(PROFILER_PROFILE_QUEUE, file);
+        ZprofilerFileWriteVarint(file, id);
+        ZprofilerFileWriteString(file, gProfilerQueueNames[id]);
+        ZprofilerFileWriteVarint(file, counts.nbPushed.load(std::memory_order_relaxed));
+        ZprofilerFileWriteVarint(file, counts.nbPopped.load(std::memory_order_relaxed));
+        ZprofilerFileWriteVarint(file, counts.maxDepth.load(std::memory_order_relaxed));
+    }
+    for(size_t id=0;id<gProfilerLockNames.size();id++)
+    {
+        fputc(PROFILER_PROFILE_LOCK, file);
+        ZprofilerFileWriteVarint(file, id);
+        ZprofilerFileWriteString(file, gProfilerLockNames[id]);
+    }
+    UnLockCriticalSection(ZprofilerSitesCriticalSection());
+    
+    vector<tdstProfilerThreadContext*> contexts;
+    ZprofilerGetThreadContexts(contexts);
+    vector<uint64_t> descendantCalls;
+    for(size_t nbThread=0;nbThread<contexts.size();nbThread++)
+    {
+        unsigned int resets;
+        if( ZprofilerBeginTreeRead(contexts[nbThread], resets) )
+        {
+            ZprofilerSaveThread(file, contexts[nbThread], descendantCalls);
+        }
+    }
+    
+    fputc(PROFILER_PROFILE_END, file);
+    bool written = !ferror(file);
+    return (fclose(file)==0) && written;
+}
+
+//
+// Reads the varints of a saved profile. Past the end or after a bad varint,
+// everything reads as 0 and ok is false.
+//
+struct ZProfilerProfileReader
+{
+    ZProfilerProfileReader( const unsigned char *data, size_t size ) : buffer(data), end(data+size), ok(true) {}
+    
+    int byte()
+    {
+        if( !ok || buffer==end )
+        {
+            ok = false;
+            return -1;
+        }
+        return *buffer++;
+    }
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+        const unsigned char *next = ok ? ZprofilerReadVarint(buffer, end, value) : NULL;
+        if( !next )
+        {
+            ok = false;
+            return 0;
+        }
+        buffer = next;
+        return value;
+    }
+    double real()
+    {
+        uint64_t bits = varint();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    std::string string()
+    {
+        uint64_t length = varint();
+        if( length>(uint64_t)(end-buffer) )
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string text((const char*)buffer, (size_t)length);
+        buffer += length;
+        return text;
+    }
+    
+    const unsigned char	*buffer;
+    const unsigned char	*end;
+    bool				ok;
+};
+
+//
+// Read saved stats, in ticks of this process, and merge them into data and histogram
+//
+void ZprofilerLoadStats( ZProfilerProfileReader &reader, double scale, tdstGenProfilerData &data, tdstProfilerHistogram &histogram )
+{
+    tdstGenProfilerData saved;
+    saved.nbCalls		= (unsigned long)reader.varint();
+    saved.totalTime		= (uint64_t)(double(reader.varint())*scale);
+    saved.minTime		= (uint64_t)(double(reader.varint())*scale);
+    saved.maxTime		= (uint64_t)(double(reader.varint())*scale);
+    saved.sumSquares	= reader.real()*scale*scale;
+    
+    tdstProfilerHistogram savedHistogram;
+    memset(&savedHistogram, 0, sizeof(savedHistogram));
+    uint64_t nbBuckets = reader.varint();
+    uint64_t bucket = 0;
+    for(uint64_t i=0;i<nbBuckets && reader.ok;i++)
+    {
+        bucket += reader.varint();
+        uint64_t count = reader.varint();
+        if( bucket<PROFILER_HISTOGRAM_BUCKETS )
+        {
+            savedHistogram.buckets[bucket] += (unsigned int)count;
+        }
+    }
+    ZprofilerShiftHistogram(savedHistogram, saved, 0, scale);
+    
+    ZprofilerMergeData(data, saved);
+    ZprofilerMergeHistogram(histogram, savedHistogram);
+}
+
+// Id in this process of an id of the saved process
+inline unsigned int ZprofilerSavedId( const vector<unsigned int> &ids, uint64_t savedId, unsigned int unknownId )
+{
+    return (savedId<ids.size()) ? ids[(size_t)savedId] : unknownId;
+}
+
+inline void ZprofilerSetSavedId( vector<unsigned int> &ids, uint64_t savedId, unsigned int id, unsigned int unknownId )
+{
+    if( savedId<(1<<24) )
+    {
+        if( ids.size()<=savedId )
+        {
+            ids.resize((size_t)savedId+1, unknownId);
+        }
+        ids[(size_t)savedId] = id;
+    }
+}
+
+//
+// Add the tree and the stats of a saved thread to a context
+//
+void ZprofilerLoadThread( ZProfilerProfileReader &reader, tdstProfilerThreadContext *context, double scale, const vector<unsigned int> &siteIds,
+                          const vector<unsigned int> &counterIds, const vector<unsigned int> &queueIds, const vector<unsigned int> &lockIds, vector<unsigned int> &nodes )
+{
+    // Stats that don't fit in the context are read into these
+    tdstProfilerIdStats discarded;
+    tdstProfilerLockStats discardedLock;
+    memset(&discarded, 0, sizeof(discarded));
+    memset(&discardedLock, 0, sizeof(discardedLock));
     
-    // Map for calls
-    std::map<std::string, tdstGenProfilerData> mapCalls;
-    std::map<std::string, tdstGenProfilerData>::iterator IterMapCalls;
-    mapCalls.clear();
+    // Saved nodes come after their parent
+    uint64_t nbNodes = reader.varint();
+    nodes.assign(1, PROFILER_ROOT_NODE);
+    for(uint64_t i=0;i<nbNodes && reader.ok;i++)
+    {
+        uint64_t parent		= reader.varint();
+        unsigned int siteId	= ZprofilerSavedId(siteIds, reader.varint(), 0);
+        unsigned int node	= ZprofilerGetChildNode(context, (parent<nodes.size()) ? nodes[(size_t)parent] : PROFILER_ROOT_NODE, siteId);
+        nodes.push_back(node);
+        
+        tdstProfilerNode &loaded = context->nodes[node];
+        ZprofilerLoadStats(reader, scale, loaded.data, context->histograms[node]);
+        loaded.allocations.nbAllocs		+= reader.varint();
+        loaded.allocations.allocBytes	+= reader.varint();
+        loaded.allocations.nbFrees		+= reader.varint();
+        loaded.allocations.freeBytes	+= reader.varint();
+        uint64_t peakBytes = reader.varint();
+        loaded.allocations.peakBytes	= (peakBytes>loaded.allocations.peakBytes) ? peakBytes : loaded.allocations.peakBytes;
+        for(unsigned int counter=0;counter<PROFILER_PERF_COUNTERS;counter++)
+        {
+            loaded.perfCounts[counter] += reader.varint();
+        }
+        uint64_t nbCounters = reader.varint();
+        for(uint64_t counter=0;counter<nbCounters && reader.ok;counter++)
+        {
+            unsigned int counterId	= ZprofilerSavedId(counterIds, reader.varint(), PROFILER_COUNTER_ITEMS);
+            uint64_t value			= reader.varint();
+            ZprofilerAddNodeCounter(context, node, counterId, value);
+        }
+    }
     
-    // Map for Thread Ids
-    std::map<std::string, int> ThreadIdsCount;
-    std::map<std::string, int>::iterator IterThreadIdsCount;
-    ThreadIdsCount.clear();
+    uint64_t nbSampled = reader.varint();
+    for(uint64_t i=0;i<nbSampled && reader.ok;i++)
+    {
+        unsigned int siteId	= ZprofilerSavedId(siteIds, reader.varint(), 0);
+        uint64_t nbCalls	= reader.varint();
+        uint64_t nbTimed	= reader.varint();
+        while( context->sampling.size()<=siteId && !context->sampling.full() )
+        {
+            context->sampling.push_back();
+        }
+        if( siteId<context->sampling.size() )
+        {
+            context->sampling[siteId].nbCalls	+= nbCalls;
+            context->sampling[siteId].nbSampled	+= nbTimed;
+        }
+    }
     
-    // Vector for callstack
-    vector<tdstGenProfilerData> tmpCallStack;
-    vector<tdstGenProfilerData>::iterator IterTmpCallStack;
-    tmpCallStack.clear();
+    uint64_t nbAsync = reader.varint();
+    for(uint64_t i=0;i<nbAsync && reader.ok;i++)
+    {
+        tdstProfilerIdStats *stats = context->asyncStats.get(ZprofilerSavedId(siteIds, reader.varint(), 0));
+        stats = stats ? stats : &discarded;
+        ZprofilerLoadStats(reader, scale, stats->data, stats->histogram);
+    }
     
-    // Copy map data into a vector in the aim to sort it
-    std::map<std::string, tdstGenProfilerData>::iterator	IterMap;
-    for(IterMap=mapProfilerGraph.begin(); IterMap!=mapProfilerGraph.end(); ++IterMap)
+    uint64_t nbWaits = reader.varint();
+    for(uint64_t i=0;i<nbWaits && reader.ok;i++)
     {
-        strcpy((*IterMap).second.szBunchCodeName, (*IterMap).first.c_str());
-        tmpCallStack.push_back( (*IterMap).second );
+        tdstProfilerIdStats *stats = context->queueWaits.get(ZprofilerSavedId(queueIds, reader.varint(), 0));
+        stats = stats ? stats : &discarded;
+        ZprofilerLoadStats(reader, scale, stats->data, stats->histogram);
     }
     
-    // Sort the vector
-    std::sort(tmpCallStack.begin(), tmpCallStack.end(), MyDataSortPredicate);
+    uint64_t nbLocks = reader.varint();
+    for(uint64_t i=0;i<nbLocks && reader.ok;i++)
+    {
+        unsigned int lockId	= ZprofilerSavedId(lockIds, reader.varint(), (unsigned int)-1);
+        unsigned int siteId	= ZprofilerSavedId(siteIds, reader.varint(), 0);
+        tdstProfilerLockStats *stats = ZprofilerGetLockStats(context, lockId, siteId);
+        stats = stats ? stats : &discardedLock;
+        stats->nbContended += reader.varint();
+        ZprofilerLoadStats(reader, scale, stats->wait, stats->waitHistogram);
+        ZprofilerLoadStats(reader, scale, stats->hold, stats->holdHistogram);
+    }
+}
+
+//
+// Add a saved profile to the contexts of this process, in its ticks. Returns false
+// when the file can't be read or ends early, what it held until then is loaded.
+//
+bool Zprofiler_load_profile( const char *filename, bool mergeThreads, tdstProfilerSavedProcess &process )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    FILE *file = fopen(filename, "rb");
+    if( !file )
+    {
+        return false;
+    }
+    vector<unsigned char> content;
+    unsigned char block[64*1024];
+    size_t size;
+    while( (size = fread(block, 1, sizeof(block), file))>0 )
+    {
+        content.insert(content.end(), block, block+size);
+    }
+    fclose(file);
+    if( content.size()<8 || memcmp(&content[0], PROFILER_PROFILE_MAGIC, 8) )
+    {
+        return false;
+    }
     
-    // Create a map with thread Ids
-    for(IterTmpCallStack=tmpCallStack.begin(); IterTmpCallStack!=tmpCallStack.end(); ++IterTmpCallStack)
+    ZProfilerProfileReader reader(&content[0]+8, content.size()-8);
+    if( reader.varint()!=PROFILER_PROFILE_VERSION )
     {
-        //// DEBUG
-        //fprintf(DumpFile, "%s\n", (*IterTmpCallStack).szBunchCodeName );
-        //// DEBUG
-        
-        tmpString	= strstr((*IterTmpCallStack).szBunchCodeName, _THREADID_NAME_SEPARATOR_);
-        size		= (long)(tmpString-(*IterTmpCallStack).szBunchCodeName);
-        strncpy(szThreadId, (*IterTmpCallStack).szBunchCodeName+1, size-1); szThreadId[size-1] = 0;
-        ThreadIdsCount[szThreadId]++;
+        return false;
+    }
+    double ticksPerSecond	= reader.real();
+    process.processId		= (unsigned long)reader.varint();
+    process.hostName		= reader.string();
+    process.monotonicStart	= reader.varint();
+    process.realtimeStart	= reader.varint();
+    uint64_t duration		= reader.varint();
+    int perfMode			= (int)reader.varint();
+    uint64_t asyncDropped	= reader.varint();
+    uint64_t asyncUnmatched	= reader.varint();
+    if( !reader.ok || !(ticksPerSecond>0.0) )
+    {
+        return false;
     }
+    process.duration		= double(duration)*1000.0/ticksPerSecond;
+    process.nbThreads		= 0;
+    process.events.clear();
     
-    // Retrieve the number of thread ids
-    //unsigned long nbThreadIds	= mapProfilerGraph.size();
+    // Saved ticks to ticks of this process
+    double scale = gProfilerTicksPerSecond/ticksPerSecond;
     
-    IterThreadIdsCount = ThreadIdsCount.begin();
-    for(unsigned long nbThread=0;nbThread<ThreadIdsCount.size();nbThread++)
+    vector<unsigned int> siteIds(1, 0), counterIds, queueIds, lockIds, nodes;
+    tdstProfilerThreadContext *processContext = NULL;
+    bool complete = false;
+    while( reader.ok && !complete )
     {
-        sprintf(szThreadId, "%s", IterThreadIdsCount->first.c_str() );
-        
-        LOG("CALLSTACK of Thread %s\n", szThreadId);
-        LOG("_______________________________________________________________________________________\n");
-        LOG("| Total time   | Avg Time     |  Min time    |  Max time    | Calls  | Section\n");
-        LOG("_______________________________________________________________________________________\n");
-        
-        long nbSeparator = 0;
-        for(IterTmpCallStack=tmpCallStack.begin(); IterTmpCallStack!=tmpCallStack.end(); ++IterTmpCallStack)
+        int type = reader.byte();
+        if( type==PROFILER_PROFILE_SITE )
         {
-            tmpString	= (*IterTmpCallStack).szBunchCodeName+1;
+            uint64_t id	= reader.varint();
+            reader.varint();
+            std::string name = reader.string();
+            reader.string();
             
-            if( strstr(tmpString, szThreadId) )
+            // Reports merge sites by name, so a site per name is enough
+            ZprofilerSetSavedId(siteIds, id, ZprofilerGetSiteByName(name.c_str())->id, 0);
+        }
+        else if( type==PROFILER_PROFILE_COUNTER )
+        {
+            // Names are only copied the first time they're seen, loading profiles again doesn't grow them
+            uint64_t id	= reader.varint();
+            ZprofilerSetSavedId(counterIds, id, ZprofilerRegisterName(gProfilerCounterNames, 0, reader.string().c_str(), (size_t)-1, true), PROFILER_COUNTER_ITEMS);
+        }
+        else if( type==PROFILER_PROFILE_QUEUE )
+        {
+            uint64_t id	= reader.varint();
+            unsigned int queueId	= ZprofilerRegisterName(gProfilerQueueNames, 1, reader.string().c_str(), LIB_PROFILER_MAX_QUEUES, true);
+            uint64_t nbPushed	= reader.varint();
+            uint64_t nbPopped	= reader.varint();
+            uint64_t maxDepth	= reader.varint();
+            ZprofilerSetSavedId(queueIds, id, queueId, 0);
+            if( queueId )
             {
-                // Count the number of separator in the string
-                nbSeparator	= 0;
-                while( *tmpString )
-                {
-                    if( *tmpString++== '|' )
-                    {
-                        nbSeparator++;
-                    }
-                }
-                
-                // Get times and fill in the dislpay string
-                sprintf(textLine, "| %12.4f | %12.4f | %12.4f | %12.4f |%6d  | ",
-                        (*IterTmpCallStack).totalTime,
-                        (*IterTmpCallStack).averageTime,
-                        (*IterTmpCallStack).minTime,
-                        (*IterTmpCallStack).maxTime,
-                        (int)(*IterTmpCallStack).nbCalls);
-                
-                // Get the last start_profile_name in the string
-                tmpString = strrchr((*IterTmpCallStack).szBunchCodeName, '|')+1;
-                
-                IterMapCalls	= mapCalls.find( tmpString );
-                if( IterMapCalls!=mapCalls.end() )
+                tdstProfilerQueueCounts &counts = gProfilerQueueCounts[queueId];
+                counts.nbPushed.fetch_add(nbPushed);
+                counts.nbPopped.fetch_add(nbPopped);
+                if( maxDepth>counts.maxDepth.load() )
                 {
-                    double minTime			= (*IterMapCalls).second.minTime;
-                    double maxTime			= (*IterMapCalls).second.maxTime;
-                    //double totalTime		= (*IterMapCalls).second.totalTime;
-                    //double averageTime		= (*IterMapCalls).second.averageTime;
-                    //unsigned long nbCalls	= (*IterMapCalls).second.nbCalls;
-                    
-                    if( (*IterTmpCallStack).minTime<minTime )
-                    {
-                        (*IterMapCalls).second.minTime	= (*IterTmpCallStack).minTime;
-                    }
-                    if( (*IterTmpCallStack).maxTime>maxTime )
-                    {
-                        (*IterMapCalls).second.maxTime	= (*IterTmpCallStack).maxTime;
-                    }
-                    (*IterMapCalls).second.totalTime		+= (*IterTmpCallStack).totalTime;
-                    (*IterMapCalls).second.nbCalls			+= (*IterTmpCallStack).nbCalls;
-                    (*IterMapCalls).second.averageTime		= (*IterMapCalls).second.totalTime/(*IterMapCalls).second.nbCalls;
+                    counts.maxDepth.store(maxDepth);
                 }
-                
-                else
-                {
-                    tdstGenProfilerData tgt;// = (*IterMap).second;
-                    if( strstr(tmpString, szThreadId) )
-                    {
-                        strcpy( tgt.szBunchCodeName, tmpString );
-                    }
-                    else
-                    {
-                        sprintf(tgt.szBunchCodeName, "%s%s%s",
-                                szThreadId,
-                                _THREADID_NAME_SEPARATOR_,
-                                tmpString);
-                    }
-                    
-                    tgt.minTime			= (*IterTmpCallStack).minTime;
-                    tgt.maxTime			= (*IterTmpCallStack).maxTime;
-                    tgt.totalTime			= (*IterTmpCallStack).totalTime;
-                    tgt.averageTime		= (*IterTmpCallStack).averageTime;
-                    tgt.elapsedTime		= (*IterTmpCallStack).elapsedTime;
-                    tgt.lastTime			= (*IterTmpCallStack).lastTime;
-                    tgt.nbCalls			= (*IterTmpCallStack).nbCalls;
-                    
-                    mapCalls.insert( std::make_pair(tmpString, tgt) );
-                }
-                
-                
-                // Copy white space in the string to format the display
-                // in function of the hierarchy
-                for(i=0;i<nbSeparator;i++) strcat(textLine, "  ");
-                
-                // Remove the thred if from the string
-                if( strstr(tmpString, _THREADID_NAME_SEPARATOR_) )
-                {
-                    tmpString += strlen(szThreadId)+1;
-                }
-                
-                // Display the name of the bunch code profiled
-                LOG("%s%s\n", textLine, tmpString );
             }
         }
-        LOG("_______________________________________________________________________________________\n\n");
-        ++IterThreadIdsCount;
-    }
-    LOG( "\n\n");
-    
-    //
-    //	DUMP CALLS
-    //
-    IterThreadIdsCount = ThreadIdsCount.begin();
-    for(unsigned long nbThread=0;nbThread<ThreadIdsCount.size();nbThread++)
-    {
-        sprintf(szThreadId, "%s", IterThreadIdsCount->first.c_str() );
-        
-        LOG( "DUMP of Thread %s\n", szThreadId);
-        LOG( "_______________________________________________________________________________________\n");
-        LOG( "| Total time   | Avg Time     |  Min time    |  Max time    | Calls  | Section\n");
-        LOG( "_______________________________________________________________________________________\n");
-        
-        for(IterMapCalls=mapCalls.begin(); IterMapCalls!=mapCalls.end(); ++IterMapCalls)
+        else if( type==PROFILER_PROFILE_LOCK )
+        {
+            uint64_t id	= reader.varint();
+            ZprofilerSetSavedId(lockIds, id, ZprofilerRegisterName(gProfilerLockNames, 0, reader.string().c_str(), (size_t)-1, true), (unsigned int)-1);
+        }
+        else if( type==PROFILER_PROFILE_THREAD )
         {
-            tmpString = (*IterMapCalls).second.szBunchCodeName;
-            if( strstr(tmpString, szThreadId) )
+            unsigned long threadId		= (unsigned long)reader.varint();
+            uint64_t nbRecordsDropped	= reader.varint();
+            tdstProfilerThreadContext *context;
+            if( mergeThreads )
+            {
+                processContext = processContext ? processContext : ZprofilerNewThreadContext(process.processId);
+                context = processContext;
+            }
+            else
+            {
+                context = ZprofilerNewThreadContext(threadId);
+            }
+            context->nbRecordsDropped += nbRecordsDropped;
+            process.nbThreads++;
+            
+            ZprofilerLoadThread(reader, context, scale, siteIds, counterIds, queueIds, lockIds, nodes);
+            
+            uint64_t nbEvents	= reader.varint();
+            uint64_t ticks		= 0;
+            for(uint64_t i=0;i<nbEvents && reader.ok;i++)
             {
-                LOG( "| %12.4f | %12.4f | %12.4f | %12.4f | %6d | %s\n",
-                    (*IterMapCalls).second.totalTime,
-                    (*IterMapCalls).second.averageTime,
-                    (*IterMapCalls).second.minTime,
-                    (*IterMapCalls).second.maxTime,
-                    (int)(*IterMapCalls).second.nbCalls,
-                    (*IterMapCalls).second.szBunchCodeName+strlen(szThreadId)+1);
+                ticks += reader.varint();
+                uint64_t event = reader.varint();
+                tdstProfilerSavedEvent saved;
+                saved.threadId	= threadId;
+                saved.time		= (uint64_t)(double(ticks)*1000000000.0/ticksPerSecond);
+                saved.siteId	= ZprofilerSavedId(siteIds, event>>1, 0);
+                saved.type		= (unsigned int)(event&1);
+                process.events.push_back(saved);
             }
         }
-        LOG( "_______________________________________________________________________________________\n\n");
-        ++IterThreadIdsCount;
+        else if( type==PROFILER_PROFILE_END )
+        {
+            complete = true;
+        }
+        else
+        {
+            reader.ok = false;
+        }
     }
     
+    if( perfMode!=PROFILER_PERF_NONE )
+    {
+        gProfilerPerfMode.store(perfMode);
+    }
+    gProfilerAsyncDropped.fetch_add(asyncDropped);
+    gProfilerAsyncUnmatched.fetch_add(asyncUnmatched);
+    return complete && reader.ok;
 }
 
 ////
-////	Gestion des timers
+////	Aggregation
 ////
-#if IS_OS_WINDOWS
 
-// Initialize Our Timer (Get It Ready)
-void TimerInit()
+std::thread	gProfilerAggregator;
+std::atomic<bool>	gProfilerAggregatorStop(false);
+
+//
+// Update the stats with the records queued by a thread. Returns the number of records.
+//
+uint64_t ZprofilerAggregateRecords( tdstProfilerThreadContext *context )
 {
-    memset(&timer, 0, sizeof(timer));
+    uint64_t head = context->recordHead.load(std::memory_order_relaxed);
+    uint64_t tail = context->recordTail.load(std::memory_order_acquire);
+    if( head==tail )
+    {
+        return 0;
+    }
     
-    // Check to see if a performance counter is available
-    // If one is available the timer frequency will be updated
-    if( !QueryPerformanceFrequency((LARGE_INTEGER *) &timer.frequency) )
+    // The tree they point in is about to be emptied
+    if( ZprofilerIsContextCurrent(context) )
     {
-        // No performace counter available
-        timer.performance_timer	= false;					// Set performance timer to false
-        timer.mm_timer_start	= timeGetTime();			// Use timeGetTime() to get current time
-        timer.resolution		= 1.0f/1000.0f;				// Set our timer resolution to .001f
-        timer.frequency			= 1000;						// Set our timer frequency to 1000
-        timer.mm_timer_elapsed	= timer.mm_timer_start;		// Set the elapsed time to the current time
+        for(uint64_t record=head;record!=tail;record++)
+        {
+            const tdstProfilerRecord &queued = context->records[record & context->recordMask];
+            ZprofilerAddTime(context, queued.node, queued.time);
+        }
     }
-    else
+    context->recordHead.store(tail, std::memory_order_release);
+    return tail-head;
+}
+
+void ZprofilerAggregator()
+{
+    vector<tdstProfilerThreadContext*> contexts;
+    for(;;)
     {
-        // Performance counter is available, use it instead of the multimedia timer
-        // Get the current time and store it in performance_timer_start
-        QueryPerformanceCounter((LARGE_INTEGER *) &timer.performance_timer_start);
-        timer.performance_timer			= true;				// Set performance timer to true
+        bool stop = gProfilerAggregatorStop.load(std::memory_order_acquire);
         
-        // Calculate the timer resolution using the timer frequency
-        timer.resolution				= (float) (((double)1.0f)/((double)timer.frequency));
+        uint64_t nbRecords = 0;
+        ZprofilerGetThreadContexts(contexts);
+        for(size_t i=0;i<contexts.size();i++)
+        {
+            nbRecords += ZprofilerAggregateRecords(contexts[i]);
+        }
         
-        // Set the elapsed time to the current time
-        timer.performance_timer_elapsed	= timer.performance_timer_start;
+        if( stop )
+        {
+            break;
+        }
+        if( !nbRecords )
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+//
+// Wait for the records queued so far to be aggregated
+//
+void ZprofilerAggregationSync()
+{
+    if( !gProfilerAggregatorRunning.load() )
+    {
+        return;
+    }
+    vector<tdstProfilerThreadContext*> contexts;
+    ZprofilerGetThreadContexts(contexts);
+    for(size_t i=0;i<contexts.size();i++)
+    {
+        uint64_t tail = contexts[i]->recordTail.load();
+        while( contexts[i]->recordHead.load()<tail && gProfilerAggregatorRunning.load() )
+        {
+            std::this_thread::yield();
+        }
     }
 }
 
-// platform specific get hires times...
-double startHighResolutionTimer()
+void Zprofiler_enable_aggregation( unsigned int recordsPerThread, int policy )
 {
-    __int64 time;
-    
-    // Are we using the performance timer?
-    if( timer.performance_timer )
+    if( gProfilerAggregatorRunning.load() )
+    {
+        return;
+    }
+    gProfilerAggregationRecords	= recordsPerThread ? recordsPerThread : 1;
+    gProfilerAggregationPolicy	= policy;
+    gProfilerAggregatorStop.store(false);
+    gProfilerAggregatorRunning.store(true);
+    gProfilerAggregator			= std::thread(ZprofilerAggregator);
+    gProfilerAggregating.store(true);
+}
+
+//
+// Aggregate what is left and go back to updating stats in PROFILER_END
+//
+void Zprofiler_disable_aggregation()
+{
+    if( !gProfilerAggregatorRunning.load() )
+    {
+        return;
+    }
+    gProfilerAggregating.store(false);
+    gProfilerAggregatorStop.store(true, std::memory_order_release);
+    gProfilerAggregator.join();
+    gProfilerAggregatorRunning.store(false);
+}
+
+////
+////	Thread exit
+////
+
+// Stats of the threads that exited, merged by calling context. Only written
+// under ZprofilerRetiredCriticalSection, and read by reports like the context
+// of a thread, with thread id 0.
+tdstProfilerThreadContext *gProfilerRetiredContext = NULL;
+
+ZCriticalSection_t *ZprofilerRetiredCriticalSection()
+{
+    static ZCriticalSection_t *cs = NewCriticalSection();
+    return cs;
+}
+
+//
+// Add the stats of a thread to the retired context
+//
+void ZprofilerRetireStats( tdstProfilerThreadContext *retired, tdstProfilerThreadContext *context )
+{
+    // Nodes come after their parent
+    unsigned int nbNodes = context->nodes.size();
+    vector<unsigned int> nodes(nbNodes, PROFILER_ROOT_NODE);
+    for(unsigned int node=1;node<nbNodes;node++)
     {
-        // Grab the current performance time
-        QueryPerformanceCounter((LARGE_INTEGER *) &time);
+        const tdstProfilerNode &source = context->nodes[node];
+        unsigned int target = ZprofilerGetChildNode(retired, nodes[source.parent], source.siteId);
+        nodes[node] = target;
         
-        // Return the current time minus the start time multiplied
-        // by the resolution and 1000 (To Get MS)
-        return ( (double) ( time - timer.performance_timer_start) * timer.resolution)*1000.0f;
+        tdstProfilerNode &merged = retired->nodes[target];
+        ZprofilerMergeData(merged.data, source.data);
+        ZprofilerMergeHistogram(retired->histograms[target], context->histograms[node]);
+        ZprofilerMergeAllocations(merged.allocations, source.allocations);
+        for(unsigned int i=0;i<PROFILER_PERF_COUNTERS;i++)
+        {
+            merged.perfCounts[i] += source.perfCounts[i];
+        }
+        for(unsigned int counter = source.firstCounter.load(std::memory_order_relaxed); counter!=PROFILER_NO_COUNTER; counter = context->counters[counter].next)
+        {
+            ZprofilerAddNodeCounter(retired, target, context->counters[counter].counterId, context->counters[counter].value);
+        }
     }
-    else
+    
+    unsigned int nbSampling = context->sampling.size();
+    while( retired->sampling.size()<nbSampling && !retired->sampling.full() )
+    {
+        retired->sampling.push_back();
+    }
+    for(unsigned int siteId=0;siteId<nbSampling && siteId<retired->sampling.size();siteId++)
+    {
+        retired->sampling[siteId].nbCalls	+= context->sampling[siteId].nbCalls;
+        retired->sampling[siteId].nbSampled	+= context->sampling[siteId].nbSampled;
+    }
+    
+    unsigned int nbAsync = context->asyncStats.count.load(std::memory_order_relaxed);
+    for(unsigned int index=0;index<nbAsync;index++)
+    {
+        const tdstProfilerIdStats &source = context->asyncStats.stats[index];
+        tdstProfilerIdStats *stats = retired->asyncStats.get(source.id);
+        if( stats )
+        {
+            ZprofilerMergeData(stats->data, source.data);
+            ZprofilerMergeHistogram(stats->histogram, source.histogram);
+        }
+    }
+    unsigned int nbWaits = context->queueWaits.count.load(std::memory_order_relaxed);
+    for(unsigned int index=0;index<nbWaits;index++)
+    {
+        const tdstProfilerIdStats &source = context->queueWaits.stats[index];
+        tdstProfilerIdStats *stats = retired->queueWaits.get(source.id);
+        if( stats )
+        {
+            ZprofilerMergeData(stats->data, source.data);
+            ZprofilerMergeHistogram(stats->histogram, source.histogram);
+        }
+    }
+    unsigned int nbLocks = context->lockCount.load(std::memory_order_relaxed);
+    for(unsigned int index=0;index<nbLocks;index++)
     {
-        // Return the current time minus the start time multiplied
-        // by the resolution and 1000 (To Get MS)
-        return( (double) ( timeGetTime() - timer.mm_timer_start) * timer.resolution)*1000.0f;
+        const tdstProfilerLockStats &source = context->lockStats[index];
+        tdstProfilerLockStats *stats = ZprofilerGetLockStats(retired, source.lockId, source.siteId);
+        if( stats )
+        {
+            stats->nbContended += source.nbContended;
+            ZprofilerMergeData(stats->wait, source.wait);
+            ZprofilerMergeHistogram(stats->waitHistogram, source.waitHistogram);
+            ZprofilerMergeData(stats->hold, source.hold);
+            ZprofilerMergeHistogram(stats->holdHistogram, source.holdHistogram);
+        }
     }
+    retired->nbRecordsDropped += context->nbRecordsDropped;
 }
-/*
- unsigned long endHighResolutionTimer(unsigned long time[2])
- {
- unsigned long ticks=0;
- //__asm__ __volatile__(
- //   "rdtsc\n"
- //   "sub  0x4(%%ecx),  %%edx\n"
- //   "sbb  (%%ecx),  %%eax\n"
- //   : "=a" (ticks) : "c" (time)
- //   );
- return ticks;
- }
- */
+
+//
+// Called on the thread that exits, from the destructor of the thread key: closes
+// its perf group, moves its stats to the retired context and leaves its context
+// to the next thread. Its timeline stays in the context until then.
+//
+void ZprofilerThreadExit( tdstProfilerThreadContext *context )
+{
+    ZPROFILER_INTERNAL_SCOPE;
+    
+    // Sections started by destructors that run later register a new context
+    gProfilerThreadContext = NULL;
+    
+    // Hand over the capture chunk being filled, which carries this thread id
+    context->captureBusy.store(1);
+    if( gProfilerCapturing.load() && context->captureChunk )
+    {
+        ZprofilerCaptureSubmitChunk(context->captureChunk);
+        context->captureChunk = NULL;
+    }
+    context->captureBusy.store(0, std::memory_order_release);
+    
+    ZprofilerCloseThreadPerf(context);
+    ZprofilerWaitRecords(context);
+    bool current = ZprofilerIsContextCurrent(context);
+    if( current )
+    {
+        LockCriticalSection(ZprofilerRetiredCriticalSection());
+        if( !gProfilerRetiredContext )
+        {
+            gProfilerRetiredContext = ZprofilerNewThreadContext(0);
+        }
+        else if( !ZprofilerIsContextCurrent(gProfilerRetiredContext) )
+        {
+            ZprofilerResetThreadContext(gProfilerRetiredContext);
+        }
+        ZprofilerRetireStats(gProfilerRetiredContext, context);
+        UnLockCriticalSection(ZprofilerRetiredCriticalSection());
+    }
+    
+    uint64_t nbEvents			= context->nbEvents.load(std::memory_order_relaxed);
+    uint64_t nbEventsDropped	= context->nbEventsDropped;
+    ZprofilerResetThreadContext(context);
+    if( current )
+    {
+        context->nbEvents.store(nbEvents, std::memory_order_release);
+        context->nbEventsDropped	= nbEventsDropped;
+    }
+    
+    LockCriticalSection(ZprofilerThreadsCriticalSection());
+    context->exited = true;
+    UnLockCriticalSection(ZprofilerThreadsCriticalSection());
+}
+
+////
+////	Allocations
+////
+
+#if LIB_PROFILER_TRACK_ALLOCATIONS
+
+#if IS_OS_LINUX && defined(__GLIBC__)
+#define LIB_PROFILER_HOOK_MALLOC 1
+#else
+#define LIB_PROFILER_HOOK_MALLOC 0
+#endif
+
+#if IS_OS_WINDOWS
+#include <malloc.h>
+#define ZprofilerAllocationSize(pointer) _msize(pointer)
 #elif IS_OS_MACOSX
+#include <malloc/malloc.h>
+#define ZprofilerAllocationSize(pointer) malloc_size(pointer)
+#else
+#include <malloc.h>
+#define ZprofilerAllocationSize(pointer) malloc_usable_size(pointer)
+#endif
 
-// Initialize Our Timer (Get It Ready)
-void TimerInit()
+#include <new>
+#include <errno.h>
+
+//
+// glibc allocator, under the malloc family replaced below. operator new uses it
+// too, so its allocations aren't counted twice.
+//
+#if LIB_PROFILER_HOOK_MALLOC
+extern "C"
 {
+    void *__libc_malloc( size_t size );
+    void *__libc_calloc( size_t count, size_t size );
+    void *__libc_realloc( void *pointer, size_t size );
+    void *__libc_memalign( size_t alignment, size_t size );
+    void *__libc_valloc( size_t size );
+    void *__libc_pvalloc( size_t size );
+    void __libc_free( void *pointer );
 }
+#define ZprofilerRawMalloc(size) __libc_malloc(size)
+#define ZprofilerRawFree(pointer) __libc_free(pointer)
+#else
+#define ZprofilerRawMalloc(size) malloc(size)
+#define ZprofilerRawFree(pointer) free(pointer)
+#endif
 
-double startHighResolutionTimer()
+//
+// Count a block just allocated, or about to be freed, in the innermost open
+// section. Only reads the thread context, threads that never profiled anything
+// aren't tracked, nor the blocks of the profiler itself. Sizes are the usable
+// sizes of the blocks, as freeing only knows those.
+//
+inline void ZprofilerTrackAllocation( void *pointer )
 {
-    UnsignedWide t;
-    Microseconds(&t);
-    /*time[0] = t.lo;
-     time[1] = t.hi;
-     */
-    double ms = double(t.hi*1000LU);
-    ms += double(t.lo/1000LU);//*0.001;
+    tdstProfilerThreadContext *context = gProfilerThreadContext;
+    if( !pointer || !context || gProfilerInProfiler )
+    {
+        return;
+    }
+    size_t size = ZprofilerAllocationSize(pointer);
+    context->liveBytes += (int64_t)size;
+    if( context->callStack.empty() )
+    {
+        return;
+    }
     
+    tdstProfilerFrame &frame = context->callStack.back();
+    tdstProfilerAllocations &allocations = context->nodes[frame.node].allocations;
+    allocations.nbAllocs++;
+    allocations.allocBytes += size;
+    if( context->liveBytes>frame.peakLiveBytes )
+    {
+        frame.peakLiveBytes = context->liveBytes;
+    }
+}
+
+//
+// A block of size bytes was freed, or moved by realloc
+//
+inline void ZprofilerTrackFreedSize( size_t size )
+{
+    tdstProfilerThreadContext *context = gProfilerThreadContext;
+    if( !context || gProfilerInProfiler )
+    {
+        return;
+    }
+    context->liveBytes -= (int64_t)size;
+    if( context->callStack.empty() )
+    {
+        return;
+    }
     
-    return ms;
+    tdstProfilerAllocations &allocations = context->nodes[context->callStack.back().node].allocations;
+    allocations.nbFrees++;
+    allocations.freeBytes += size;
 }
-/*
- unsigned long endHighResolutionTimer(unsigned long time[2])
- {
- UnsignedWide t;
- Microseconds(&t);
- return t.lo - time[0];
- // given that we're returning a 32 bit integer, and this is unsigned subtraction...
- // it will just wrap around, we don't need the upper word of the time.
- // NOTE: the code assumes that more than 3 hrs will not go by between calls to startHighResolutionTimer() and endHighResolutionTimer().
- // I mean... that damn well better not happen anyway.
- }
- */
-#else
 
-// Initialize Our Timer (Get It Ready)
-void TimerInit()
+inline void ZprofilerTrackFree( void *pointer )
 {
+    if( pointer && gProfilerThreadContext && !gProfilerInProfiler )
+    {
+        ZprofilerTrackFreedSize(ZprofilerAllocationSize(pointer));
+    }
 }
 
-double startHighResolutionTimer()
+inline void *ZprofilerNew( size_t size, bool nothrow )
 {
-    timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts); // Works on Linux
+    for(;;)
+    {
+        void *pointer = ZprofilerRawMalloc(size ? size : 1);
+        if( pointer )
+        {
+            ZprofilerTrackAllocation(pointer);
+            return pointer;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if( !handler )
+        {
+            if( nothrow )
+            {
+                return NULL;
+            }
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+inline void ZprofilerDelete( void *pointer )
+{
+    ZprofilerTrackFree(pointer);
+    ZprofilerRawFree(pointer);
+}
+
+void *operator new( size_t size ) { return ZprofilerNew(size, false); }
+void *operator new[]( size_t size ) { return ZprofilerNew(size, false); }
+void *operator new( size_t size, const std::nothrow_t & ) noexcept { return ZprofilerNew(size, true); }
+void *operator new[]( size_t size, const std::nothrow_t & ) noexcept { return ZprofilerNew(size, true); }
+void operator delete( void *pointer ) noexcept { ZprofilerDelete(pointer); }
+void operator delete[]( void *pointer ) noexcept { ZprofilerDelete(pointer); }
+void operator delete( void *pointer, const std::nothrow_t & ) noexcept { ZprofilerDelete(pointer); }
+void operator delete[]( void *pointer, const std::nothrow_t & ) noexcept { ZprofilerDelete(pointer); }
+#if defined(__cpp_sized_deallocation)
+void operator delete( void *pointer, size_t ) noexcept { ZprofilerDelete(pointer); }
+void operator delete[]( void *pointer, size_t ) noexcept { ZprofilerDelete(pointer); }
+#endif
+
+#if LIB_PROFILER_HOOK_MALLOC
+//
+// The malloc family, as glibc lets a program replace it. Aligned operator new
+// goes through aligned_alloc, so it's tracked here.
+//
+extern "C"
+{
+    void *malloc( size_t size )
+    {
+        void *pointer = __libc_malloc(size);
+        ZprofilerTrackAllocation(pointer);
+        return pointer;
+    }
     
+    void *calloc( size_t count, size_t size )
+    {
+        void *pointer = __libc_calloc(count, size);
+        ZprofilerTrackAllocation(pointer);
+        return pointer;
+    }
+    
+    void *realloc( void *pointer, size_t size )
+    {
+        if( !pointer )
+        {
+            return malloc(size);
+        }
+        if( !size )
+        {
+            free(pointer);
+            return NULL;
+        }
+        size_t oldSize = ZprofilerAllocationSize(pointer);
+        void *newPointer = __libc_realloc(pointer, size);
+        if( newPointer )
+        {
+            // Count a move or a resize as freeing the old block and allocating the new one
+            ZprofilerTrackFreedSize(oldSize);
+            ZprofilerTrackAllocation(newPointer);
+        }
+        return newPointer;
+    }
+    
+    void free( void *pointer )
+    {
+        ZprofilerTrackFree(pointer);
+        __libc_free(pointer);
+    }
+    
+    void *memalign( size_t alignment, size_t size )
+    {
+        void *pointer = __libc_memalign(alignment, size);
+        ZprofilerTrackAllocation(pointer);
+        return pointer;
+    }
+    
+    void *aligned_alloc( size_t alignment, size_t size )
+    {
+        return memalign(alignment, size);
+    }
     
-    double ms = double(ts.tv_sec*1000LU);
-    ms += double(ts.tv_nsec/1000LU)*0.001;
+    int posix_memalign( void **pointer, size_t alignment, size_t size )
+    {
+        if( !alignment || (alignment&(alignment-1)) || alignment%sizeof(void*) )
+        {
+            return EINVAL;
+        }
+        void *block = memalign(alignment, size);
+        if( !block )
+        {
+            return ENOMEM;
+        }
+        *pointer = block;
+        return 0;
+    }
     
+    void *valloc( size_t size )
+    {
+        void *pointer = __libc_valloc(size);
+        ZprofilerTrackAllocation(pointer);
+        return pointer;
+    }
     
-    return ms;
+    void *pvalloc( size_t size )
+    {
+        void *pointer = __libc_pvalloc(size);
+        ZprofilerTrackAllocation(pointer);
+        return pointer;
+    }
 }
-#endif
+#endif  // LIB_PROFILER_HOOK_MALLOC
+
+#endif  // LIB_PROFILER_TRACK_ALLOCATIONS
 
 #endif  // LIB_PROFILER_IMPLEMENTATION
 
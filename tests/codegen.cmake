@@ -0,0 +1,34 @@
+#
+# Compares the disassembly of the functions of libProfilerCodegen.cpp with
+# objdump, up to their return, addresses and symbol references left out.
+# cmake -DOBJDUMP=objdump -DLIBRARY=libprofiler-codegen.a -P codegen.cmake
+#
+
+function(disassemble output name)
+    set(${output} "" PARENT_SCOPE)
+    string(REGEX MATCH "<${name}>:\n[^\n]*(\n[^\n]+)*" body "${disassembly}")
+    if(NOT body)
+        message(FATAL_ERROR "${name} isn't in ${LIBRARY}")
+    endif()
+    string(REGEX REPLACE "[^\n]*:\n" "" body "${body}")
+    string(REGEX REPLACE "\n *[0-9a-f]+:\t" "\n" body "\n${body}")
+    string(REGEX REPLACE "<[^>\n]*>|#[^\n]*" "" body "${body}")
+    string(REGEX REPLACE "[ \t]+\n" "\n" body "${body}\n")
+    # The padding after the return depends on where the function is
+    string(REGEX REPLACE "\n(ret[^\n]*)\n.*" "\n\\1\n" body "${body}")
+    set(${output} "${body}" PARENT_SCOPE)
+endfunction()
+
+execute_process(COMMAND ${OBJDUMP} -d --no-show-raw-insn ${LIBRARY} OUTPUT_VARIABLE disassembly RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${OBJDUMP} failed on ${LIBRARY}")
+endif()
+
+disassemble(empty zprofilerCodegenEmpty)
+foreach(name zprofilerCodegenFilteredCategory zprofilerCodegenFilteredLevel)
+    disassemble(filtered ${name})
+    if(NOT filtered STREQUAL empty)
+        message(FATAL_ERROR "${name} has code of its section:\n${filtered}\nwhere zprofilerCodegenEmpty has:\n${empty}")
+    endif()
+endforeach()
+message(STATUS "Filtered sections generate no code:\n${empty}")
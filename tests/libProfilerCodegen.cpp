@@ -0,0 +1,35 @@
+//
+//  libProfilerCodegen.cpp
+//  libProfiler
+//
+//  A section filtered out by category and one filtered out by level, next to
+//  the same code without sections. The codegen test compares their
+//  disassembly: filtered sections must generate no code at all.
+//
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_CATEGORIES PROFILER_CATEGORY_DEFAULT
+#define LIB_PROFILER_LEVEL PROFILER_LEVEL_NORMAL
+#include "libProfiler.h"
+
+
+volatile int gCodegenValue;
+
+extern "C" void zprofilerCodegenEmpty()
+{
+    gCodegenValue = gCodegenValue + 1;
+}
+
+extern "C" void zprofilerCodegenFilteredCategory()
+{
+    PROFILER_START_CAT(CodegenNet, PROFILER_CATEGORY_NET, PROFILER_LEVEL_COARSE);
+    gCodegenValue = gCodegenValue + 1;
+    PROFILER_END_CAT(PROFILER_CATEGORY_NET, PROFILER_LEVEL_COARSE);
+}
+
+extern "C" void zprofilerCodegenFilteredLevel()
+{
+    PROFILER_START_CAT(CodegenFine, PROFILER_CATEGORY_DEFAULT, PROFILER_LEVEL_VERBOSE);
+    gCodegenValue = gCodegenValue + 1;
+    PROFILER_END_CAT(PROFILER_CATEGORY_DEFAULT, PROFILER_LEVEL_VERBOSE);
+}
@@ -0,0 +1,62 @@
+//
+//  libProfilerSmoke.cpp
+//  libProfiler
+//
+//  Runs a few nested sections, each inner one sleeping, and writes them for
+//  the smoke tests of the tools:
+//  ./profiler-smoke capture capture.lpc     streams them with Zprofiler_start_capture
+//  ./profiler-smoke save profile.lprof [us] saves them with Zprofiler_save_profile,
+//                                           the inner sections sleeping us microseconds
+//
+
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_IMPLEMENTATION
+#include "libProfiler.h"
+
+
+static void runSections(long sleepUs)
+{
+    PROFILER_START(SmokeOuter);
+    for (int i = 0; i < 20; i++)
+    {
+        PROFILER_START(SmokeInner);
+        std::this_thread::sleep_for(std::chrono::microseconds(sleepUs));
+        PROFILER_END();
+    }
+    PROFILER_END();
+}
+
+int main(int argc, const char * argv[])
+{
+    if (argc < 3 || (strcmp(argv[1], "capture") && strcmp(argv[1], "save")))
+    {
+        fprintf(stderr, "usage: %s capture capture.lpc\n       %s save profile.lprof [us]\n", argv[0], argv[0]);
+        return 2;
+    }
+    long sleepUs = argc > 3 ? atol(argv[3]) : 100;
+
+    Zprofiler_enable();
+    if (!strcmp(argv[1], "capture"))
+    {
+        if (!Zprofiler_start_capture(argv[2]))
+        {
+            fprintf(stderr, "can't write %s\n", argv[2]);
+            return 1;
+        }
+        runSections(sleepUs);
+        Zprofiler_stop_capture();
+        return 0;
+    }
+
+    runSections(sleepUs);
+    if (!Zprofiler_save_profile(argv[2]))
+    {
+        fprintf(stderr, "can't write %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#
+# Smoke tests of the tools on the files written by profiler-smoke, in DIR:
+# cmake -DSTEP=capture|merge|diff -DSMOKE=profiler-smoke -DCONVERT=libprofiler-convert
+#       -DMERGE=libprofiler-merge -DDIFF=libprofiler-diff -DDIR=dir -P smoke.cmake
+#
+
+# Runs a command, checks its exit code, and returns what it printed
+function(run output expected)
+    execute_process(COMMAND ${ARGN} OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE result)
+    if(NOT result STREQUAL "${expected}")
+        message(FATAL_ERROR "${ARGN} exited with ${result} instead of ${expected}:\n${out}${err}")
+    endif()
+    set(${output} "${out}" PARENT_SCOPE)
+endfunction()
+
+function(expect text pattern)
+    if(NOT text MATCHES "${pattern}")
+        message(FATAL_ERROR "no ${pattern} in:\n${text}")
+    endif()
+endfunction()
+
+file(MAKE_DIRECTORY ${DIR})
+
+if(STEP STREQUAL "capture")
+    # Capture, then convert to the tables and the JSON report
+    run(out 0 ${SMOKE} capture ${DIR}/capture.lpc)
+    run(out 0 ${CONVERT} ${DIR}/capture.lpc -json ${DIR}/capture.json)
+    expect("${out}" "CALLSTACK")
+    expect("${out}" "SmokeOuter")
+    expect("${out}" "SmokeInner")
+    file(READ ${DIR}/capture.json json)
+    expect("${json}" "\"name\":\"SmokeInner\",\"calls\":20,")
+elseif(STEP STREQUAL "merge")
+    # Two saved processes merged into one report
+    run(out 0 ${SMOKE} save ${DIR}/a.lprof)
+    run(out 0 ${SMOKE} save ${DIR}/b.lprof)
+    run(out 0 ${MERGE} ${DIR}/a.lprof ${DIR}/b.lprof -json ${DIR}/merged.json)
+    expect("${out}" "PROCESSES")
+    expect("${out}" "SmokeInner")
+    file(READ ${DIR}/merged.json json)
+    expect("${json}" "\"name\":\"SmokeInner\",\"calls\":40,")
+elseif(STEP STREQUAL "diff")
+    # 0 when nothing is slower, 1 when a path is, 2 when a profile can't be read
+    run(out 0 ${SMOKE} save ${DIR}/base.lprof 100)
+    run(out 0 ${SMOKE} save ${DIR}/slow.lprof 5000)
+    run(out 0 ${DIFF} ${DIR}/base.lprof ${DIR}/base.lprof)
+    expect("${out}" "0 slower")
+    run(out 1 ${DIFF} ${DIR}/base.lprof ${DIR}/slow.lprof)
+    expect("${out}" "SmokeInner")
+    run(out 2 ${DIFF} ${DIR}/base.lprof ${DIR}/missing.lprof)
+else()
+    message(FATAL_ERROR "unknown step ${STEP}")
+endif()
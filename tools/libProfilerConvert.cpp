@@ -0,0 +1,228 @@
+//
+//  libProfilerConvert.cpp
+//  libProfiler
+//
+//  Reads a capture written by Zprofiler_start_capture and prints the same
+//  CALLSTACK and DUMP tables as LogProfiler. Optionally writes the events as
+//  Chrome Trace Event JSON, and the report as JSON, CSV or folded stacks.
+//
+//  Built by the CMake project, or:
+//  g++ -O2 -std=c++11 -I.. libProfilerConvert.cpp -o libprofiler-convert -lpthread
+//  ./libprofiler-convert capture.lpc [-chrome trace.json] [-json report.json] [-csv report.csv] [-folded report.folded]
+//
+
+#include <stdlib.h>
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_IMPLEMENTATION
+#include "libProfiler.h"
+
+
+static bool readVarint(FILE *file, uint64_t &value)
+{
+    unsigned char buffer[10];
+    int size = 0;
+    int c;
+    do
+    {
+        c = fgetc(file);
+        if (c == EOF || size == 10)
+            return false;
+        buffer[size++] = (unsigned char)c;
+    } while (c & 0x80);
+    return ZprofilerReadVarint(buffer, buffer + size, value) != NULL;
+}
+
+static bool readString(FILE *file, std::string &text)
+{
+    uint64_t length;
+    if (!readVarint(file, length))
+        return false;
+    text.resize((size_t)length);
+    return !length || fread(&text[0], 1, (size_t)length, file) == length;
+}
+
+int main(int argc, const char * argv[])
+{
+    const char *captureName = NULL;
+    const char *chromeName = NULL;
+    const char *jsonName = NULL, *csvName = NULL, *foldedName = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-chrome") && i + 1 < argc)
+            chromeName = argv[++i];
+        else if (!strcmp(argv[i], "-json") && i + 1 < argc)
+            jsonName = argv[++i];
+        else if (!strcmp(argv[i], "-csv") && i + 1 < argc)
+            csvName = argv[++i];
+        else if (!strcmp(argv[i], "-folded") && i + 1 < argc)
+            foldedName = argv[++i];
+        else
+            captureName = argv[i];
+    }
+    if (!captureName)
+    {
+        fprintf(stderr, "usage: %s capture.lpc [-chrome trace.json] [-json report.json] [-csv report.csv] [-folded report.folded]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(captureName, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "can't open %s\n", captureName);
+        return 1;
+    }
+
+    char magic[8];
+    uint64_t version, ticksPerSecond, startTicks, processId;
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, PROFILER_CAPTURE_MAGIC, 8)
+        || !readVarint(file, version) || version != PROFILER_CAPTURE_VERSION
+        || !readVarint(file, ticksPerSecond) || !readVarint(file, startTicks) || !readVarint(file, processId))
+    {
+        fprintf(stderr, "%s is not a libProfiler capture\n", captureName);
+        return 1;
+    }
+
+    // Replay into contexts of this process, with the clock of the captured one
+    Zprofiler_enable();
+    gProfilerTicksPerSecond = (double)ticksPerSecond;
+    gProfilerStartTicks = startTicks;
+    gProfilerProcessId = (unsigned long)processId;
+
+    // The overhead measured here isn't the one of the captured process
+    gProfilerOverheadTicks = 0.0;
+    gProfilerSelfOverheadTicks = 0.0;
+
+    FILE *chrome = NULL;
+    const char *separator = "";
+    if (chromeName)
+    {
+        chrome = fopen(chromeName, "wt");
+        if (!chrome)
+        {
+            fprintf(stderr, "can't open %s\n", chromeName);
+            return 1;
+        }
+        fprintf(chrome, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+
+    std::vector<unsigned int> siteIds;
+    std::map<unsigned long, tdstProfilerThreadContext*> contexts;
+    std::vector<unsigned char> data;
+    uint64_t nbEvents = 0, nbLostChunks = 0;
+    bool complete = false;
+
+    int type;
+    while ((type = fgetc(file)) != EOF)
+    {
+        if (type == PROFILER_CAPTURE_SITE)
+        {
+            uint64_t id, line;
+            std::string name, siteFile;
+            if (!readVarint(file, id) || !readVarint(file, line) || !readString(file, name) || !readString(file, siteFile))
+                break;
+            ZProfilerSite *site = new ZProfilerSite(strdup(name.c_str()), strdup(siteFile.c_str()), (int)line);
+            if (siteIds.size() <= id)
+                siteIds.resize((size_t)id + 1, 0);
+            siteIds[(size_t)id] = site->id;
+        }
+        else if (type == PROFILER_CAPTURE_CHUNK)
+        {
+            uint64_t threadId, time, lostChunks, size;
+            if (!readVarint(file, threadId) || !readVarint(file, time) || !readVarint(file, lostChunks) || !readVarint(file, size))
+                break;
+            data.resize((size_t)size);
+            if (size && fread(&data[0], 1, (size_t)size, file) != size)
+                break;
+
+            tdstProfilerThreadContext *&context = contexts[(unsigned long)threadId];
+            if (!context)
+            {
+                context = ZprofilerNewThreadContext((unsigned long)threadId);
+                if (chrome)
+                {
+                    fprintf(chrome, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"Thread %lu\"}}",
+                            separator, gProfilerProcessId, (unsigned long)threadId, (unsigned long)threadId);
+                    separator = ",";
+                }
+            }
+
+            // Events were lost: the open frames can't be closed anymore
+            if (lostChunks)
+            {
+                context->callStack.clear();
+                nbLostChunks += lostChunks;
+            }
+
+            const unsigned char *buffer = data.empty() ? NULL : &data[0];
+            const unsigned char *end = buffer + data.size();
+            while (buffer && buffer < end)
+            {
+                uint64_t delta, event;
+                buffer = ZprofilerReadVarint(buffer, end, delta);
+                if (buffer)
+                    buffer = ZprofilerReadVarint(buffer, end, event);
+                if (!buffer)
+                    break;
+                time += delta;
+                nbEvents++;
+
+                unsigned int siteId = (event >> 1) < siteIds.size() ? siteIds[(size_t)(event >> 1)] : 0;
+                if ((event & 1) == PROFILER_EVENT_BEGIN)
+                {
+                    tdstProfilerFrame &frame = ZprofilerPushFrame(context, siteId);
+                    frame.startTime = time;
+                }
+                else if (!context->callStack.empty())
+                {
+                    const tdstProfilerFrame &frame = context->callStack.back();
+                    if (chrome && frame.counted)
+                    {
+                        fprintf(chrome, ",\n{\"name\":");
+                        ZprofilerWriteJsonString(chrome, gProfilerSites[context->nodes[frame.node].siteId]->name);
+                        fprintf(chrome, ",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                                gProfilerProcessId,
+                                (unsigned long)threadId,
+                                ZprofilerTicksToMs(frame.startTime - gProfilerStartTicks) * 1000.0,
+                                ZprofilerTicksToMs(time - frame.startTime) * 1000.0);
+                    }
+                    ZprofilerPopFrame(context, time);
+                }
+            }
+        }
+        else if (type == PROFILER_CAPTURE_END)
+        {
+            complete = true;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+    fclose(file);
+
+    if (chrome)
+    {
+        fprintf(chrome, "\n]}\n");
+        fclose(chrome);
+    }
+
+    LogProfiler();
+
+    if (jsonName && !Zprofiler_export_json(jsonName))
+        fprintf(stderr, "can't write %s\n", jsonName);
+    if (csvName && !Zprofiler_export_csv(csvName))
+        fprintf(stderr, "can't write %s\n", csvName);
+    if (foldedName && !Zprofiler_export_folded(foldedName))
+        fprintf(stderr, "can't write %s\n", foldedName);
+
+    fprintf(stderr, "%llu events, %u threads", (unsigned long long)nbEvents, (unsigned int)contexts.size());
+    if (nbLostChunks)
+        fprintf(stderr, ", %llu chunks lost while capturing", (unsigned long long)nbLostChunks);
+    if (!complete)
+        fprintf(stderr, ", capture is truncated");
+    fprintf(stderr, "\n");
+
+    return 0;
+}
@@ -0,0 +1,347 @@
+//
+//  libProfilerDiff.cpp
+//  libProfiler
+//
+//  Compares profiles saved by Zprofiler_save_profile, a baseline and a current
+//  run, section by section matched on their call path. Prints the absolute and
+//  relative changes of the calls, total time, self time and p99 of each path,
+//  and flags the changes above the noise thresholds:
+//  - time and self time per call, when they change by more than -threshold
+//    percent and by more than -sigma standard errors, from the variance of the
+//    times recorded in both runs
+//  - p99, when it changes by more than -p99-threshold percent and both runs
+//    have at least -min-calls calls
+//  Paths under -min-ms of total time in both runs aren't flagged. Exits with 1
+//  when a path is slower, so a benchmark stage can fail the build.
+//
+//  Built by the CMake project, or:
+//  g++ -O2 -std=c++11 -I.. libProfilerDiff.cpp -o libprofiler-diff -lpthread -lrt
+//  ./libprofiler-diff [options] baseline.lprof current.lprof
+//  ./libprofiler-diff [options] baseline.lprof... -- current.lprof...
+//  options: [-threshold %] [-sigma n] [-p99-threshold %] [-min-calls n] [-min-ms ms] [-n rows]
+//
+//  Several profiles on one side, the processes of a prefork server, are merged.
+//
+
+#include <stdlib.h>
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_IMPLEMENTATION
+#include "libProfiler.h"
+
+
+// Stats of a call path in one run, times in ticks
+struct PathStats
+{
+    PathStats() : selfTime(0)
+    {
+        memset(&data, 0, sizeof(data));
+        memset(&histogram, 0, sizeof(histogram));
+    }
+
+    tdstGenProfilerData data;
+    tdstProfilerHistogram histogram;
+    uint64_t selfTime;
+};
+
+typedef std::map<std::string, PathStats> PathTable;
+
+#define FLAG_SLOWER 1
+#define FLAG_FASTER 2
+
+struct PathDiff
+{
+    const std::string *path;
+    const PathStats *base;                  // NULL when the path isn't in the run
+    const PathStats *current;
+    double sigma;                           // Change of the time per call in standard errors
+    int timeFlag, selfFlag, p99Flag;
+};
+
+static double thresholdPercent = 5.0;
+static double sigmaThreshold = 3.0;
+static double p99ThresholdPercent = 15.0;
+static unsigned long minCalls = 100;
+static double minMs = 1.0;
+
+static double ms(double ticks)
+{
+    return ticks * 1000.0 / gProfilerTicksPerSecond;
+}
+
+static double relative(double base, double current)
+{
+    return base > 0.0 ? (current - base) * 100.0 / base : 0.0;
+}
+
+//
+// Load the profiles of one run, and add the paths of the contexts they made
+//
+static bool loadRun(const std::vector<const char*> &fileNames, PathTable &paths, std::string &description)
+{
+    std::vector<tdstProfilerThreadContext*> before, after;
+    ZprofilerGetThreadContexts(before);
+    for (size_t i = 0; i < fileNames.size(); i++)
+    {
+        tdstProfilerSavedProcess process;
+        if (!Zprofiler_load_profile(fileNames[i], true, process))
+        {
+            fprintf(stderr, "can't read %s, or it is truncated\n", fileNames[i]);
+            return false;
+        }
+        char text[256];
+        snprintf(text, sizeof(text), "%s%s (pid %lu on %s, %u threads, %.1f ms)", i ? ", " : "", fileNames[i], process.processId,
+                 process.hostName.c_str(), process.nbThreads, process.duration);
+        description += text;
+    }
+    ZprofilerGetThreadContexts(after);
+
+    std::vector<const char*> siteNames;
+    ZprofilerGetSiteNames(siteNames);
+    std::vector<uint64_t> descendantCalls, inclusiveTimes, selfTimes;
+    std::vector<std::string> nodePaths;
+    for (size_t c = before.size(); c < after.size(); c++)
+    {
+        tdstProfilerThreadContext *context = after[c];
+        unsigned int nbNodes = context->nodes.size();
+        ZprofilerGetDescendantCalls(context, nbNodes, descendantCalls);
+        ZprofilerGetSelfTimes(context, nbNodes, descendantCalls, inclusiveTimes, selfTimes);
+
+        // Parents come before their children
+        nodePaths.assign(nbNodes, std::string());
+        for (unsigned int node = 1; node < nbNodes; node++)
+        {
+            const tdstProfilerNode &source = context->nodes[node];
+            const char *name = source.siteId < siteNames.size() ? siteNames[source.siteId] : "";
+            nodePaths[node] = source.parent != PROFILER_ROOT_NODE ? nodePaths[source.parent] + ";" + name : name;
+
+            tdstGenProfilerData data = source.data;
+            ZprofilerScaleNodeData(context, source.siteId, data);
+
+            PathStats &stats = paths[nodePaths[node]];
+            ZprofilerMergeData(stats.data, data);
+            ZprofilerMergeHistogram(stats.histogram, context->histograms[node]);
+            stats.selfTime += selfTimes[node];
+        }
+    }
+    return true;
+}
+
+static double variance(const tdstGenProfilerData &data)
+{
+    if (!data.nbCalls)
+        return 0.0;
+    double average = double(data.totalTime) / double(data.nbCalls);
+    double value = data.sumSquares / double(data.nbCalls) - average * average;
+    return value > 0.0 ? value : 0.0;
+}
+
+static double p99(const PathStats &stats)
+{
+    return (double)ZprofilerHistogramPercentile(stats.histogram, stats.data, 0.99);
+}
+
+//
+// Flag of a change of base to current, by relative and absolute thresholds
+//
+static int changeFlag(double base, double current, double percent, double sigma)
+{
+    if (fabs(relative(base, current)) < percent || fabs(sigma) < sigmaThreshold)
+        return 0;
+    return current > base ? FLAG_SLOWER : FLAG_FASTER;
+}
+
+static void comparePath(PathDiff &diff)
+{
+    diff.sigma = 0.0;
+    diff.timeFlag = diff.selfFlag = diff.p99Flag = 0;
+    if (!diff.base || !diff.current)
+        return;
+    const tdstGenProfilerData &base = diff.base->data;
+    const tdstGenProfilerData &current = diff.current->data;
+    if (!base.nbCalls || !current.nbCalls)
+        return;
+
+    // Welch's t on the time per call. Self times don't have their own
+    // variance, the standard error of the inclusive time stands for it.
+    double baseAvg = double(base.totalTime) / double(base.nbCalls);
+    double currentAvg = double(current.totalTime) / double(current.nbCalls);
+    double error = sqrt(variance(base) / double(base.nbCalls) + variance(current) / double(current.nbCalls));
+    double baseSelf = double(diff.base->selfTime) / double(base.nbCalls);
+    double currentSelf = double(diff.current->selfTime) / double(current.nbCalls);
+    diff.sigma = error > 0.0 ? (currentAvg - baseAvg) / error : (currentAvg != baseAvg ? HUGE_VAL : 0.0);
+    double selfSigma = error > 0.0 ? (currentSelf - baseSelf) / error : (currentSelf != baseSelf ? HUGE_VAL : 0.0);
+
+    if (ms(double(std::max(base.totalTime, current.totalTime))) < minMs)
+        return;
+    diff.timeFlag = changeFlag(baseAvg, currentAvg, thresholdPercent, diff.sigma);
+    diff.selfFlag = changeFlag(baseSelf, currentSelf, thresholdPercent, selfSigma);
+    if (base.nbCalls >= minCalls && current.nbCalls >= minCalls)
+        diff.p99Flag = changeFlag(p99(*diff.base), p99(*diff.current), p99ThresholdPercent, HUGE_VAL);
+}
+
+static bool isSlower(const PathDiff &diff)
+{
+    return diff.timeFlag == FLAG_SLOWER || diff.selfFlag == FLAG_SLOWER || diff.p99Flag == FLAG_SLOWER;
+}
+
+static bool isFaster(const PathDiff &diff)
+{
+    return !isSlower(diff) && (diff.timeFlag || diff.selfFlag || diff.p99Flag);
+}
+
+static double selfDelta(const PathDiff &diff)
+{
+    return double(diff.current ? diff.current->selfTime : 0) - double(diff.base ? diff.base->selfTime : 0);
+}
+
+// Slower paths first, then faster ones, then the others, by self time change
+static bool diffLess(const PathDiff &a, const PathDiff &b)
+{
+    int rankA = isSlower(a) ? 0 : (isFaster(a) ? 1 : 2);
+    int rankB = isSlower(b) ? 0 : (isFaster(b) ? 1 : 2);
+    if (rankA != rankB)
+        return rankA < rankB;
+    double deltaA = fabs(selfDelta(a)), deltaB = fabs(selfDelta(b));
+    if (deltaA != deltaB)
+        return deltaA > deltaB;
+    return *a.path < *b.path;
+}
+
+static void appendFlag(std::string &flags, const char *name, int flag)
+{
+    if (!flag)
+        return;
+    flags += flags.empty() ? "" : ",";
+    flags += name;
+    flags += flag == FLAG_SLOWER ? "+" : "-";
+}
+
+static void printDiff(const PathDiff &diff)
+{
+    const PathStats empty;
+    const PathStats &base = diff.base ? *diff.base : empty;
+    const PathStats &current = diff.current ? *diff.current : empty;
+
+    std::string flags;
+    if (!diff.base)
+        flags = "new";
+    else if (!diff.current)
+        flags = "gone";
+    appendFlag(flags, "time", diff.timeFlag);
+    appendFlag(flags, "self", diff.selfFlag);
+    appendFlag(flags, "p99", diff.p99Flag);
+
+    double baseTotal = ms(double(base.data.totalTime)), currentTotal = ms(double(current.data.totalTime));
+    double baseSelf = ms(double(base.selfTime)), currentSelf = ms(double(current.selfTime));
+    double baseP99 = ms(p99(base)), currentP99 = ms(p99(current));
+    printf("| %9lu | %7.1f | %10.3f | %10.3f | %+10.3f | %7.1f | %10.3f | %10.3f | %+10.3f | %7.1f | %9.4f | %9.4f | %7.1f | %7.1f | %-16s | %s\n",
+           current.data.nbCalls, relative(double(base.data.nbCalls), double(current.data.nbCalls)),
+           baseTotal, currentTotal, currentTotal - baseTotal, relative(baseTotal, currentTotal),
+           baseSelf, currentSelf, currentSelf - baseSelf, relative(baseSelf, currentSelf),
+           baseP99, currentP99, relative(baseP99, currentP99),
+           std::max(-99.9, std::min(99.9, diff.sigma)), flags.c_str(), diff.path->c_str());
+}
+
+int main(int argc, const char * argv[])
+{
+    std::vector<const char*> baseNames, currentNames;
+    size_t rows = 50;
+    bool split = false, usage = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-threshold") && i + 1 < argc)
+            thresholdPercent = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-sigma") && i + 1 < argc)
+            sigmaThreshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-p99-threshold") && i + 1 < argc)
+            p99ThresholdPercent = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-min-calls") && i + 1 < argc)
+            minCalls = (unsigned long)atol(argv[++i]);
+        else if (!strcmp(argv[i], "-min-ms") && i + 1 < argc)
+            minMs = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            rows = (size_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--") && !split)
+            split = true;
+        else if (argv[i][0] == '-')
+            usage = true;
+        else
+            (split ? currentNames : baseNames).push_back(argv[i]);
+    }
+    if (!split && baseNames.size() == 2)
+    {
+        currentNames.push_back(baseNames[1]);
+        baseNames.pop_back();
+    }
+    if (usage || baseNames.empty() || currentNames.empty())
+    {
+        fprintf(stderr, "usage: %s [-threshold %%] [-sigma n] [-p99-threshold %%] [-min-calls n] [-min-ms ms] [-n rows] baseline.lprof current.lprof\n"
+                        "       %s [options] baseline.lprof... -- current.lprof...\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    Zprofiler_enable();
+
+    // Saved times already have the overhead of their process taken out
+    gProfilerOverheadTicks = 0.0;
+    gProfilerSelfOverheadTicks = 0.0;
+
+    PathTable basePaths, currentPaths;
+    std::string baseDescription, currentDescription;
+    if (!loadRun(baseNames, basePaths, baseDescription) || !loadRun(currentNames, currentPaths, currentDescription))
+        return 2;
+
+    std::vector<PathDiff> diffs;
+    for (PathTable::const_iterator iter = basePaths.begin(); iter != basePaths.end(); ++iter)
+    {
+        PathDiff diff;
+        diff.path = &iter->first;
+        diff.base = &iter->second;
+        PathTable::const_iterator current = currentPaths.find(iter->first);
+        diff.current = current != currentPaths.end() ? &current->second : NULL;
+        comparePath(diff);
+        diffs.push_back(diff);
+    }
+    for (PathTable::const_iterator iter = currentPaths.begin(); iter != currentPaths.end(); ++iter)
+    {
+        if (basePaths.count(iter->first))
+            continue;
+        PathDiff diff;
+        diff.path = &iter->first;
+        diff.base = NULL;
+        diff.current = &iter->second;
+        comparePath(diff);
+        diffs.push_back(diff);
+    }
+    std::sort(diffs.begin(), diffs.end(), diffLess);
+
+    size_t nbSlower = 0, nbFaster = 0, nbNew = 0, nbGone = 0;
+    for (size_t i = 0; i < diffs.size(); i++)
+    {
+        nbSlower += isSlower(diffs[i]) ? 1 : 0;
+        nbFaster += isFaster(diffs[i]) ? 1 : 0;
+        nbNew += diffs[i].base ? 0 : 1;
+        nbGone += diffs[i].current ? 0 : 1;
+    }
+
+    printf("Baseline: %s\n", baseDescription.c_str());
+    printf("Current:  %s\n", currentDescription.c_str());
+    printf("Flagged: time or self time per call changed by %.1f%% and %.1f sigma, p99 by %.1f%% with %lu calls, paths over %.3f ms\n\n",
+           thresholdPercent, sigmaThreshold, p99ThresholdPercent, minCalls, minMs);
+    printf("Times in ms, changes of current against baseline\n");
+    printf("|   Calls   | Calls %% | Total base | Total cur  | Total diff | Total %% | Self base  | Self cur   | Self diff  | Self %%  | p99 base  | p99 cur   | p99 %%   | Sigma   | Flags            | Path\n");
+    for (size_t i = 0; i < diffs.size(); i++)
+    {
+        // Flagged paths are always shown
+        if (i >= rows && !isSlower(diffs[i]) && !isFaster(diffs[i]))
+        {
+            printf("(%u more paths)\n", (unsigned int)(diffs.size() - i));
+            break;
+        }
+        printDiff(diffs[i]);
+    }
+
+    printf("\n%u slower, %u faster, %u new, %u gone\n", (unsigned int)nbSlower, (unsigned int)nbFaster, (unsigned int)nbNew, (unsigned int)nbGone);
+    return nbSlower ? 1 : 0;
+}
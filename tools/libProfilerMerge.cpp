@@ -0,0 +1,250 @@
+//
+//  libProfilerMerge.cpp
+//  libProfiler
+//
+//  Merges profiles saved by Zprofiler_save_profile, a file per process of a
+//  prefork server or of several machines, into one report: the CALLSTACK and
+//  DUMP of each process with its threads merged, then the sections of all the
+//  processes with their calls summed and their histograms merged. Start times
+//  are lined up with the steady clock between processes of the same host, and
+//  with the system clock between hosts, in the PROCESSES table and the Chrome
+//  trace of the saved timelines.
+//
+//  Built by the CMake project, or:
+//  g++ -O2 -std=c++11 -I.. libProfilerMerge.cpp -o libprofiler-merge -lpthread -lrt
+//  ./libprofiler-merge profile... [-chrome trace.json] [-json report.json] [-csv report.csv] [-folded report.folded]
+//
+//  In the JSON, CSV and folded exports, thread ids are process ids.
+//
+
+#include <stdlib.h>
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_IMPLEMENTATION
+#include "libProfiler.h"
+
+
+struct Process
+{
+    const char *fileName;
+    tdstProfilerSavedProcess saved;
+    uint64_t start;                         // ns since the first process started
+};
+
+// Tables named by process instead of thread
+struct MergeSink : public ZProfilerTextSink
+{
+    MergeSink(ZProfilerReport &textReport, const std::map<unsigned long, std::string> &processNames) : ZProfilerTextSink(textReport), names(processNames) {}
+
+    const char *processName(unsigned long processId)
+    {
+        std::map<unsigned long, std::string>::const_iterator iter = names.find(processId);
+        return iter != names.end() ? iter->second.c_str() : "";
+    }
+
+    void beginTree(unsigned long processId, uint64_t nbRecordsDropped)
+    {
+        report.print("CALLSTACK of Process %s\n", processName(processId));
+        report.end();
+        if (nbRecordsDropped)
+        {
+            report.print("%llu calls dropped, the aggregation queue was full\n", (unsigned long long)nbRecordsDropped);
+            report.end();
+        }
+        writeHeader(report);
+    }
+
+    void beginTable(unsigned long processId, bool allThreads)
+    {
+        if (allThreads)
+        {
+            appendDump();
+            report.print("TOP %u sections by %s, all processes\n", gProfilerTopSections, ZprofilerSortName(gProfilerSortKey));
+            report.end();
+            writeHeader(report);
+            table = &report;
+        }
+        else
+        {
+            dump.print("DUMP of Process %s, by %s\n", processName(processId), ZprofilerSortName(gProfilerSortKey));
+            dump.end();
+            writeHeader(dump);
+            table = &dump;
+        }
+    }
+
+    const std::map<unsigned long, std::string> &names;
+};
+
+//
+// Start of each process on one axis. Steady clocks only compare on the same
+// host, so each host is moved to the system clock by the offset between its
+// clocks in its first profile.
+//
+static void alignProcesses(std::vector<Process> &processes)
+{
+    std::map<std::string, int64_t> hostOffsets;
+    std::vector<int64_t> starts;
+    int64_t first = 0;
+    for (size_t i = 0; i < processes.size(); i++)
+    {
+        const tdstProfilerSavedProcess &saved = processes[i].saved;
+        std::map<std::string, int64_t>::iterator iter = hostOffsets.find(saved.hostName);
+        if (iter == hostOffsets.end())
+            iter = hostOffsets.insert(std::make_pair(saved.hostName, (int64_t)saved.realtimeStart - (int64_t)saved.monotonicStart)).first;
+        starts.push_back((int64_t)saved.monotonicStart + iter->second);
+        first = i ? std::min(first, starts.back()) : starts.back();
+    }
+    for (size_t i = 0; i < processes.size(); i++)
+        processes[i].start = (uint64_t)(starts[i] - first);
+}
+
+static void printProcesses(const std::vector<Process> &processes)
+{
+    printf("PROCESSES, start times lined up\n");
+    printf("%-24s %10s %12s %12s %8s  %s\n", "Host", "Pid", "Start ms", "Duration ms", "Threads", "File");
+    for (size_t i = 0; i < processes.size(); i++)
+    {
+        const Process &process = processes[i];
+        printf("%-24.24s %10lu %12.3f %12.3f %8u  %s\n", process.saved.hostName.c_str(), process.saved.processId, double(process.start) * 1e-6,
+               process.saved.duration, process.saved.nbThreads, process.fileName);
+    }
+    printf("\n");
+}
+
+//
+// Saved timelines as complete events, each process moved to its start
+//
+static bool writeChrome(const char *fileName, const std::vector<Process> &processes)
+{
+    FILE *file = fopen(fileName, "wt");
+    if (!file)
+        return false;
+
+    std::vector<const char*> siteNames;
+    ZprofilerGetSiteNames(siteNames);
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *separator = "";
+    std::vector<const tdstProfilerSavedEvent*> stack;
+    for (size_t i = 0; i < processes.size(); i++)
+    {
+        const Process &process = processes[i];
+        const std::vector<tdstProfilerSavedEvent> &events = process.saved.events;
+        unsigned long processId = process.saved.processId;
+
+        fprintf(file, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":", separator, processId);
+        ZprofilerWriteJsonString(file, (process.saved.hostName + " " + std::to_string(processId)).c_str());
+        fprintf(file, "}}");
+        separator = ",";
+
+        for (size_t e = 0; e < events.size(); e++)
+        {
+            const tdstProfilerSavedEvent &event = events[e];
+            if (!e || events[e - 1].threadId != event.threadId)
+            {
+                stack.clear();
+                fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"Thread %lu\"}}",
+                        processId, event.threadId, event.threadId);
+            }
+            if (event.type == PROFILER_EVENT_BEGIN)
+            {
+                stack.push_back(&event);
+                continue;
+            }
+            if (stack.empty() || stack.back()->siteId != event.siteId)
+                continue;
+
+            const tdstProfilerSavedEvent *begin = stack.back();
+            stack.pop_back();
+
+            fprintf(file, ",\n{\"name\":");
+            ZprofilerWriteJsonString(file, begin->siteId < siteNames.size() ? siteNames[begin->siteId] : "");
+            fprintf(file, ",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}", processId, event.threadId,
+                    double(process.start + begin->time) * 0.001, double(event.time - begin->time) * 0.001);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
+
+int main(int argc, const char * argv[])
+{
+    const char *chromeName = NULL;
+    const char *jsonName = NULL, *csvName = NULL, *foldedName = NULL;
+    std::vector<const char*> fileNames;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-chrome") && i + 1 < argc)
+            chromeName = argv[++i];
+        else if (!strcmp(argv[i], "-json") && i + 1 < argc)
+            jsonName = argv[++i];
+        else if (!strcmp(argv[i], "-csv") && i + 1 < argc)
+            csvName = argv[++i];
+        else if (!strcmp(argv[i], "-folded") && i + 1 < argc)
+            foldedName = argv[++i];
+        else
+            fileNames.push_back(argv[i]);
+    }
+    if (fileNames.empty())
+    {
+        fprintf(stderr, "usage: %s profile... [-chrome trace.json] [-json report.json] [-csv report.csv] [-folded report.folded]\n", argv[0]);
+        return 1;
+    }
+
+    Zprofiler_enable();
+
+    // Saved times already have the overhead of their process taken out
+    gProfilerOverheadTicks = 0.0;
+    gProfilerSelfOverheadTicks = 0.0;
+
+    std::vector<Process> processes;
+    std::map<unsigned long, std::string> processNames;
+    for (size_t i = 0; i < fileNames.size(); i++)
+    {
+        Process process;
+        process.fileName = fileNames[i];
+        process.start = 0;
+        process.saved.nbThreads = 0;
+        if (!Zprofiler_load_profile(fileNames[i], true, process.saved))
+        {
+            fprintf(stderr, "can't read %s, or it is truncated\n", fileNames[i]);
+            if (process.saved.nbThreads == 0)
+                continue;
+        }
+
+        std::string name = std::to_string(process.saved.processId) + " on " + process.saved.hostName;
+        std::string &processName = processNames[process.saved.processId];
+        processName = processName.empty() ? name : processName + ", " + process.saved.hostName;
+        processes.push_back(process);
+    }
+    if (processes.empty())
+        return 1;
+
+    alignProcesses(processes);
+
+    // Rates per second are over the time all the processes span
+    double span = 0.0;
+    for (size_t i = 0; i < processes.size(); i++)
+        span = std::max(span, double(processes[i].start) * 1e-6 + processes[i].saved.duration);
+    gProfilerStartTicks = ZprofilerGetTicks() - (uint64_t)(span * 0.001 * gProfilerTicksPerSecond);
+
+    printProcesses(processes);
+
+    ZProfilerReport report;
+    MergeSink sink(report, processNames);
+    ZprofilerWriteReport(sink, gProfilerTopSections);
+    report.flush();
+
+    if (chromeName && !writeChrome(chromeName, processes))
+        fprintf(stderr, "can't write %s\n", chromeName);
+    if (jsonName && !Zprofiler_export_json(jsonName))
+        fprintf(stderr, "can't write %s\n", jsonName);
+    if (csvName && !Zprofiler_export_csv(csvName))
+        fprintf(stderr, "can't write %s\n", csvName);
+    if (foldedName && !Zprofiler_export_folded(foldedName))
+        fprintf(stderr, "can't write %s\n", foldedName);
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+//
+//  libProfilerTop.cpp
+//  libProfiler
+//
+//  Shows the sections published by a process that called
+//  Zprofiler_start_publishing, refreshed every interval. Only reads the shared
+//  memory: the process isn't stopped nor slowed down.
+//
+//  Built by the CMake project, or:
+//  g++ -O2 -std=c++11 -I.. libProfilerTop.cpp -o libprofiler-top -lpthread -lrt
+//  ./libprofiler-top -pid N | -name /shared [-sort self|p99|total|avg|calls] [-interval ms] [-n rows] [-once]
+//
+
+#include <stdlib.h>
+
+#define USE_PROFILER 1
+#define LIB_PROFILER_IMPLEMENTATION
+#include "libProfiler.h"
+
+
+static int sortKey = PROFILER_SORT_SELF;
+
+static double sortValue(const tdstProfilerSharedSection &section)
+{
+    switch (sortKey)
+    {
+        case PROFILER_SORT_TOTAL:
+            return section.totalTime;
+        case PROFILER_SORT_AVG:
+            return section.avgTime;
+        case PROFILER_SORT_CALLS:
+            return (double)section.nbCalls;
+        case PROFILER_SORT_P99:
+            return section.p99Time;
+        default:
+            return section.selfTime;
+    }
+}
+
+static bool sortLess(const tdstProfilerSharedSection &a, const tdstProfilerSharedSection &b)
+{
+    double valueA = sortValue(a), valueB = sortValue(b);
+    if (valueA != valueB)
+        return valueA > valueB;
+    return strcmp(a.name, b.name) < 0;
+}
+
+static bool parseSortKey(const char *name)
+{
+    static const char *names[] = { "total", "self", "avg", "calls", "p99" };
+    static const int keys[] = { PROFILER_SORT_TOTAL, PROFILER_SORT_SELF, PROFILER_SORT_AVG, PROFILER_SORT_CALLS, PROFILER_SORT_P99 };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        if (!strcmp(name, names[i]))
+        {
+            sortKey = keys[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void printStats(const char *name, tdstProfilerPublishedStats &stats, size_t rows)
+{
+    std::sort(stats.sections.begin(), stats.sections.end(), sortLess);
+
+    printf("%s  pid %lu  %.1f s  %u threads  %u sections  update %llu\n\n", name, stats.processId, stats.time * 0.001,
+           stats.nbThreads, stats.nbSections, (unsigned long long)stats.nbUpdates);
+    printf("%-40s %10s %12s %12s %10s %10s %10s %10s %10s\n", "Section", "Calls", "Total ms", "Self ms", "Avg ms", "p50 ms", "p90 ms", "p99 ms", "Max ms");
+    for (size_t i = 0; i < stats.sections.size() && i < rows; i++)
+    {
+        const tdstProfilerSharedSection &section = stats.sections[i];
+        printf("%-40.40s %10llu %12.3f %12.3f %10.4f %10.4f %10.4f %10.4f %10.4f\n", section.name, (unsigned long long)section.nbCalls,
+               section.totalTime, section.selfTime, section.avgTime, section.p50Time, section.p90Time, section.p99Time, section.maxTime);
+    }
+    if (stats.nbSections > stats.sections.size())
+        printf("(%u sections not published)\n", stats.nbSections - (unsigned int)stats.sections.size());
+}
+
+int main(int argc, const char * argv[])
+{
+    std::string name;
+    unsigned int interval = 1000;
+    size_t rows = 30;
+    bool once = false, usage = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-pid") && i + 1 < argc)
+            name = std::string("/libprofiler.") + argv[++i];
+        else if (!strcmp(argv[i], "-name") && i + 1 < argc)
+            name = argv[++i];
+        else if (!strcmp(argv[i], "-sort") && i + 1 < argc && parseSortKey(argv[i + 1]))
+            i++;
+        else if (!strcmp(argv[i], "-interval") && i + 1 < argc)
+            interval = (unsigned int)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            rows = (size_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-once"))
+            once = true;
+        else
+            usage = true;
+    }
+    if (usage || name.empty())
+    {
+        fprintf(stderr, "usage: %s -pid N | -name /shared [-sort self|p99|total|avg|calls] [-interval ms] [-n rows] [-once]\n", argv[0]);
+        return 1;
+    }
+    if (interval < 10)
+        interval = 10;
+
+    tdstProfilerPublishedStats stats;
+    for (;;)
+    {
+        if (!Zprofiler_read_published(name.c_str(), stats))
+        {
+            fprintf(stderr, "can't read %s\n", name.c_str());
+            return 1;
+        }
+        if (!once)
+            printf("\x1b[H\x1b[2J");
+        printStats(name.c_str(), stats, rows);
+        fflush(stdout);
+        if (once)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+    }
+
+    return 0;
+}